@@ -7,13 +7,28 @@
 
 #include <algorithm>
 #include <assert.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
 #include <iterator>
 #include <limits.h>
 #include <limits>
+#include <list>
 #include <memory>
+#include <mutex>
+#include <numeric>
 #include <sstream>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
 
 #include "google/cloud/rest_options.h"
 #include "google/cloud/storage/client.h"
@@ -24,8 +39,29 @@
 #include <boost/uuid/uuid_generators.hpp> // generators
 #include <boost/uuid/uuid_io.hpp>         // streaming operators etc.
 
+// The debug and trace messages are compiled in, unless the build sets a
+// higher SPDLOG_ACTIVE_LEVEL
+#ifndef SPDLOG_ACTIVE_LEVEL
+#define SPDLOG_ACTIVE_LEVEL SPDLOG_LEVEL_TRACE
+#endif
+#include "spdlog/async.h"
+#include "spdlog/sinks/stdout_color_sinks.h"
 #include "spdlog/spdlog.h"
 
+#include <crc32c/crc32c.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <zlib.h>
+#include <zstd.h>
+
 using namespace gcsplugin;
 
 namespace gc = ::google::cloud;
@@ -63,6 +99,43 @@ HandleContainer active_handles;
     return (err_val);                                                          \
   }
 
+// Logging of the hot paths, run on each read, write or seek: the message is
+// compiled out above SPDLOG_ACTIVE_LEVEL, and its arguments are not evaluated
+// when the debug level is not enabled
+#define LOG_HOT_DEBUG(...)                                                     \
+  do {                                                                         \
+    if (spdlog::should_log(spdlog::level::debug)) {                            \
+      SPDLOG_DEBUG(__VA_ARGS__);                                               \
+    }                                                                          \
+  } while (0)
+
+// With GCS_DRIVER_LOG_ASYNC set, the messages are queued to a thread of spdlog
+// that writes them, so that the transfers of a debug or trace run do not wait
+// for the console. The oldest messages are dropped when the queue is full.
+constexpr size_t async_log_queue_size{8192};
+std::shared_ptr<spdlog::logger> syncLogger; // replaced by the async logger
+
+void UseAsyncLogger() {
+  if (syncLogger) {
+    return;
+  }
+  syncLogger = spdlog::default_logger();
+  spdlog::init_thread_pool(async_log_queue_size, 1);
+  spdlog::set_default_logger(std::make_shared<spdlog::async_logger>(
+      syncLogger->name(), syncLogger->sinks().begin(),
+      syncLogger->sinks().end(), spdlog::thread_pool(),
+      spdlog::async_overflow_policy::overrun_oldest));
+}
+
+void UseSyncLogger() {
+  if (!syncLogger) {
+    return;
+  }
+  spdlog::set_default_logger(std::move(syncLogger));
+  // the writing thread ends once the queued messages are written
+  spdlog::details::registry::instance().set_tp(nullptr);
+}
+
 void LogError(const std::string &msg) {
   lastError = msg;
   spdlog::error(lastError);
@@ -97,243 +170,3480 @@ Handle *InsertHandle(VariantPtr &&var_ptr) {
       ->get();
 }
 
-HandleIt FindHandle(void *handle) {
-  return std::find_if(active_handles.begin(), active_handles.end(),
-                      [handle](const HandlePtr &act_h_ptr) {
-                        return handle == static_cast<void *>(act_h_ptr.get());
-                      });
+HandleIt FindHandle(void *handle) {
+  return std::find_if(active_handles.begin(), active_handles.end(),
+                      [handle](const HandlePtr &act_h_ptr) {
+                        return handle == static_cast<void *>(act_h_ptr.get());
+                      });
+}
+
+void EraseRemove(HandleIt pos) {
+  *pos = std::move(active_handles.back());
+  active_handles.pop_back();
+}
+
+// Definition of helper functions
+
+using Clock = std::chrono::steady_clock;
+
+// Stalled transfers
+//
+// The client library aborts a request whose throughput stays below a floor
+// for a window of time, the download is then resumed (see below) and the
+// upload retried by the library. The floor is GCS_STALL_MIN_RATE bytes/s
+// (default 1 KiB/s). The window is GCS_STALL_TIMEOUT seconds when set,
+// otherwise it is derived from the observed delays to receive the first chunk
+// of a download: 4 times their 99th percentile, within 2s and 120s.
+constexpr long long default_stall_min_rate{1024};
+long long stallMinRate{default_stall_min_rate};
+long long stallTimeout{0}; // seconds, adaptive if 0
+constexpr size_t stall_nb_samples{256};
+constexpr size_t stall_min_samples{16};
+constexpr auto stall_min_window = std::chrono::seconds(2);
+constexpr auto stall_max_window = std::chrono::seconds(120);
+
+std::atomic<long long> nbStalledRequests{0};
+
+std::mutex first_chunk_mutex;
+std::vector<Clock::duration> first_chunk_samples;
+size_t first_chunk_next{0};
+
+void RecordFirstChunkDelay(Clock::duration delay) {
+  std::lock_guard<std::mutex> lock{first_chunk_mutex};
+  if (first_chunk_samples.size() < stall_nb_samples) {
+    first_chunk_samples.push_back(delay);
+  } else {
+    first_chunk_samples[first_chunk_next] = delay;
+    first_chunk_next = (first_chunk_next + 1) % stall_nb_samples;
+  }
+}
+
+std::chrono::seconds GetStallWindow() {
+  if (stallTimeout > 0) {
+    return std::chrono::seconds(stallTimeout);
+  }
+
+  std::vector<Clock::duration> samples;
+  {
+    std::lock_guard<std::mutex> lock{first_chunk_mutex};
+    if (first_chunk_samples.size() < stall_min_samples) {
+      return stall_max_window;
+    }
+    samples = first_chunk_samples;
+  }
+  const size_t rank =
+      std::min(samples.size() - 1, samples.size() * 99 / 100);
+  std::nth_element(samples.begin(), samples.begin() + rank, samples.end());
+  // round up to the second, the unit of the option
+  const auto window = std::chrono::duration_cast<std::chrono::seconds>(
+      4 * samples[rank] + std::chrono::seconds(1) - Clock::duration(1));
+  return std::min(stall_max_window, std::max(stall_min_window, window));
+}
+
+gc::Options MakeDownloadStallOptions() {
+  return gc::Options{}
+      .set<gcs::DownloadStallTimeoutOption>(GetStallWindow())
+      .set<gcs::DownloadStallMinimumRateOption>(
+          static_cast<std::uint32_t>(stallMinRate));
+}
+
+gc::Options MakeUploadStallOptions() {
+  return gc::Options{}
+      .set<gcs::TransferStallTimeoutOption>(GetStallWindow())
+      .set<gcs::TransferStallMinimumRateOption>(
+          static_cast<std::uint32_t>(stallMinRate));
+}
+
+// Transient failures of a download are resumed by a new request starting at
+// the first missing byte, pinned to the generation of the object so that the
+// bytes come from the same content. Default value below can be overriden by
+// setting GCS_READ_RESUME_ATTEMPTS: it is the number of successive requests
+// allowed to fail without delivering any byte.
+constexpr long long default_read_resume_attempts = 5;
+long long readResumeAttempts{default_read_resume_attempts};
+constexpr auto read_resume_backoff = std::chrono::milliseconds(100);
+constexpr auto read_resume_max_backoff = std::chrono::milliseconds(5000);
+// The count of bytes delivered by a read that fails is lost, the reads are
+// split in chunks to bound the bytes downloaded again on a resume
+constexpr std::int64_t read_resume_chunk_size{1024 * 1024};
+
+bool IsTransientFailure(const gc::Status &status) {
+  switch (status.code()) {
+  case gc::StatusCode::kUnavailable:
+  case gc::StatusCode::kDeadlineExceeded:
+  case gc::StatusCode::kInternal:
+  case gc::StatusCode::kResourceExhausted:
+  case gc::StatusCode::kAborted:
+    return true;
+  default:
+    return false;
+  }
+}
+
+gcs::Generation MakeGenerationOption(std::int64_t generation) {
+  return generation != 0 ? gcs::Generation(generation) : gcs::Generation();
+}
+
+// Read the bytes [start_range, end_range) of an object into buffer, from a
+// stream opened at start_range by a request sent at request_start
+gc::StatusOr<long long int>
+ReadStreamToBuffer(gcs::ObjectReadStream &reader, const std::string &bucket_name,
+                   const std::string &object_name, std::int64_t generation,
+                   char *buffer, std::int64_t start_range,
+                   std::int64_t end_range, Clock::time_point request_start) {
+  const std::int64_t size = end_range - start_range;
+  std::int64_t num_read{0};
+  long long nb_stalled{0};
+  auto backoff = read_resume_backoff;
+
+  std::int64_t num_read_before{0}; // by the previous request
+  bool first_chunk{true};
+  while (num_read < size) {
+    const std::int64_t chunk_size =
+        std::min(read_resume_chunk_size, size - num_read);
+    reader.read(buffer + num_read, chunk_size);
+    const std::int64_t chunk_read = static_cast<std::int64_t>(reader.gcount());
+    num_read += chunk_read;
+    if (!reader.bad()) {
+      if (first_chunk) {
+        RecordFirstChunkDelay(Clock::now() - request_start);
+        first_chunk = false;
+      }
+      if (chunk_read < chunk_size) {
+        break; // end of the object
+      }
+      continue;
+    }
+
+    const gc::Status status = reader.status();
+    if (gc::StatusCode::kDeadlineExceeded == status.code()) {
+      nbStalledRequests++;
+    }
+    nb_stalled = num_read > num_read_before ? 0 : nb_stalled + 1;
+    num_read_before = num_read;
+    if (!IsTransientFailure(status) || nb_stalled > readResumeAttempts) {
+      return gc::Status{status.code(), "Error while creating reading stream; " +
+                                           status.message()};
+    }
+
+    if (generation == 0) {
+      const auto received_generation = reader.received_generation();
+      generation = received_generation.value_or(0);
+    }
+    if (nb_stalled > 0) {
+      std::this_thread::sleep_for(backoff);
+      backoff = std::min(2 * backoff, read_resume_max_backoff);
+    }
+    spdlog::warn("Resuming the download of {} at byte {}: {}", object_name,
+                 start_range + num_read, status.message());
+
+    request_start = Clock::now();
+    first_chunk = true;
+    reader = client.ReadObject(bucket_name, object_name,
+                               gcs::ReadRange(start_range + num_read, end_range),
+                               MakeGenerationOption(generation),
+                               gcs::AcceptEncodingGzip(),
+                               MakeDownloadStallOptions());
+  }
+
+  LOG_HOT_DEBUG("read = {}", num_read);
+  return static_cast<long long int>(num_read);
+}
+
+gc::StatusOr<long long int>
+DownloadRangeOnce(const std::string &bucket_name,
+                  const std::string &object_name, std::int64_t generation,
+                  char *buffer, std::int64_t start_range,
+                  std::int64_t end_range) {
+  // the stored bytes: the objects stored with Content-Encoding: gzip are
+  // otherwise transcoded by the service, which then ignores the range
+  const auto request_start = Clock::now();
+  auto reader = client.ReadObject(bucket_name, object_name,
+                                  gcs::ReadRange(start_range, end_range),
+                                  MakeGenerationOption(generation),
+                                  gcs::AcceptEncodingGzip(),
+                                  MakeDownloadStallOptions());
+  return ReadStreamToBuffer(reader, bucket_name, object_name, generation,
+                            buffer, start_range, end_range, request_start);
+}
+
+// Hedged reads
+//
+// When GCS_HEDGE_READS is set, a ranged read that has not received its first
+// byte after a delay sends a duplicate request, and the first request to
+// deliver a byte gets the buffer. The other one is dropped as soon as it
+// answers, closing its connection. The delay is the GCS_HEDGE_PERCENTILE
+// (default 95) of the observed times to first byte, and the hedges are capped
+// to GCS_HEDGE_MAX_PERCENT (default 5) of the requests.
+bool hedgeReads{false};
+long long hedgePercentile{95};
+long long hedgeMaxPercent{5};
+constexpr size_t hedge_nb_samples{256};
+constexpr size_t hedge_min_samples{16};
+constexpr auto hedge_min_delay = std::chrono::milliseconds(10);
+
+std::atomic<long long> nbRangeRequests{0};
+std::atomic<long long> nbHedgedRequests{0};
+std::atomic<long long> nbHedgeWins{0};
+
+// The first request of a hedged read runs on the calling thread. The hedge is
+// sent by a thread waiting for the delay, that ends at once when the first
+// request answers in time. A dropped hedge still runs when the read returns,
+// the driver waits for these threads on disconnection, before it can be
+// unloaded.
+std::mutex hedge_running_mutex;
+std::condition_variable hedge_running_cv;
+int nbHedgeAttemptsRunning{0};
+
+std::mutex first_byte_mutex;
+std::vector<Clock::duration> first_byte_samples;
+size_t first_byte_next{0};
+
+void RecordFirstByteDelay(Clock::duration delay) {
+  std::lock_guard<std::mutex> lock{first_byte_mutex};
+  if (first_byte_samples.size() < hedge_nb_samples) {
+    first_byte_samples.push_back(delay);
+  } else {
+    first_byte_samples[first_byte_next] = delay;
+    first_byte_next = (first_byte_next + 1) % hedge_nb_samples;
+  }
+}
+
+// Returns false while there are too few samples to decide on a delay
+bool GetHedgeDelay(Clock::duration &delay) {
+  std::vector<Clock::duration> samples;
+  {
+    std::lock_guard<std::mutex> lock{first_byte_mutex};
+    if (first_byte_samples.size() < hedge_min_samples) {
+      return false;
+    }
+    samples = first_byte_samples;
+  }
+  const size_t rank = std::min(
+      samples.size() - 1,
+      static_cast<size_t>(samples.size() * hedgePercentile / 100));
+  std::nth_element(samples.begin(), samples.begin() + rank, samples.end());
+  delay = std::max<Clock::duration>(samples[rank], hedge_min_delay);
+  return true;
+}
+
+bool TakeHedgeBudget() {
+  const long long nb_requests = nbRangeRequests;
+  long long nb_hedged = nbHedgedRequests;
+  while (nb_hedged * 100 < hedgeMaxPercent * nb_requests) {
+    if (nbHedgedRequests.compare_exchange_weak(nb_hedged, nb_hedged + 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+namespace gcsplugin {
+// State shared by the requests of a hedged read, that may outlive the read
+struct HedgeRace {
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  char *buffer_{nullptr}; // written only by the winner
+  int winner_{-1};
+  int nb_launched_{0};
+  int nb_failed_{0};
+  bool done_{false};
+  gc::StatusOr<long long int> result_;
+};
+} // namespace gcsplugin
+
+void RunHedgeAttemptImpl(const std::shared_ptr<HedgeRace> &race, int attempt,
+                         const std::string &bucket_name,
+                         const std::string &object_name,
+                         std::int64_t generation, std::int64_t start_range,
+                         std::int64_t end_range) {
+  const auto t0 = Clock::now();
+  auto reader = client.ReadObject(bucket_name, object_name,
+                                  gcs::ReadRange(start_range, end_range),
+                                  MakeGenerationOption(generation),
+                                  gcs::AcceptEncodingGzip(),
+                                  MakeDownloadStallOptions());
+  char first{0};
+  if (reader) {
+    reader.read(&first, 1);
+  }
+  const bool failed = !reader.status().ok() || reader.bad();
+
+  std::unique_lock<std::mutex> lock{race->mutex_};
+  if (race->winner_ != -1) {
+    // lost the race, drop the request
+    return;
+  }
+  if (failed) {
+    race->nb_failed_++;
+    if (race->nb_failed_ == race->nb_launched_) {
+      auto &o_status = reader.status();
+      race->result_ = gc::Status{o_status.code(),
+                                 "Error while creating reading stream; " +
+                                     o_status.message()};
+      race->done_ = true;
+    }
+    race->cv_.notify_all();
+    return;
+  }
+
+  race->winner_ = attempt;
+  race->cv_.notify_all();
+  char *buffer = race->buffer_;
+  lock.unlock();
+
+  RecordFirstByteDelay(Clock::now() - t0);
+  if (attempt > 0) {
+    nbHedgeWins++;
+  }
+
+  gc::StatusOr<long long int> result{reader.gcount()};
+  if (*result == 1) {
+    buffer[0] = first;
+    result = ReadStreamToBuffer(reader, bucket_name, object_name, generation,
+                                buffer + 1, start_range + 1, end_range, t0);
+    if (result) {
+      *result += 1;
+    }
+  }
+
+  lock.lock();
+  race->result_ = std::move(result);
+  race->done_ = true;
+  race->cv_.notify_all();
+}
+
+// Send the hedge if the first request has not answered after the delay
+void RunHedge(std::shared_ptr<HedgeRace> race, Clock::duration delay,
+              std::string bucket_name, std::string object_name,
+              std::int64_t generation, std::int64_t start_range,
+              std::int64_t end_range) {
+  bool hedge{false};
+  {
+    std::unique_lock<std::mutex> lock{race->mutex_};
+    if (!race->cv_.wait_for(lock, delay, [&race]() {
+          return race->winner_ != -1 || race->done_;
+        }) &&
+        TakeHedgeBudget()) {
+      race->nb_launched_++;
+      hedge = true;
+    }
+  }
+  if (hedge) {
+    spdlog::debug("Hedging read of {} [{}, {}) after {} ms", object_name,
+                  start_range, end_range,
+                  std::chrono::duration_cast<std::chrono::milliseconds>(delay)
+                      .count());
+    RunHedgeAttemptImpl(race, 1, bucket_name, object_name, generation,
+                        start_range, end_range);
+  }
+  std::lock_guard<std::mutex> lock{hedge_running_mutex};
+  nbHedgeAttemptsRunning--;
+  hedge_running_cv.notify_all();
+}
+
+void WaitForHedgeAttempts() {
+  std::unique_lock<std::mutex> lock{hedge_running_mutex};
+  hedge_running_cv.wait(lock, []() { return nbHedgeAttemptsRunning == 0; });
+}
+
+gc::StatusOr<long long int>
+HedgedDownloadRange(const std::string &bucket_name,
+                    const std::string &object_name, std::int64_t generation,
+                    char *buffer, std::int64_t start_range,
+                    std::int64_t end_range) {
+  auto race = std::make_shared<HedgeRace>();
+  race->buffer_ = buffer;
+  race->nb_launched_ = 1;
+
+  Clock::duration delay;
+  if (GetHedgeDelay(delay)) {
+    {
+      std::lock_guard<std::mutex> running_lock{hedge_running_mutex};
+      nbHedgeAttemptsRunning++;
+    }
+    try {
+      std::thread(RunHedge, race, delay, bucket_name, object_name, generation,
+                  start_range, end_range)
+          .detach();
+    } catch (const std::system_error &e) {
+      spdlog::debug("Reading {} without hedge, no more threads: {}",
+                    object_name, e.what());
+      std::lock_guard<std::mutex> running_lock{hedge_running_mutex};
+      nbHedgeAttemptsRunning--;
+    }
+  }
+  RunHedgeAttemptImpl(race, 0, bucket_name, object_name, generation,
+                      start_range, end_range);
+
+  // the buffer is written until the winner is done, the hedge may have won
+  std::unique_lock<std::mutex> lock{race->mutex_};
+  race->cv_.wait(lock, [&race]() { return race->done_; });
+  return race->result_;
+}
+
+gc::StatusOr<long long int>
+RequestFileRange(const std::string &bucket_name, const std::string &object_name,
+                 char *buffer, std::int64_t start_range, std::int64_t end_range,
+                 std::int64_t generation) {
+  nbRangeRequests++;
+  if (!hedgeReads || end_range <= start_range) {
+    return DownloadRangeOnce(bucket_name, object_name, generation, buffer,
+                             start_range, end_range);
+  }
+  return HedgedDownloadRange(bucket_name, object_name, generation, buffer,
+                             start_range, end_range);
+}
+
+// Single-flight requests
+//
+// The concurrent requests of ranges of the same object generation, e.g. from
+// handles reading a shared header or from prefetches, are coalesced: a range
+// contained in one being downloaded waits for it and gets its bytes from the
+// downloading thread instead of being requested again. When that download
+// fails, the waiting ranges are requested on their own.
+namespace gcsplugin {
+struct RangeWaiter {
+  char *buffer_;
+  std::int64_t start_;
+  std::int64_t end_;
+  bool done_{false};
+  bool ok_{false};
+  long long read_{0};
+};
+
+struct InFlightRange {
+  std::int64_t start_;
+  std::int64_t end_;
+  std::vector<RangeWaiter *> waiters_;
+};
+} // namespace gcsplugin
+
+std::mutex in_flight_mutex;
+std::condition_variable in_flight_cv;
+std::unordered_multimap<std::string, InFlightRange *> in_flight_ranges;
+std::atomic<long long> nbCoalescedRequests{0};
+
+std::string MakeObjectKey(const std::string &bucket, const std::string &name,
+                          std::int64_t generation) {
+  return bucket + '/' + name + '#' + std::to_string(generation);
+}
+
+// Hand the bytes of a completed download to the ranges waiting for it
+void CompleteInFlightRange(const std::string &key, InFlightRange &range,
+                           const char *buffer,
+                           const gc::StatusOr<long long int> &maybe_read) {
+  {
+    std::lock_guard<std::mutex> lock{in_flight_mutex};
+    auto found = in_flight_ranges.equal_range(key);
+    for (auto it = found.first; it != found.second; ++it) {
+      if (it->second == &range) {
+        in_flight_ranges.erase(it);
+        break;
+      }
+    }
+    if (range.waiters_.empty()) {
+      return;
+    }
+    for (RangeWaiter *waiter : range.waiters_) {
+      if (maybe_read) {
+        const std::int64_t available = range.start_ + *maybe_read;
+        const long long copied = std::max<std::int64_t>(
+            std::min(waiter->end_, available) - waiter->start_, 0);
+        if (copied > 0) {
+          std::memcpy(waiter->buffer_, buffer + (waiter->start_ - range.start_),
+                      static_cast<size_t>(copied));
+        }
+        waiter->read_ = copied;
+        waiter->ok_ = true;
+      }
+      waiter->done_ = true;
+    }
+  }
+  in_flight_cv.notify_all();
+}
+
+gc::StatusOr<long long int>
+DownloadRangeSingleFlight(const std::string &bucket_name,
+                          const std::string &object_name, char *buffer,
+                          std::int64_t start_range, std::int64_t end_range,
+                          std::int64_t generation) {
+  if (end_range <= start_range) {
+    return RequestFileRange(bucket_name, object_name, buffer, start_range,
+                            end_range, generation);
+  }
+
+  const std::string key = MakeObjectKey(bucket_name, object_name, generation);
+  InFlightRange range{start_range, end_range, {}};
+  bool in_flight{false};
+  {
+    std::unique_lock<std::mutex> lock{in_flight_mutex};
+    InFlightRange *covering{nullptr};
+    auto found = in_flight_ranges.equal_range(key);
+    for (auto it = found.first; it != found.second; ++it) {
+      if (it->second->start_ <= start_range && end_range <= it->second->end_) {
+        covering = it->second;
+        break;
+      }
+    }
+
+    if (covering) {
+      RangeWaiter waiter{buffer, start_range, end_range};
+      covering->waiters_.push_back(&waiter);
+      nbCoalescedRequests++;
+      in_flight_cv.wait(lock, [&waiter]() { return waiter.done_; });
+      if (waiter.ok_) {
+        return waiter.read_;
+      }
+    } else {
+      in_flight_ranges.emplace(key, &range);
+      in_flight = true;
+    }
+  }
+
+  auto maybe_read = RequestFileRange(bucket_name, object_name, buffer,
+                                     start_range, end_range, generation);
+  if (in_flight) {
+    CompleteInFlightRange(key, range, buffer, maybe_read);
+  }
+  return maybe_read;
+}
+
+// Shared block cache
+//
+// With GCS_SHARED_CACHE_SIZE set (in bytes, 0 to disable), the blocks of
+// GCS_SHARED_CACHE_BLOCK_SIZE bytes read from the objects of known generation
+// are kept in a shared memory segment, named by GCS_SHARED_CACHE_NAME, that
+// the instances of the driver of the host attach to when connecting. A block
+// downloaded by one of the processes of a Khiops run is read from memory by
+// the others.
+//
+// The segment is a fixed table of slots holding one block each. A block is
+// stored in one of the slots of a small window given by the hash of its key,
+// in place of the oldest one. Each slot has a sequence number, odd while the
+// slot is written: a reader checks the number did not change while it copied
+// the block, a writer takes the slot by making its number odd and gives up if
+// another writer has it. The segment outlives the processes and serves the
+// next runs, until it is removed (from /dev/shm on Linux).
+constexpr long long default_shared_cache_block_size{1024 * 1024};
+constexpr std::uint64_t shared_cache_magic{0x4b47435342433031ULL};
+constexpr size_t shared_cache_window{8};
+constexpr size_t shared_cache_alignment{4096};
+
+long long sharedCacheSize{0};
+long long sharedCacheBlockSize{default_shared_cache_block_size};
+std::string sharedCacheName;
+
+std::atomic<long long> nbSharedCacheHits{0};
+std::atomic<long long> nbSharedCacheMisses{0};
+
+namespace gcsplugin {
+struct SharedCacheHeader {
+  std::atomic<std::uint64_t> magic_; // set once the segment is initialized
+  std::uint64_t block_size_;
+  std::uint64_t nb_slots_;
+  std::atomic<std::uint64_t> clock_; // stamps of the writes
+};
+
+struct alignas(64) SharedCacheSlot {
+  std::atomic<std::uint64_t> sequence_; // odd while written
+  std::atomic<std::uint64_t> stamp_;
+  std::atomic<std::uint64_t> key_[2]; // 0 if empty
+  std::atomic<std::int64_t> length_;
+};
+
+struct SharedCacheKey {
+  std::uint64_t hashes_[2];
+};
+} // namespace gcsplugin
+
+void *sharedCacheSegment{nullptr};
+size_t sharedCacheSegmentSize{0};
+SharedCacheHeader *sharedCacheHeader{nullptr};
+SharedCacheSlot *sharedCacheSlots{nullptr};
+char *sharedCacheBlocks{nullptr};
+
+size_t GetSharedCacheBlocksOffset(std::uint64_t nb_slots) {
+  const size_t slots_end = sizeof(SharedCacheSlot) * (1 + nb_slots);
+  return (slots_end + shared_cache_alignment - 1) / shared_cache_alignment *
+         shared_cache_alignment;
+}
+
+void DetachSharedCache() {
+#ifndef _WIN32
+  if (sharedCacheSegment) {
+    munmap(sharedCacheSegment, sharedCacheSegmentSize);
+  }
+#endif
+  sharedCacheSegment = nullptr;
+  sharedCacheSegmentSize = 0;
+  sharedCacheHeader = nullptr;
+  sharedCacheSlots = nullptr;
+  sharedCacheBlocks = nullptr;
+}
+
+// Wait for another process to complete the initialization of the segment
+template <typename Predicate> bool WaitForSharedCache(Predicate ready) {
+  for (int i = 0; i < 100; i++) {
+    if (ready()) {
+      return true;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  return ready();
+}
+
+void AttachSharedCache() {
+  DetachSharedCache();
+  if (sharedCacheSize <= 0) {
+    return;
+  }
+#ifdef _WIN32
+  spdlog::warn("The shared cache is not supported on Windows, GCS_SHARED_CACHE_SIZE is ignored");
+#else
+  const std::uint64_t block_size =
+      static_cast<std::uint64_t>(sharedCacheBlockSize);
+  const std::uint64_t nb_slots =
+      static_cast<std::uint64_t>(sharedCacheSize) / block_size;
+  if (0 == nb_slots) {
+    spdlog::warn("GCS_SHARED_CACHE_SIZE is smaller than a block, the shared "
+                 "cache is disabled");
+    return;
+  }
+  const size_t blocks_offset = GetSharedCacheBlocksOffset(nb_slots);
+  const size_t segment_size =
+      blocks_offset + static_cast<size_t>(nb_slots * block_size);
+
+  bool created{true};
+  int fd = shm_open(sharedCacheName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd < 0 && EEXIST == errno) {
+    created = false;
+    fd = shm_open(sharedCacheName.c_str(), O_RDWR, 0600);
+  }
+  if (fd < 0) {
+    spdlog::warn("Cannot open the shared cache {}: {}", sharedCacheName,
+                 std::strerror(errno));
+    return;
+  }
+
+  bool sized{false};
+  if (created) {
+    sized = ftruncate(fd, static_cast<off_t>(segment_size)) == 0;
+  } else {
+    sized = WaitForSharedCache([fd, segment_size]() {
+      struct stat st;
+      return fstat(fd, &st) == 0 &&
+             static_cast<size_t>(st.st_size) == segment_size;
+    });
+  }
+  void *segment = sized ? mmap(nullptr, segment_size, PROT_READ | PROT_WRITE,
+                               MAP_SHARED, fd, 0)
+                        : MAP_FAILED;
+  close(fd);
+  if (MAP_FAILED == segment) {
+    spdlog::warn("Cannot map the shared cache {}, it is disabled. A segment "
+                 "of another size may exist already.",
+                 sharedCacheName);
+    return;
+  }
+
+  // the memory of a new segment is zeroed: all the slots are empty
+  SharedCacheHeader *header = static_cast<SharedCacheHeader *>(segment);
+  if (created) {
+    header->block_size_ = block_size;
+    header->nb_slots_ = nb_slots;
+    header->magic_.store(shared_cache_magic, std::memory_order_release);
+  } else if (!WaitForSharedCache([header]() {
+               return header->magic_.load(std::memory_order_acquire) ==
+                      shared_cache_magic;
+             }) ||
+             header->block_size_ != block_size ||
+             header->nb_slots_ != nb_slots) {
+    spdlog::warn("The shared cache {} has another layout, it is disabled",
+                 sharedCacheName);
+    munmap(segment, segment_size);
+    return;
+  }
+
+  sharedCacheSegment = segment;
+  sharedCacheSegmentSize = segment_size;
+  sharedCacheHeader = header;
+  sharedCacheSlots = reinterpret_cast<SharedCacheSlot *>(
+      static_cast<char *>(segment) + sizeof(SharedCacheSlot));
+  sharedCacheBlocks = static_cast<char *>(segment) + blocks_offset;
+  spdlog::debug("Attached to the shared cache {}: {} blocks of {} bytes",
+                sharedCacheName, nb_slots, block_size);
+#endif
+}
+
+// FNV-1a, with two bases for the two hashes of the keys
+std::uint64_t HashSharedCacheKey(const std::string &key, std::uint64_t hash) {
+  for (const char c : key) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 1099511628211ULL;
+  }
+  return hash | 1;
+}
+
+SharedCacheKey MakeSharedCacheKey(const std::string &object_key,
+                                  std::int64_t block_idx) {
+  const std::string key = object_key + '@' + std::to_string(block_idx);
+  return SharedCacheKey{{HashSharedCacheKey(key, 14695981039346656037ULL),
+                         HashSharedCacheKey(key, 9650029242287828579ULL)}};
+}
+
+// Copy bytes [offset, offset + size) of a cached block, returns the length of
+// the block or -1 if it is not in the cache
+long long ReadSharedBlock(const SharedCacheKey &key, std::int64_t offset,
+                          char *buffer, std::int64_t size) {
+  const std::uint64_t nb_slots = sharedCacheHeader->nb_slots_;
+  const std::int64_t block_size =
+      static_cast<std::int64_t>(sharedCacheHeader->block_size_);
+  const std::uint64_t window =
+      std::min<std::uint64_t>(shared_cache_window, nb_slots);
+  for (std::uint64_t i = 0; i < window; i++) {
+    const std::uint64_t slot_idx = (key.hashes_[0] + i) % nb_slots;
+    SharedCacheSlot &slot = sharedCacheSlots[slot_idx];
+    const std::uint64_t sequence =
+        slot.sequence_.load(std::memory_order_acquire);
+    if ((sequence & 1) != 0 ||
+        slot.key_[0].load(std::memory_order_relaxed) != key.hashes_[0] ||
+        slot.key_[1].load(std::memory_order_relaxed) != key.hashes_[1]) {
+      continue;
+    }
+    const std::int64_t length = slot.length_.load(std::memory_order_relaxed);
+    if (length < 0 || length > block_size) {
+      continue;
+    }
+    const std::int64_t copied =
+        std::max<std::int64_t>(std::min(size, length - offset), 0);
+    if (copied > 0) {
+      std::memcpy(buffer, sharedCacheBlocks + slot_idx * block_size + offset,
+                  static_cast<size_t>(copied));
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (slot.sequence_.load(std::memory_order_relaxed) == sequence) {
+      return length;
+    }
+  }
+  return -1;
+}
+
+void WriteSharedBlock(const SharedCacheKey &key, const char *data,
+                      std::int64_t length) {
+  const std::uint64_t nb_slots = sharedCacheHeader->nb_slots_;
+  const std::uint64_t window =
+      std::min<std::uint64_t>(shared_cache_window, nb_slots);
+
+  // an empty slot, or else the oldest one
+  std::uint64_t slot_idx = key.hashes_[0] % nb_slots;
+  std::uint64_t oldest = std::numeric_limits<std::uint64_t>::max();
+  for (std::uint64_t i = 0; i < window; i++) {
+    const std::uint64_t idx = (key.hashes_[0] + i) % nb_slots;
+    SharedCacheSlot &slot = sharedCacheSlots[idx];
+    const std::uint64_t first = slot.key_[0].load(std::memory_order_relaxed);
+    if (first == key.hashes_[0] &&
+        slot.key_[1].load(std::memory_order_relaxed) == key.hashes_[1]) {
+      return;
+    }
+    const std::uint64_t stamp =
+        first == 0 ? 0 : slot.stamp_.load(std::memory_order_relaxed);
+    if (stamp < oldest) {
+      oldest = stamp;
+      slot_idx = idx;
+    }
+  }
+
+  SharedCacheSlot &slot = sharedCacheSlots[slot_idx];
+  std::uint64_t sequence = slot.sequence_.load(std::memory_order_relaxed);
+  if ((sequence & 1) != 0 ||
+      !slot.sequence_.compare_exchange_strong(sequence, sequence + 1,
+                                              std::memory_order_relaxed)) {
+    return;
+  }
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot.key_[0].store(key.hashes_[0], std::memory_order_relaxed);
+  slot.key_[1].store(key.hashes_[1], std::memory_order_relaxed);
+  slot.length_.store(length, std::memory_order_relaxed);
+  slot.stamp_.store(
+      sharedCacheHeader->clock_.fetch_add(1, std::memory_order_relaxed) + 1,
+      std::memory_order_relaxed);
+  std::memcpy(sharedCacheBlocks + slot_idx * sharedCacheHeader->block_size_,
+              data, static_cast<size_t>(length));
+
+  slot.sequence_.store(sequence + 2, std::memory_order_release);
+}
+
+// Read a range through the shared cache: the cached blocks are copied, the
+// runs of missing blocks downloaded in one request each and cached
+gc::StatusOr<long long int>
+DownloadRangeThroughSharedCache(const std::string &bucket_name,
+                                const std::string &object_name, char *buffer,
+                                std::int64_t start_range,
+                                std::int64_t end_range,
+                                std::int64_t generation) {
+  const std::int64_t block_size =
+      static_cast<std::int64_t>(sharedCacheHeader->block_size_);
+  const std::string object_key =
+      MakeObjectKey(bucket_name, object_name, generation);
+  std::vector<char> fetched;
+
+  std::int64_t pos = start_range;
+  while (pos < end_range) {
+    const std::int64_t block_idx = pos / block_size;
+    const std::int64_t offset = pos - block_idx * block_size;
+    const long long length = ReadSharedBlock(
+        MakeSharedCacheKey(object_key, block_idx), offset,
+        buffer + (pos - start_range),
+        std::min(end_range - pos, block_size - offset));
+    if (length >= 0) {
+      nbSharedCacheHits++;
+      pos = std::min<std::int64_t>(end_range, block_idx * block_size + length);
+      if (length < block_size) {
+        break; // end of the object
+      }
+      continue;
+    }
+
+    // the run of missing blocks, up to the next cached one
+    nbSharedCacheMisses++;
+    const std::int64_t last_block_idx = (end_range - 1) / block_size;
+    std::int64_t end_block_idx = block_idx + 1;
+    while (end_block_idx <= last_block_idx &&
+           ReadSharedBlock(MakeSharedCacheKey(object_key, end_block_idx), 0,
+                           nullptr, 0) < 0) {
+      end_block_idx++;
+    }
+
+    const std::int64_t run_start = block_idx * block_size;
+    const std::int64_t run_end = end_block_idx * block_size;
+    fetched.resize(static_cast<size_t>(run_end - run_start));
+    auto maybe_read =
+        DownloadRangeSingleFlight(bucket_name, object_name, fetched.data(),
+                                  run_start, run_end, generation);
+    RETURN_STATUS_ON_ERROR(maybe_read);
+
+    for (std::int64_t idx = block_idx; idx < end_block_idx; idx++) {
+      const std::int64_t block_start = (idx - block_idx) * block_size;
+      const std::int64_t block_length = std::min(
+          block_size, static_cast<std::int64_t>(*maybe_read) - block_start);
+      if (block_length <= 0) {
+        break;
+      }
+      WriteSharedBlock(MakeSharedCacheKey(object_key, idx),
+                       fetched.data() + block_start, block_length);
+    }
+
+    const std::int64_t available = run_start + *maybe_read;
+    const std::int64_t copied =
+        std::max<std::int64_t>(std::min(end_range, available) - pos, 0);
+    std::memcpy(buffer + (pos - start_range),
+                fetched.data() + (pos - run_start), static_cast<size_t>(copied));
+    pos += copied;
+    if (available < run_end) {
+      break; // end of the object
+    }
+  }
+  return pos - start_range;
+}
+
+// Disk cache
+//
+// The objects staged in GCS_DISK_CACHE_DIR by driver_warmDiskCache, e.g. with
+// the gcswarmcache tool before a job, are read from local disk instead of the
+// bucket. Each object generation is a file named after the hash of its key,
+// holding the key, for a check on reading, and the size of the object
+// followed by its content. The files are renamed once complete.
+constexpr char disk_cache_magic[8] = {'K', 'G', 'C', 'S', 'O', 'B', 'J', '1'};
+std::string diskCacheDir;
+std::atomic<long long> nbDiskCacheReads{0};
+
+std::string GetDiskCacheFilePath(const std::string &key) {
+  std::ostringstream os;
+  os << diskCacheDir << '/' << std::hex << std::hash<std::string>{}(key)
+     << ".obj";
+  return os.str();
+}
+
+// Open a staged object, positioned on its content
+bool OpenDiskCacheFile(const std::string &key, std::ifstream &file,
+                       std::int64_t &size) {
+  file.open(GetDiskCacheFilePath(key), std::ios::binary);
+  char magic[sizeof(disk_cache_magic)];
+  uint64_t key_size{0};
+  if (!file.read(magic, sizeof(magic)) ||
+      std::memcmp(magic, disk_cache_magic, sizeof(magic)) != 0 ||
+      !file.read(reinterpret_cast<char *>(&key_size), sizeof(key_size)) ||
+      key_size != key.size()) {
+    return false;
+  }
+  std::string stored_key(key.size(), '\0');
+  uint64_t stored_size{0};
+  if (!file.read(&stored_key[0], static_cast<std::streamsize>(key.size())) ||
+      stored_key != key ||
+      !file.read(reinterpret_cast<char *>(&stored_size), sizeof(stored_size))) {
+    return false;
+  }
+  size = static_cast<std::int64_t>(stored_size);
+  return true;
+}
+
+// The staged files recently read are kept open, the most recent first, so
+// that the reads of an object do not open and check its file again. A file
+// holds a single generation and is never written once renamed, an open one
+// stays valid. Its stream has a single position, each read locks it.
+struct StagedFile {
+  std::mutex mutex_;
+  std::ifstream file_;
+  std::int64_t size_{0};
+  std::streamoff content_start_{0};
+};
+constexpr size_t max_open_staged_files{16};
+std::mutex staged_files_mutex;
+std::list<std::pair<std::string, std::shared_ptr<StagedFile>>> staged_files;
+
+// Returns null if the object is not staged
+std::shared_ptr<StagedFile> GetStagedFile(const std::string &key) {
+  auto find_file = [&]() {
+    return std::find_if(
+        staged_files.begin(), staged_files.end(),
+        [&](const std::pair<std::string, std::shared_ptr<StagedFile>> &entry) {
+          return entry.first == key;
+        });
+  };
+  {
+    std::lock_guard<std::mutex> lock{staged_files_mutex};
+    auto it = find_file();
+    if (it != staged_files.end()) {
+      staged_files.splice(staged_files.begin(), staged_files, it);
+      return it->second;
+    }
+  }
+
+  auto staged = std::make_shared<StagedFile>();
+  if (!OpenDiskCacheFile(key, staged->file_, staged->size_)) {
+    return nullptr;
+  }
+  staged->content_start_ = staged->file_.tellg();
+
+  std::lock_guard<std::mutex> lock{staged_files_mutex};
+  auto it = find_file();
+  if (it != staged_files.end()) {
+    // opened concurrently by another reader
+    staged_files.splice(staged_files.begin(), staged_files, it);
+    return it->second;
+  }
+  staged_files.emplace_front(key, staged);
+  if (staged_files.size() > max_open_staged_files) {
+    staged_files.pop_back();
+  }
+  return staged;
+}
+
+// Returns -1 if the object is not staged
+long long ReadFromDiskCache(const std::string &key, char *buffer,
+                            std::int64_t start_range, std::int64_t end_range) {
+  auto staged = GetStagedFile(key);
+  if (!staged) {
+    return -1;
+  }
+  const std::int64_t to_read =
+      std::max<std::int64_t>(std::min(end_range, staged->size_) - start_range,
+                             0);
+  if (to_read > 0) {
+    std::lock_guard<std::mutex> lock{staged->mutex_};
+    std::ifstream &file = staged->file_;
+    if (!file.seekg(staged->content_start_ + start_range) ||
+        !file.read(buffer, static_cast<std::streamsize>(to_read))) {
+      file.clear();
+      return -1;
+    }
+  }
+  nbDiskCacheReads++;
+  return to_read;
+}
+
+gc::StatusOr<long long int>
+DownloadFileRangeToBuffer(const std::string &bucket_name,
+                          const std::string &object_name, char *buffer,
+                          std::int64_t start_range, std::int64_t end_range,
+                          std::int64_t generation = 0) {
+  if (!diskCacheDir.empty() && 0 != generation) {
+    const long long staged_read =
+        ReadFromDiskCache(MakeObjectKey(bucket_name, object_name, generation),
+                          buffer, start_range, end_range);
+    if (staged_read >= 0) {
+      return staged_read;
+    }
+  }
+  if (!sharedCacheHeader || 0 == generation || end_range <= start_range) {
+    return DownloadRangeSingleFlight(bucket_name, object_name, buffer,
+                                     start_range, end_range, generation);
+  }
+  return DownloadRangeThroughSharedCache(bucket_name, object_name, buffer,
+                                         start_range, end_range, generation);
+}
+
+// Checksums support
+//
+// The CRC32C of the objects transferred in whole is computed by the driver with
+// the crc32c library, which uses the CRC instructions of the CPU when available,
+// and compared with the one of the object metadata. The hashes of the client
+// library are disabled, so that a single checksum is computed on the data.
+// Validation can be turned off by setting GCS_VALIDATE_CHECKSUMS to 0.
+bool validateChecksums{true};
+
+uint32_t ExtendCrc32c(uint32_t crc, const char *data, size_t size) {
+  if (!validateChecksums) {
+    return crc;
+  }
+  return crc32c::Extend(crc, reinterpret_cast<const uint8_t *>(data), size);
+}
+
+// The metadata holds the base64 encoding of the big-endian checksum
+std::string EncodeCrc32c(uint32_t crc) {
+  static const char *alphabet =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  const uint8_t bytes[4] = {
+      static_cast<uint8_t>(crc >> 24), static_cast<uint8_t>(crc >> 16),
+      static_cast<uint8_t>(crc >> 8), static_cast<uint8_t>(crc)};
+  std::string res;
+  res.push_back(alphabet[bytes[0] >> 2]);
+  res.push_back(alphabet[((bytes[0] & 0x03) << 4) | (bytes[1] >> 4)]);
+  res.push_back(alphabet[((bytes[1] & 0x0F) << 2) | (bytes[2] >> 6)]);
+  res.push_back(alphabet[bytes[2] & 0x3F]);
+  res.push_back(alphabet[bytes[3] >> 2]);
+  res.push_back(alphabet[(bytes[3] & 0x03) << 4]);
+  res.append("==");
+  return res;
+}
+
+// An empty expected value, e.g. for a composite object, skips the validation
+gc::Status CheckCrc32c(const std::string &object_name, uint32_t computed,
+                       const std::string &expected) {
+  if (!validateChecksums || expected.empty()) {
+    return {};
+  }
+  const std::string encoded = EncodeCrc32c(computed);
+  if (encoded == expected) {
+    return {};
+  }
+  return gc::Status{gc::StatusCode::kDataLoss,
+                    "Checksum mismatch on " + object_name +
+                        ": expected CRC32C " + expected + ", computed " +
+                        encoded};
+}
+
+// Write to the upload stream of a writer, keeping the checksum of the uploaded
+// bytes
+void WriteToObject(WriteFile &writer_h, const char *data, std::streamsize size) {
+  writer_h.crc32c_ =
+      ExtendCrc32c(writer_h.crc32c_, data, static_cast<size_t>(size));
+  writer_h.writer_.write(data, size);
+}
+
+// Compressed inputs support
+//
+// Compressed parts cannot be read by plain ranges: the bytes are streamed from
+// a position where the decoder can start, and decoded on the fly. The state of
+// the decoder is kept in the multifile between two reads, so that sequential
+// reads resume where the previous one stopped.
+//
+// The positions where the decoder can start are recorded in a checkpoint index
+// per part: the start of each zstd frame or gzip member, and for gzip, deflate
+// block boundaries every compressedIndexSpan uncompressed bytes, along with the
+// 32K of history needed to resume the decoding there (see zran.c in the zlib
+// sources). Seekable zstd objects carry their frame table, from which the index
+// is built without decoding the object. For gzip objects, the uncompressed size
+// is read at the end of the object, and the checkpoints are recorded by the
+// decoders of the reads as they pass them, up to the end of the part. The other
+// objects are decoded in whole when they are opened.
+namespace gcsplugin {
+struct Checkpoint {
+  tOffset out_{0};     // uncompressed offset
+  tOffset in_{0};      // compressed offset of the first byte to decode
+  int bits_{0};        // gzip: bits of the byte before in_ still to decode
+  bool fresh_{false};  // the decoding starts on a gzip member or zstd frame
+  std::string window_; // gzip: uncompressed bytes preceding out_
+};
+
+struct CompressedPartIndex {
+  Compression compression_{Compression::kNone};
+  tOffset uncompressed_size_{0};
+  std::string first_line_;
+
+  // Shared by the handles reading the part, the checkpoints are completed while
+  // it is decoded
+  mutable std::mutex mutex_;
+  mutable std::vector<Checkpoint> checkpoints_; // sorted by uncompressed offset
+  mutable bool complete_{false}; // up to the end of the part
+
+  // Closest checkpoint at or before offset
+  Checkpoint FindCheckpoint(tOffset offset) const {
+    std::lock_guard<std::mutex> lock{mutex_};
+    auto after_it = std::upper_bound(
+        checkpoints_.begin(), checkpoints_.end(), offset,
+        [](tOffset o, const Checkpoint &point) { return o < point.out_; });
+    return *std::prev(after_it);
+  }
+
+  // Record a checkpoint found at least span bytes past the last one. Returns
+  // the offset of the last checkpoint.
+  tOffset AddCheckpoint(Checkpoint point, tOffset span) const {
+    std::lock_guard<std::mutex> lock{mutex_};
+    if (!complete_ && point.out_ - checkpoints_.back().out_ >= span) {
+      checkpoints_.push_back(std::move(point));
+    }
+    return checkpoints_.back().out_;
+  }
+
+  bool IsComplete() const {
+    std::lock_guard<std::mutex> lock{mutex_};
+    return complete_;
+  }
+
+  void SetComplete() const {
+    std::lock_guard<std::mutex> lock{mutex_};
+    complete_ = true;
+  }
+
+  // Bytes held, mostly by the gzip windows
+  size_t GetMemorySize() const {
+    std::lock_guard<std::mutex> lock{mutex_};
+    size_t size = sizeof(*this) + first_line_.size();
+    for (const Checkpoint &point : checkpoints_) {
+      size += sizeof(point) + point.window_.size();
+    }
+    return size;
+  }
+};
+
+struct DecodeState {
+  std::string bucket_name_;
+  std::string object_name_;
+  std::int64_t generation_{0};
+  Compression compression_{Compression::kGzip};
+  size_t part_idx_{0};
+  tOffset out_pos_{0}; // uncompressed position in the part
+  tOffset in_pos_{0};  // compressed position of the next byte to decode
+  bool raw_{false};    // gzip: raw deflate stream, resumed from a checkpoint
+  int trailer_skip_{0};
+  bool member_end_{false};
+  bool done_{false};
+  int flush_{Z_NO_FLUSH};
+  bool zlib_initialized_{false};
+  z_stream strm_{};
+  ZSTD_DStream *zstd_{nullptr};
+  gcs::ObjectReadStream source_;
+  std::vector<char> in_buf_;
+  size_t in_begin_{0};
+  size_t in_end_{0};
+  uint32_t crc32c_{0}; // checksum of the compressed bytes read
+  bool whole_{false};  // decoded from the start of the object
+  long long nb_stalled_{0}; // successive resumes without progress
+  // called with the bytes produced by each call to the decoder
+  std::function<void(DecodeState &, const char *, size_t)> on_progress_;
+
+  DecodeState() = default;
+  DecodeState(const DecodeState &) = delete;
+  DecodeState &operator=(const DecodeState &) = delete;
+
+  ~DecodeState() {
+    if (zlib_initialized_) {
+      inflateEnd(&strm_);
+    }
+    ZSTD_freeDStream(zstd_);
+  }
+};
+} // namespace gcsplugin
+
+constexpr size_t decode_in_buf_size{256 * 1024};
+constexpr size_t gzip_window_size{32 * 1024};
+constexpr int gzip_trailer_size{8};
+
+// Distance in uncompressed bytes between two gzip checkpoints. Default value
+// below can be overriden by setting GCS_COMPRESSED_INDEX_SPAN
+constexpr long long default_compressed_index_span = 16 * 1024 * 1024;
+tOffset compressedIndexSpan{default_compressed_index_span};
+
+// Directory where the checkpoint indexes are persisted, set by
+// GCS_COMPRESSED_INDEX_DIR. The indexes are kept in memory only if empty.
+std::string compressedIndexDir;
+
+void OpenDecodeSource(DecodeState &state, tOffset read_from) {
+  // request the stored bytes, and not a transcoded version of them, for
+  // objects uploaded with Content-Encoding: gzip
+  state.source_ = client.ReadObject(
+      state.bucket_name_, state.object_name_, gcs::AcceptEncodingGzip(),
+      gcs::ReadFromOffset(read_from), MakeGenerationOption(state.generation_),
+      gcs::DisableCrc32cChecksum(true), gcs::DisableMD5Hash(true),
+      MakeDownloadStallOptions());
+}
+
+// On a transient failure of the compressed stream, reopen it after the last
+// byte received
+gc::Status ResumeDecodeSource(DecodeState &state) {
+  const gc::Status status = state.source_.status();
+  state.nb_stalled_ = state.in_end_ > 0 ? 0 : state.nb_stalled_ + 1;
+  if (!IsTransientFailure(status) || state.nb_stalled_ > readResumeAttempts) {
+    return gc::Status{status.code(), "Error while reading compressed stream; " +
+                                         status.message()};
+  }
+
+  if (state.generation_ == 0) {
+    state.generation_ = state.source_.received_generation().value_or(0);
+  }
+  if (state.nb_stalled_ > 0) {
+    auto backoff = read_resume_backoff;
+    for (long long i = 1; i < state.nb_stalled_; i++) {
+      backoff = std::min(2 * backoff, read_resume_max_backoff);
+    }
+    std::this_thread::sleep_for(backoff);
+  }
+
+  const tOffset read_from = state.in_pos_ + static_cast<tOffset>(state.in_end_);
+  spdlog::warn("Resuming the download of {} at byte {}: {}", state.object_name_,
+               read_from, status.message());
+  OpenDecodeSource(state, read_from);
+  return {};
+}
+
+gc::StatusOr<std::unique_ptr<DecodeState>>
+OpenDecodeState(const std::string &bucket_name, const std::string &object_name,
+                std::int64_t generation, size_t part_idx,
+                Compression compression, const Checkpoint &from) {
+  std::unique_ptr<DecodeState> state{new DecodeState};
+  state->bucket_name_ = bucket_name;
+  state->object_name_ = object_name;
+  state->generation_ = generation;
+  state->compression_ = compression;
+  state->part_idx_ = part_idx;
+  state->out_pos_ = from.out_;
+  state->in_pos_ = from.in_;
+  state->whole_ = from.in_ == 0;
+
+  // with a partially decoded byte before the checkpoint, start one byte earlier
+  OpenDecodeSource(*state, from.in_ - (from.bits_ ? 1 : 0));
+  if (!state->source_) {
+    auto &o_status = state->source_.status();
+    return gc::Status{o_status.code(), "Error while creating reading stream; " +
+                                           o_status.message()};
+  }
+  state->in_buf_.resize(decode_in_buf_size);
+
+  if (Compression::kZstd == compression) {
+    state->zstd_ = ZSTD_createDStream();
+    if (!state->zstd_ || ZSTD_isError(ZSTD_initDStream(state->zstd_))) {
+      return gc::Status{gc::StatusCode::kInternal,
+                        "Error while initializing the zstd decoder"};
+    }
+    return state;
+  }
+
+  // gzip: windowBits 15 + 32 for an automatic detection of the header at the
+  // start of a member, -15 for a raw deflate stream inside a member
+  z_stream &strm = state->strm_;
+  state->raw_ = !from.fresh_;
+  if (inflateInit2(&strm, state->raw_ ? -15 : 15 + 32) != Z_OK) {
+    return gc::Status{gc::StatusCode::kInternal,
+                      "Error while initializing the gzip decoder"};
+  }
+  state->zlib_initialized_ = true;
+
+  if (state->raw_) {
+    if (from.bits_) {
+      const int byte = state->source_.get();
+      if (!state->source_) {
+        return gc::Status{gc::StatusCode::kDataLoss,
+                          "Error while resuming compressed stream"};
+      }
+      inflatePrime(&strm, from.bits_, byte >> (8 - from.bits_));
+    }
+    inflateSetDictionary(
+        &strm, reinterpret_cast<const Bytef *>(from.window_.data()),
+        static_cast<uInt>(from.window_.size()));
+  }
+  return state;
+}
+
+// Decode up to len bytes into out. Returns the number of bytes produced, less
+// than len only at the end of the stream.
+gc::StatusOr<long long> DecodeToBuffer(DecodeState &state, char *out,
+                                       tOffset len) {
+  tOffset produced{0};
+
+  while (produced < len && !state.done_) {
+    if (state.in_begin_ == state.in_end_) {
+      auto &source = state.source_;
+      source.read(state.in_buf_.data(),
+                  static_cast<std::streamsize>(state.in_buf_.size()));
+      state.in_begin_ = 0;
+      state.in_end_ = static_cast<size_t>(source.gcount());
+      state.crc32c_ =
+          ExtendCrc32c(state.crc32c_, state.in_buf_.data(), state.in_end_);
+      if (source.bad()) {
+        // the bytes received before the failure are still decoded
+        gc::Status status = ResumeDecodeSource(state);
+        if (!status.ok()) {
+          return status;
+        }
+        continue;
+      }
+      if (state.in_end_ == 0) {
+        if (state.member_end_) {
+          state.done_ = true;
+          break;
+        }
+        return gc::Status{gc::StatusCode::kDataLoss,
+                          "Unexpected end of compressed stream"};
+      }
+    }
+
+    const char *in = state.in_buf_.data() + state.in_begin_;
+    const size_t avail_in = state.in_end_ - state.in_begin_;
+
+    if (state.trailer_skip_ > 0) {
+      // end of a gzip member resumed as a raw stream: skip its trailer
+      const size_t skip =
+          std::min(avail_in, static_cast<size_t>(state.trailer_skip_));
+      state.in_begin_ += skip;
+      state.in_pos_ += static_cast<tOffset>(skip);
+      state.trailer_skip_ -= static_cast<int>(skip);
+      state.member_end_ = (state.trailer_skip_ == 0);
+      continue;
+    }
+
+    constexpr tOffset max_chunk{1 << 30};
+    const size_t out_chunk =
+        static_cast<size_t>(std::min(len - produced, max_chunk));
+    char *chunk_start = out + produced;
+    size_t consumed{0};
+    size_t chunk_produced{0};
+
+    if (Compression::kZstd == state.compression_) {
+      ZSTD_inBuffer in_buf{in, avail_in, 0};
+      ZSTD_outBuffer out_buf{chunk_start, out_chunk, 0};
+      const size_t ret = ZSTD_decompressStream(state.zstd_, &out_buf, &in_buf);
+      if (ZSTD_isError(ret)) {
+        return gc::Status{gc::StatusCode::kDataLoss,
+                          std::string("Error while decoding data: ") +
+                              ZSTD_getErrorName(ret)};
+      }
+      consumed = in_buf.pos;
+      chunk_produced = out_buf.pos;
+      // 0 means a frame was completely decoded and flushed
+      state.member_end_ = (ret == 0);
+    } else {
+      z_stream &strm = state.strm_;
+      if (state.member_end_) {
+        // concatenated gzip members form a single logical stream
+        inflateReset2(&strm, 15 + 32);
+        state.member_end_ = false;
+      }
+      strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in));
+      strm.avail_in = static_cast<uInt>(avail_in);
+      strm.next_out = reinterpret_cast<Bytef *>(chunk_start);
+      strm.avail_out = static_cast<uInt>(out_chunk);
+
+      const int ret = inflate(&strm, state.flush_);
+      consumed = avail_in - strm.avail_in;
+      chunk_produced = out_chunk - strm.avail_out;
+
+      if (ret == Z_STREAM_END) {
+        if (state.raw_) {
+          state.raw_ = false;
+          state.trailer_skip_ = gzip_trailer_size;
+        } else {
+          state.member_end_ = true;
+        }
+      } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        return gc::Status{gc::StatusCode::kDataLoss,
+                          std::string("Error while inflating data: ") +
+                              (strm.msg ? strm.msg : std::to_string(ret))};
+      }
+    }
+
+    state.in_begin_ += consumed;
+    state.in_pos_ += static_cast<tOffset>(consumed);
+    state.out_pos_ += static_cast<tOffset>(chunk_produced);
+    produced += static_cast<tOffset>(chunk_produced);
+
+    if (state.on_progress_) {
+      state.on_progress_(state, chunk_start, chunk_produced);
+    }
+  }
+
+  return produced;
+}
+
+// Advance the decoder by count uncompressed bytes
+gc::Status SkipDecoded(DecodeState &state, tOffset count) {
+  std::vector<char> waste(static_cast<size_t>(
+      std::min<tOffset>(count, static_cast<tOffset>(decode_in_buf_size))));
+  while (count > 0) {
+    const tOffset chunk =
+        std::min<tOffset>(count, static_cast<tOffset>(waste.size()));
+    auto maybe_skipped = DecodeToBuffer(state, waste.data(), chunk);
+    RETURN_STATUS_ON_ERROR(maybe_skipped);
+    if (*maybe_skipped < chunk) {
+      return gc::Status{gc::StatusCode::kOutOfRange,
+                        "Trying to skip past the end of compressed stream"};
+    }
+    count -= chunk;
+  }
+  return {};
+}
+
+// Have a decoder record in an index the checkpoints it passes. Its gzip history
+// starts with the window of the checkpoint it starts from.
+void RecordCheckpoints(DecodeState &state,
+                       std::shared_ptr<const CompressedPartIndex> index,
+                       const Checkpoint &from) {
+  std::string history = from.window_;
+  tOffset next_out = from.out_ + compressedIndexSpan;
+
+  // stop at each deflate block boundary to consider a checkpoint there
+  state.flush_ = Z_BLOCK;
+  state.on_progress_ = [index, history, next_out](
+                           DecodeState &st, const char *data, size_t n) mutable {
+    if (Compression::kGzip == st.compression_) {
+      history.append(data, n);
+      if (history.size() > 2 * gzip_window_size) {
+        history.erase(0, history.size() - gzip_window_size);
+      }
+    }
+    if (st.out_pos_ < next_out) {
+      return;
+    }
+
+    Checkpoint point;
+    point.out_ = st.out_pos_;
+    point.in_ = st.in_pos_;
+    if (st.member_end_) {
+      // start of a zstd frame or of a gzip member, no history needed
+      point.fresh_ = true;
+    } else {
+      if (Compression::kGzip != st.compression_) {
+        return;
+      }
+      const int data_type = st.strm_.data_type;
+      const bool block_end = (data_type & 128) && !(data_type & 64);
+      if (!block_end || st.trailer_skip_ != 0) {
+        return;
+      }
+      point.bits_ = data_type & 7;
+      const size_t window = std::min(history.size(), gzip_window_size);
+      point.window_ = history.substr(history.size() - window);
+    }
+    next_out =
+        index->AddCheckpoint(std::move(point), compressedIndexSpan) +
+        compressedIndexSpan;
+  };
+}
+
+// Decode a whole object to learn its uncompressed size and its first line, used
+// for the common header detection, and to build its checkpoint index
+gc::Status ScanCompressedObject(const std::string &bucket,
+                                const std::string &name,
+                                std::int64_t generation, Compression compression,
+                                const std::string &crc32c,
+                                const std::shared_ptr<CompressedPartIndex> &index) {
+  index->compression_ = compression;
+  Checkpoint start;
+  start.fresh_ = true;
+  index->checkpoints_.push_back(start);
+
+  auto maybe_state =
+      OpenDecodeState(bucket, name, generation, 0, compression, start);
+  RETURN_STATUS_ON_ERROR(maybe_state);
+  DecodeState &state = **maybe_state;
+  RecordCheckpoints(state, index, start);
+
+  bool line_complete{false};
+  std::vector<char> out(decode_in_buf_size);
+  const tOffset out_size = static_cast<tOffset>(out.size());
+
+  while (!state.done_) {
+    auto maybe_produced = DecodeToBuffer(state, out.data(), out_size);
+    RETURN_STATUS_ON_ERROR(maybe_produced);
+    const size_t produced = static_cast<size_t>(*maybe_produced);
+
+    if (!line_complete) {
+      const auto out_end = out.begin() + static_cast<std::ptrdiff_t>(produced);
+      auto eol = std::find(out.begin(), out_end, '\n');
+      line_complete = eol != out_end;
+      index->first_line_.append(out.begin(), line_complete ? eol + 1 : out_end);
+    }
+  }
+  index->uncompressed_size_ = state.out_pos_;
+  index->SetComplete();
+
+  // the whole object was downloaded
+  gc::Status crc_status = CheckCrc32c(name, state.crc32c_, crc32c);
+  if (!crc_status.ok()) {
+    return crc_status;
+  }
+
+  spdlog::debug("Indexed {}: {} bytes, {} checkpoints", name,
+                index->uncompressed_size_, index->checkpoints_.size());
+  return {};
+}
+
+// Decode the first line of an object, used for the common header detection
+gc::Status ReadFirstLine(const std::string &bucket, const std::string &name,
+                         std::int64_t generation, CompressedPartIndex &index) {
+  auto maybe_state = OpenDecodeState(bucket, name, generation, 0,
+                                     index.compression_, index.checkpoints_[0]);
+  RETURN_STATUS_ON_ERROR(maybe_state);
+  char c{0};
+  while (c != '\n') {
+    auto maybe_decoded = DecodeToBuffer(**maybe_state, &c, 1);
+    RETURN_STATUS_ON_ERROR(maybe_decoded);
+    if (*maybe_decoded == 0) {
+      break;
+    }
+    index.first_line_.push_back(c);
+  }
+  return {};
+}
+
+uint32_t ReadLE32(const char *p) {
+  const unsigned char *u = reinterpret_cast<const unsigned char *>(p);
+  return static_cast<uint32_t>(u[0]) | (static_cast<uint32_t>(u[1]) << 8) |
+         (static_cast<uint32_t>(u[2]) << 16) |
+         (static_cast<uint32_t>(u[3]) << 24);
+}
+
+void WriteLE32(char *p, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    p[i] = static_cast<char>((value >> (8 * i)) & 0xFF);
+  }
+}
+
+uint64_t ReadLE64(const char *p) {
+  return static_cast<uint64_t>(ReadLE32(p)) |
+         (static_cast<uint64_t>(ReadLE32(p + 4)) << 32);
+}
+
+void WriteLE64(char *p, uint64_t value) {
+  WriteLE32(p, static_cast<uint32_t>(value));
+  WriteLE32(p + 4, static_cast<uint32_t>(value >> 32));
+}
+
+// The gzip objects written by the driver end with an empty member, whose extra
+// field holds the uncompressed size of the object and the stored size it
+// applies to, different once the object is composed with others
+constexpr size_t gzip_size_member_size{42};
+constexpr size_t gzip_size_field_offset{16};
+
+std::string MakeGzipSizeMember(uint64_t uncompressed_size,
+                               uint64_t stored_size) {
+  std::string member(gzip_size_member_size, '\0');
+  char *p = &member[0];
+  const unsigned char header[] = {0x1f, 0x8b, 8, 4}; // deflate, FEXTRA
+  std::memcpy(p, header, sizeof(header));
+  p[9] = static_cast<char>(0xff); // unknown OS
+  p[10] = 20;                     // XLEN, one subfield
+  p[12] = 'G';
+  p[13] = 'S';
+  p[14] = 16; // LEN
+  WriteLE64(p + gzip_size_field_offset, uncompressed_size);
+  WriteLE64(p + gzip_size_field_offset + 8, stored_size);
+  p[32] = 3; // final empty block, followed by a zero CRC and size
+  return member;
+}
+
+// Size of a gzip object from the size member ending the objects written by
+// the driver, if it applies to the stored size of the object: a composition,
+// e.g. by an append, hides it. The ISIZE field of the last member is not used,
+// it is the size modulo 2^32 of that member only. Returns kNotFound without a
+// size member.
+gc::Status ReadGzipSize(const std::string &bucket, const std::string &name,
+                        std::int64_t generation, tOffset stored_size,
+                        CompressedPartIndex &index) {
+  const gc::Status no_size{gc::StatusCode::kNotFound, "No gzip size member"};
+  const tOffset tail_size = static_cast<tOffset>(gzip_size_member_size);
+  if (stored_size < tail_size) {
+    return no_size;
+  }
+
+  char tail[gzip_size_member_size];
+  auto maybe_read = DownloadFileRangeToBuffer(
+      bucket, name, tail, stored_size - tail_size, stored_size, generation);
+  RETURN_STATUS_ON_ERROR(maybe_read);
+  if (*maybe_read != tail_size) {
+    return no_size;
+  }
+
+  const std::string expected_header =
+      MakeGzipSizeMember(0, 0).substr(0, gzip_size_field_offset);
+  if (!std::equal(expected_header.begin(), expected_header.end(), tail) ||
+      ReadLE64(tail + gzip_size_field_offset + 8) !=
+          static_cast<uint64_t>(stored_size)) {
+    return no_size;
+  }
+  const tOffset size =
+      static_cast<tOffset>(ReadLE64(tail + gzip_size_field_offset));
+
+  index.compression_ = Compression::kGzip;
+  index.uncompressed_size_ = size;
+  Checkpoint start;
+  start.fresh_ = true;
+  index.checkpoints_.push_back(start);
+  return {};
+}
+
+// zstd seekable format, see contrib/seekable_format in the zstd sources
+constexpr uint32_t zstd_seekable_magic{0x8F92EAB1};
+constexpr uint32_t zstd_skippable_magic{0x184D2A5E};
+constexpr size_t zstd_seek_footer_size{9};
+constexpr size_t zstd_skippable_header_size{8};
+
+// Build the index of a seekable zstd object from its seek table. Returns
+// kNotFound if the object has no seek table.
+gc::Status ReadZstdSeekTable(const std::string &bucket, const std::string &name,
+                             std::int64_t generation, tOffset stored_size,
+                             CompressedPartIndex &index) {
+  const tOffset footer_size = static_cast<tOffset>(zstd_seek_footer_size);
+  const gc::Status no_table{gc::StatusCode::kNotFound, "No zstd seek table"};
+  if (stored_size < footer_size) {
+    return no_table;
+  }
+
+  char footer[zstd_seek_footer_size];
+  auto maybe_read = DownloadFileRangeToBuffer(
+      bucket, name, footer, stored_size - footer_size, stored_size, generation);
+  RETURN_STATUS_ON_ERROR(maybe_read);
+  if (*maybe_read != footer_size || ReadLE32(footer + 5) != zstd_seekable_magic) {
+    return no_table;
+  }
+
+  const uint32_t nb_frames = ReadLE32(footer);
+  const bool has_checksum = (footer[4] & 0x80) != 0;
+  const tOffset entry_size = has_checksum ? 12 : 8;
+  const tOffset entries_size = static_cast<tOffset>(nb_frames) * entry_size;
+  const tOffset table_size = static_cast<tOffset>(zstd_skippable_header_size) +
+                             entries_size + footer_size;
+  if (table_size > stored_size) {
+    return no_table;
+  }
+
+  std::vector<char> entries(static_cast<size_t>(entries_size));
+  const tOffset entries_start = stored_size - footer_size - entries_size;
+  maybe_read =
+      DownloadFileRangeToBuffer(bucket, name, entries.data(), entries_start,
+                                entries_start + entries_size, generation);
+  RETURN_STATUS_ON_ERROR(maybe_read);
+  if (*maybe_read != entries_size) {
+    return gc::Status{gc::StatusCode::kDataLoss, "Truncated zstd seek table"};
+  }
+
+  std::vector<Checkpoint> checkpoints;
+  Checkpoint point;
+  point.fresh_ = true;
+  for (uint32_t i = 0; i < nb_frames; i++) {
+    const char *entry = entries.data() + i * entry_size;
+    checkpoints.push_back(point);
+    point.in_ += ReadLE32(entry);
+    point.out_ += ReadLE32(entry + 4);
+  }
+  if (checkpoints.empty()) {
+    checkpoints.push_back(point);
+  }
+
+  // the table must describe the whole object, which is not the case after the
+  // composition of seekable objects, e.g. by an append
+  if (point.in_ + table_size != stored_size) {
+    return no_table;
+  }
+
+  index.compression_ = Compression::kZstd;
+  index.uncompressed_size_ = point.out_;
+  index.checkpoints_ = std::move(checkpoints);
+  index.complete_ = true;
+  return {};
+}
+
+// Persistence of the indexes on local disk, as a gzip file holding the key of
+// the object, for a check on load, followed by the index fields
+std::string GetIndexFilePath(const std::string &key) {
+  std::ostringstream os;
+  os << compressedIndexDir << '/' << std::hex << std::hash<std::string>{}(key)
+     << ".idx";
+  return os.str();
+}
+
+bool WriteIndexBytes(gzFile file, const void *data, size_t size) {
+  return size == 0 ||
+         gzwrite(file, data, static_cast<unsigned>(size)) ==
+             static_cast<int>(size);
+}
+
+bool ReadIndexBytes(gzFile file, void *data, size_t size) {
+  return size == 0 ||
+         gzread(file, data, static_cast<unsigned>(size)) == static_cast<int>(size);
+}
+
+bool WriteIndexString(gzFile file, const std::string &str) {
+  const uint64_t size = str.size();
+  return WriteIndexBytes(file, &size, sizeof(size)) &&
+         WriteIndexBytes(file, str.data(), str.size());
+}
+
+bool ReadIndexString(gzFile file, std::string &str) {
+  uint64_t size{0};
+  if (!ReadIndexBytes(file, &size, sizeof(size))) {
+    return false;
+  }
+  str.resize(static_cast<size_t>(size));
+  return ReadIndexBytes(file, &str[0], str.size());
+}
+
+void PersistIndex(const std::string &key, const CompressedPartIndex &index) {
+  const std::string path = GetIndexFilePath(key);
+  const std::string tmp_path =
+      path + '.' + boost::uuids::to_string(boost::uuids::random_generator()());
+  gzFile file = gzopen(tmp_path.c_str(), "wb1");
+  if (!file) {
+    spdlog::warn("Cannot persist the index of {} to {}", key, path);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock{index.mutex_};
+  const int32_t compression = static_cast<int32_t>(index.compression_);
+  const uint64_t nb_points = index.checkpoints_.size();
+  bool ok = WriteIndexString(file, key) &&
+            WriteIndexBytes(file, &compression, sizeof(compression)) &&
+            WriteIndexBytes(file, &index.uncompressed_size_,
+                            sizeof(index.uncompressed_size_)) &&
+            WriteIndexString(file, index.first_line_) &&
+            WriteIndexBytes(file, &nb_points, sizeof(nb_points));
+  for (const Checkpoint &point : index.checkpoints_) {
+    const int32_t bits = point.bits_;
+    const int32_t fresh = point.fresh_ ? 1 : 0;
+    ok = ok && WriteIndexBytes(file, &point.out_, sizeof(point.out_)) &&
+         WriteIndexBytes(file, &point.in_, sizeof(point.in_)) &&
+         WriteIndexBytes(file, &bits, sizeof(bits)) &&
+         WriteIndexBytes(file, &fresh, sizeof(fresh)) &&
+         WriteIndexString(file, point.window_);
+  }
+  ok = (gzclose(file) == Z_OK) && ok;
+
+  // the rename makes the index visible to the other processes only once
+  // complete
+  if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    std::remove(tmp_path.c_str());
+    spdlog::warn("Cannot persist the index of {} to {}", key, path);
+  }
+}
+
+bool LoadIndex(const std::string &key, CompressedPartIndex &index) {
+  gzFile file = gzopen(GetIndexFilePath(key).c_str(), "rb");
+  if (!file) {
+    return false;
+  }
+
+  std::string stored_key;
+  int32_t compression{0};
+  uint64_t nb_points{0};
+  bool ok = ReadIndexString(file, stored_key) && stored_key == key &&
+            ReadIndexBytes(file, &compression, sizeof(compression)) &&
+            ReadIndexBytes(file, &index.uncompressed_size_,
+                           sizeof(index.uncompressed_size_)) &&
+            ReadIndexString(file, index.first_line_) &&
+            ReadIndexBytes(file, &nb_points, sizeof(nb_points));
+  for (uint64_t i = 0; ok && i < nb_points; i++) {
+    Checkpoint point;
+    int32_t bits{0};
+    int32_t fresh{0};
+    ok = ReadIndexBytes(file, &point.out_, sizeof(point.out_)) &&
+         ReadIndexBytes(file, &point.in_, sizeof(point.in_)) &&
+         ReadIndexBytes(file, &bits, sizeof(bits)) &&
+         ReadIndexBytes(file, &fresh, sizeof(fresh)) &&
+         ReadIndexString(file, point.window_);
+    point.bits_ = bits;
+    point.fresh_ = fresh != 0;
+    index.checkpoints_.push_back(std::move(point));
+  }
+  gzclose(file);
+
+  // only the complete indexes are persisted
+  index.compression_ = static_cast<Compression>(compression);
+  index.complete_ = true;
+  return ok && !index.checkpoints_.empty();
+}
+
+// The indexes are kept to avoid resolving the same object generation twice,
+// e.g. on a call to driver_getFileSize followed by driver_fopen, within a
+// budget of max_index_cache_size bytes. The least recently used ones are
+// dropped first, the handles reading them keep them.
+constexpr size_t max_index_cache_size{256 * 1024 * 1024};
+std::mutex index_cache_mutex;
+using IndexCacheEntry =
+    std::pair<std::string, std::shared_ptr<const CompressedPartIndex>>;
+std::list<IndexCacheEntry> index_cache; // most recently used first
+std::unordered_map<std::string, std::list<IndexCacheEntry>::iterator>
+    index_cache_keys;
+
+std::shared_ptr<const CompressedPartIndex>
+FindCachedIndex(const std::string &key) {
+  std::lock_guard<std::mutex> lock{index_cache_mutex};
+  auto found = index_cache_keys.find(key);
+  if (found == index_cache_keys.end()) {
+    return nullptr;
+  }
+  index_cache.splice(index_cache.begin(), index_cache, found->second);
+  return found->second->second;
+}
+
+// The sizes of the indexes grow as their checkpoints are recorded, they are
+// summed again on each insertion
+void CacheIndex(const std::string &key,
+                std::shared_ptr<const CompressedPartIndex> index) {
+  std::lock_guard<std::mutex> lock{index_cache_mutex};
+  auto found = index_cache_keys.find(key);
+  if (found != index_cache_keys.end()) {
+    index_cache.erase(found->second);
+  }
+  index_cache.emplace_front(key, std::move(index));
+  index_cache_keys[key] = index_cache.begin();
+
+  size_t cached_size{0};
+  auto it = index_cache.begin();
+  for (; it != index_cache.end(); ++it) {
+    cached_size += it->second->GetMemorySize();
+    if (cached_size > max_index_cache_size && it != index_cache.begin()) {
+      break;
+    }
+  }
+  while (it != index_cache.end()) {
+    index_cache_keys.erase(it->first);
+    it = index_cache.erase(it);
+  }
+}
+
+gc::StatusOr<std::shared_ptr<const CompressedPartIndex>>
+GetCompressedPartIndex(const std::string &bucket, const std::string &name,
+                       std::int64_t generation, Compression compression,
+                       tOffset stored_size, const std::string &crc32c) {
+  const std::string key = MakeObjectKey(bucket, name, generation);
+  std::shared_ptr<const CompressedPartIndex> cached = FindCachedIndex(key);
+  if (cached) {
+    return cached;
+  }
+
+  std::shared_ptr<CompressedPartIndex> index{new CompressedPartIndex};
+  const bool persisted = !compressedIndexDir.empty() && LoadIndex(key, *index);
+
+  if (!persisted) {
+    // the size is read at the end of the object when it can be
+    gc::Status status =
+        Compression::kZstd == compression
+            ? ReadZstdSeekTable(bucket, name, generation, stored_size, *index)
+            : ReadGzipSize(bucket, name, generation, stored_size, *index);
+    if (status.ok()) {
+      status = ReadFirstLine(bucket, name, generation, *index);
+    } else if (status.code() == gc::StatusCode::kNotFound) {
+      index.reset(new CompressedPartIndex);
+      status = ScanCompressedObject(bucket, name, generation, compression,
+                                    crc32c, index);
+    }
+    if (!status.ok()) {
+      return status;
+    }
+
+    if (!compressedIndexDir.empty() && index->IsComplete()) {
+      PersistIndex(key, *index);
+    }
+  }
+
+  CacheIndex(key, index);
+  return std::shared_ptr<const CompressedPartIndex>{std::move(index)};
+}
+
+// Generation of a part as listed at opening, 0 if unknown
+std::int64_t GetPartGeneration(const MultiPartFile &multifile, size_t part_idx) {
+  return part_idx < multifile.generations_.size()
+             ? multifile.generations_[part_idx]
+             : 0;
+}
+
+// At the end of a part, check that its decoder reaches the end of the object,
+// and the checksum of the object if it was decoded from its start. An index
+// recorded while decoding is then complete.
+gc::Status FinishDecoding(MultiPartFile &multifile, size_t part_idx) {
+  DecodeState &state = *multifile.decoder_;
+  char extra{0};
+  auto maybe_extra = DecodeToBuffer(state, &extra, 1);
+  RETURN_STATUS_ON_ERROR(maybe_extra);
+  if (*maybe_extra > 0) {
+    return gc::Status{gc::StatusCode::kDataLoss,
+                      "Decoded data of " + state.object_name_ +
+                          " larger than its size of " +
+                          std::to_string(state.out_pos_ - 1) +
+                          " bytes, read at the end of the object"};
+  }
+  if (state.whole_ && part_idx < multifile.checksums_.size()) {
+    gc::Status status = CheckCrc32c(state.object_name_, state.crc32c_,
+                                    multifile.checksums_[part_idx]);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+  const CompressedPartIndex &index = *multifile.indexes_[part_idx];
+  if (state.on_progress_ && !index.IsComplete()) {
+    index.SetComplete();
+    spdlog::debug("Indexed {} while reading", state.object_name_);
+    if (!compressedIndexDir.empty()) {
+      PersistIndex(MakeObjectKey(state.bucket_name_, state.object_name_,
+                                 state.generation_),
+                   index);
+    }
+  }
+  return {};
+}
+
+// Read uncompressed bytes [start, end) of a compressed part into buffer
+gc::StatusOr<long long> DecodeRangeToBuffer(MultiPartFile &multifile,
+                                            size_t part_idx, char *buffer,
+                                            tOffset start, tOffset end) {
+  auto &state = multifile.decoder_;
+  const std::shared_ptr<const CompressedPartIndex> &index =
+      multifile.indexes_[part_idx];
+
+  // closest checkpoint before the requested range
+  const Checkpoint from = index->FindCheckpoint(start);
+
+  // the current decoder is reused if it is positioned on the same part, between
+  // that checkpoint and the requested range
+  if (!state || state->part_idx_ != part_idx || state->out_pos_ > start ||
+      state->out_pos_ < from.out_) {
+    state.reset();
+    auto maybe_state =
+        OpenDecodeState(multifile.bucketname_, multifile.filenames_[part_idx],
+                        GetPartGeneration(multifile, part_idx), part_idx,
+                        multifile.compression_, from);
+    RETURN_STATUS_ON_ERROR(maybe_state);
+    state = std::move(*maybe_state);
+    if (!index->IsComplete()) {
+      RecordCheckpoints(*state, index, from);
+    }
+  }
+
+  gc::Status status = SkipDecoded(*state, start - state->out_pos_);
+  if (!status.ok()) {
+    state.reset();
+    return status;
+  }
+
+  auto maybe_read = DecodeToBuffer(*state, buffer, end - start);
+  if (!maybe_read) {
+    state.reset();
+    return maybe_read;
+  }
+  if (state->out_pos_ == index->uncompressed_size_) {
+    status = FinishDecoding(multifile, part_idx);
+    state.reset();
+    if (!status.ok()) {
+      return status;
+    }
+  }
+  return maybe_read;
+}
+
+// Memory budget
+//
+// The buffers kept by the driver beyond a read or a write (prefetched and read
+// ahead blocks, small objects, compressed blocks waiting for their upload) are
+// reserved from a budget of GCS_MEMORY_BUDGET bytes for the process (1 GiB by
+// default, 0 for no limit). What does not fit is not buffered: a prefetch or a
+// read ahead is not made, the read then requesting its own bytes, and a writer
+// waits for the upload of its blocks in flight before compressing the next.
+constexpr long long default_memory_budget{1024LL * 1024 * 1024};
+long long memoryBudget{default_memory_budget};
+std::atomic<long long> reservedMemory{0};
+std::atomic<long long> peakReservedMemory{0};
+std::atomic<long long> nbDeclinedReservations{0};
+
+namespace gcsplugin {
+// Bytes reserved from the budget, released on destruction
+struct MemoryReservation {
+  MemoryReservation() = default;
+  MemoryReservation(const MemoryReservation &) = delete;
+  MemoryReservation &operator=(const MemoryReservation &) = delete;
+  MemoryReservation(MemoryReservation &&other) noexcept : size_{other.size_} {
+    other.size_ = 0;
+  }
+  MemoryReservation &operator=(MemoryReservation &&other) noexcept {
+    std::swap(size_, other.size_);
+    return *this;
+  }
+  ~MemoryReservation() { Release(); }
+
+  // force reserves over the budget, for a buffer needed to make progress
+  bool Reserve(long long size, bool force = false) {
+    long long reserved = reservedMemory.load();
+    do {
+      if (!force && memoryBudget > 0 && reserved + size > memoryBudget) {
+        nbDeclinedReservations++;
+        return false;
+      }
+    } while (!reservedMemory.compare_exchange_weak(reserved, reserved + size));
+    size_ += size;
+
+    long long peak = peakReservedMemory.load();
+    while (peak < reserved + size &&
+           !peakReservedMemory.compare_exchange_weak(peak, reserved + size)) {
+    }
+    return true;
+  }
+
+  void Release() {
+    reservedMemory -= size_;
+    size_ = 0;
+  }
+
+  long long size_{0};
+};
+} // namespace gcsplugin
+
+// Pooled I/O buffers
+//
+// The buffers of the transfers (prefetched and read ahead blocks, relay
+// buffers of the copies and of the staging) are page-aligned and rounded up to
+// a size class, a power of two from 4 KiB to 64 MiB. A released buffer is kept
+// in a free list of its class, for the next buffer of that class, as long as
+// the free lists hold less than GCS_BUFFER_POOL_SIZE bytes (64 MiB by
+// default). The pool is emptied on disconnection. A buffer that cannot be
+// allocated is reported as a kResourceExhausted status, the operation failing
+// through the error path of its driver function.
+constexpr size_t io_buffer_alignment{4096};
+constexpr size_t io_buffer_min_class{4096};
+constexpr size_t io_buffer_nb_classes{15}; // up to 64 MiB
+constexpr long long default_buffer_pool_size{64 * 1024 * 1024};
+long long bufferPoolSize{default_buffer_pool_size};
+// Relay buffers of the copies
+constexpr size_t copy_buffer_size{1024 * 1024};
+
+std::mutex buffer_pool_mutex;
+// never destroyed, the handles left open at exit release their buffers after
+// the destruction of the globals
+std::vector<std::vector<char *>> &buffer_pool =
+    *new std::vector<std::vector<char *>>(io_buffer_nb_classes);
+long long bufferPoolBytes{0}; // in the free lists
+std::atomic<long long> nbPooledBuffers{0};
+std::atomic<long long> nbAllocatedBuffers{0};
+
+char *AllocateAligned(size_t size) {
+#ifdef _WIN32
+  return static_cast<char *>(_aligned_malloc(size, io_buffer_alignment));
+#else
+  void *p{nullptr};
+  return 0 == posix_memalign(&p, io_buffer_alignment, size)
+             ? static_cast<char *>(p)
+             : nullptr;
+#endif
+}
+
+void FreeAligned(char *p) {
+#ifdef _WIN32
+  _aligned_free(p);
+#else
+  free(p);
+#endif
+}
+
+// Index of the smallest class holding size bytes, io_buffer_nb_classes if too
+// large for the pool
+size_t GetBufferClass(size_t size) {
+  size_t idx{0};
+  while (idx < io_buffer_nb_classes && (io_buffer_min_class << idx) < size) {
+    idx++;
+  }
+  return idx;
+}
+
+// Returns nullptr if the buffer cannot be allocated
+char *AcquireBuffer(size_t size, size_t &capacity) {
+  if (size > std::numeric_limits<size_t>::max() - io_buffer_alignment) {
+    return nullptr;
+  }
+  const size_t idx = GetBufferClass(size);
+  if (idx < io_buffer_nb_classes) {
+    capacity = io_buffer_min_class << idx;
+    std::lock_guard<std::mutex> lock{buffer_pool_mutex};
+    auto &free_list = buffer_pool[idx];
+    if (!free_list.empty()) {
+      char *p = free_list.back();
+      free_list.pop_back();
+      bufferPoolBytes -= static_cast<long long>(capacity);
+      nbPooledBuffers++;
+      return p;
+    }
+  } else {
+    capacity = (size + io_buffer_alignment - 1) / io_buffer_alignment *
+               io_buffer_alignment;
+  }
+  char *p = AllocateAligned(capacity);
+  if (p) {
+    nbAllocatedBuffers++;
+  }
+  return p;
+}
+
+void ReleaseBuffer(char *p, size_t capacity) {
+  const size_t idx = GetBufferClass(capacity);
+  if (idx < io_buffer_nb_classes) {
+    std::lock_guard<std::mutex> lock{buffer_pool_mutex};
+    if (bufferPoolBytes + static_cast<long long>(capacity) <= bufferPoolSize) {
+      buffer_pool[idx].push_back(p);
+      bufferPoolBytes += static_cast<long long>(capacity);
+      return;
+    }
+  }
+  FreeAligned(p);
+}
+
+void EmptyBufferPool() {
+  std::lock_guard<std::mutex> lock{buffer_pool_mutex};
+  for (auto &free_list : buffer_pool) {
+    for (char *p : free_list) {
+      FreeAligned(p);
+    }
+    free_list.clear();
+  }
+  bufferPoolBytes = 0;
+}
+
+namespace gcsplugin {
+// Buffer taken from the pool, given back on destruction. The buffer is empty
+// if it cannot be allocated, see MakeIoBuffer.
+struct IoBuffer {
+  IoBuffer() = default;
+  explicit IoBuffer(size_t size) {
+    if (size > 0) {
+      data_ = AcquireBuffer(size, capacity_);
+      size_ = data_ ? size : 0;
+    }
+  }
+  IoBuffer(const IoBuffer &) = delete;
+  IoBuffer &operator=(const IoBuffer &) = delete;
+  IoBuffer(IoBuffer &&other) noexcept
+      : data_{other.data_}, size_{other.size_}, capacity_{other.capacity_} {
+    other.data_ = nullptr;
+    other.size_ = 0;
+    other.capacity_ = 0;
+  }
+  IoBuffer &operator=(IoBuffer &&other) noexcept {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
+    return *this;
+  }
+  ~IoBuffer() {
+    if (data_) {
+      ReleaseBuffer(data_, capacity_);
+    }
+  }
+
+  char *data() { return data_; }
+  const char *data() const { return data_; }
+  size_t size() const { return size_; }
+  const char *begin() const { return data_; }
+  const char *end() const { return data_ + size_; }
+  // shrink only, e.g. to the count of bytes actually read
+  void resize(size_t size) { size_ = std::min(size, size_); }
+
+  char *data_{nullptr};
+  size_t size_{0};
+  size_t capacity_{0};
+};
+} // namespace gcsplugin
+
+gc::StatusOr<IoBuffer> MakeIoBuffer(size_t size) {
+  IoBuffer buffer(size);
+  if (buffer.size() < size) {
+    return gc::Status{gc::StatusCode::kResourceExhausted,
+                      "Cannot allocate a buffer of " + std::to_string(size) +
+                          " bytes"};
+  }
+  return buffer;
+}
+
+// Prefetching support
+//
+// When an uncompressed file is opened for reading, its first block of
+// GCS_PREFETCH_SIZE bytes (the preferred buffer size by default, 0 to disable)
+// is requested right away, and its last block as well if GCS_PREFETCH_LAST is
+// set. The first read, and the read following a seek near the end, are then
+// usually served from memory. The first block of a multifile gives the header
+// of its first part, it is fetched in place of that header by the background
+// resolution of the parts.
+long long prefetchSize{preferred_buffer_size};
+bool prefetchLast{false};
+
+namespace gcsplugin {
+struct PrefetchedBlock {
+  size_t part_idx_{0};
+  tOffset start_{0}; // in the part object
+  tOffset size_{0};  // requested, less is fetched at the end of the object
+  std::future<gc::StatusOr<IoBuffer>> task_;
+  gc::StatusOr<IoBuffer> data_; // once the task is over
+  bool read_ahead_{false}; // rest of an extended request, see below
+  MemoryReservation reservation_;
+};
+} // namespace gcsplugin
+
+gc::StatusOr<IoBuffer> FetchBlock(const std::string &bucket_name,
+                                  const std::string &object_name,
+                                  std::int64_t generation, tOffset start,
+                                  tOffset size) {
+  auto maybe_data = MakeIoBuffer(static_cast<size_t>(size));
+  RETURN_STATUS_ON_ERROR(maybe_data);
+  auto maybe_read = DownloadFileRangeToBuffer(bucket_name, object_name,
+                                              maybe_data->data(), start,
+                                              start + size, generation);
+  RETURN_STATUS_ON_ERROR(maybe_read);
+  maybe_data->resize(static_cast<size_t>(*maybe_read));
+  return maybe_data;
+}
+
+// Returns nullptr if the block does not fit in the memory budget
+std::shared_ptr<PrefetchedBlock>
+PrefetchBlock(const std::string &bucket_name, const std::string &object_name,
+              std::int64_t generation, size_t part_idx, tOffset start,
+              tOffset size) {
+  std::shared_ptr<PrefetchedBlock> block = std::make_shared<PrefetchedBlock>();
+  if (!block->reservation_.Reserve(size)) {
+    return nullptr;
+  }
+  block->part_idx_ = part_idx;
+  block->start_ = start;
+  block->size_ = size;
+  block->task_ = std::async(std::launch::async, FetchBlock, bucket_name,
+                            object_name, generation, start, size);
+  return block;
+}
+
+// Copy the start of the range [start, end) of a part from a prefetched block.
+// object_end tells if the copy stopped at the end of the part object. A block
+// read up to its end is released.
+tOffset ReadPrefetched(MultiPartFile &multifile, size_t part_idx, char *buffer,
+                       tOffset start, tOffset end, bool &object_end) {
+  auto &blocks = multifile.prefetched_;
+  for (auto it = blocks.begin(); it != blocks.end(); ++it) {
+    PrefetchedBlock &block = **it;
+    if (block.part_idx_ != part_idx || start < block.start_ ||
+        start >= block.start_ + block.size_) {
+      continue;
+    }
+    if (block.task_.valid()) {
+      block.data_ = block.task_.get();
+    }
+    if (!block.data_) {
+      // the range is requested again
+      spdlog::debug("Prefetch failed: {}", block.data_.status().message());
+      blocks.erase(it);
+      return 0;
+    }
+
+    const IoBuffer &data = *block.data_;
+    const tOffset block_end = block.start_ + static_cast<tOffset>(data.size());
+    const tOffset copied = std::max<tOffset>(std::min(end, block_end) - start, 0);
+    if (copied > 0) {
+      std::memcpy(buffer, data.data() + (start - block.start_),
+                  static_cast<size_t>(copied));
+    }
+    object_end = static_cast<tOffset>(data.size()) < block.size_ &&
+                 start + copied == block_end;
+    if (start + copied == block_end) {
+      blocks.erase(it);
+    }
+    return copied;
+  }
+  return 0;
+}
+
+// Prefetch the first block of a single file, and the last block of the last
+// part if requested
+void StartPrefetch(MultiPartFile &multifile, tOffset last_part_size) {
+  if (prefetchSize <= 0 || Compression::kNone != multifile.compression_ ||
+      multifile.content_) {
+    return;
+  }
+  const size_t nb_files = multifile.filenames_.size();
+  const size_t last_idx = nb_files - 1;
+  std::vector<std::shared_ptr<PrefetchedBlock>> blocks;
+  if (1 == nb_files) {
+    blocks.push_back(PrefetchBlock(multifile.bucketname_,
+                                   multifile.filenames_[0],
+                                   GetPartGeneration(multifile, 0), 0, 0,
+                                   std::min(prefetchSize, last_part_size)));
+  }
+  const tOffset last_start = std::max<tOffset>(last_part_size - prefetchSize, 0);
+  if (prefetchLast && (last_idx > 0 || last_start >= prefetchSize)) {
+    blocks.push_back(PrefetchBlock(
+        multifile.bucketname_, multifile.filenames_[last_idx],
+        GetPartGeneration(multifile, last_idx), last_idx, last_start,
+        last_part_size - last_start));
+  }
+  for (auto &block : blocks) {
+    if (block) {
+      multifile.prefetched_.push_back(std::move(block));
+    }
+  }
+}
+
+// Adaptive request sizing
+//
+// From its third read in a row, a handle reading sequentially sends requests
+// larger than its reads, the rest of the bytes being kept for the next reads.
+// The request size starts at GCS_READ_AHEAD_MIN_SIZE and doubles, up to
+// GCS_READ_AHEAD_MAX_SIZE (0 to disable), as long as the throughput of the
+// requests grows by more than a tenth: past the bandwidth-delay product of the
+// link, larger requests do not transfer faster. Each read away from the end of
+// the previous one halves the size and drops the bytes read ahead. The sizes
+// the handles settle on are averaged into the value returned by
+// driver_getSystemPreferredBufferSize, unless GCS_PREFERRED_BUFFER_SIZE is set.
+constexpr long long default_read_ahead_min_size{256 * 1024};
+constexpr long long default_read_ahead_max_size{64 * 1024 * 1024};
+constexpr int read_ahead_sequential_reads{2};
+constexpr double read_ahead_min_gain{1.1};
+long long readAheadMinSize{default_read_ahead_min_size};
+long long readAheadMaxSize{default_read_ahead_max_size};
+std::atomic<long long> learnedRequestSize{0};
+std::atomic<long long> nbReadAheadRequests{0};
+
+// Update the access pattern of a handle with a read at its current offset
+void TrackReadPosition(MultiPartFile &multifile) {
+  ReadAhead &state = multifile.read_ahead_;
+  if (multifile.offset_ == state.next_offset_) {
+    state.sequential_reads_++;
+    return;
+  }
+  if (state.next_offset_ < 0) {
+    return;
+  }
+
+  state.sequential_reads_ = 0;
+  if (state.request_size_ > 0) {
+    state.request_size_ = std::max(state.request_size_ / 2, readAheadMinSize);
+    state.last_rate_ = 0;
+    state.growing_ = true;
+  }
+  auto &blocks = multifile.prefetched_;
+  blocks.erase(std::remove_if(blocks.begin(), blocks.end(),
+                              [](const std::shared_ptr<PrefetchedBlock> &b) {
+                                return b->read_ahead_;
+                              }),
+               blocks.end());
+}
+
+void LearnRequestSize(long long size) {
+  long long learned = learnedRequestSize.load();
+  long long averaged{0};
+  do {
+    averaged = 0 == learned ? size : (3 * learned + size) / 4;
+  } while (!learnedRequestSize.compare_exchange_weak(learned, averaged));
+}
+
+// Grow the request size of a handle from the throughput of a request of size
+// bytes
+void AdaptRequestSize(ReadAhead &state, tOffset size, tOffset fetched,
+                      double seconds) {
+  if (fetched < size || seconds <= 0) {
+    // cut by the end of the object, or too fast to be measured
+    return;
+  }
+  const double rate = static_cast<double>(fetched) / seconds;
+  if (state.growing_) {
+    const bool faster =
+        0 == state.last_rate_ || rate > state.last_rate_ * read_ahead_min_gain;
+    if (faster && state.request_size_ < readAheadMaxSize) {
+      state.request_size_ = std::min(2 * state.request_size_, readAheadMaxSize);
+    } else {
+      state.growing_ = false;
+      LearnRequestSize(state.request_size_);
+    }
+  }
+  state.last_rate_ = rate;
+}
+
+// Read the range [start, end) of a part by a request of the size of the
+// handle, keeping the bytes past end for the next reads
+gc::StatusOr<long long> ReadAheadPartRange(MultiPartFile &multifile,
+                                           size_t part_idx,
+                                           const std::string &part_name,
+                                           char *buffer, tOffset start,
+                                           tOffset end) {
+  ReadAhead &state = multifile.read_ahead_;
+  if (0 == state.request_size_) {
+    state.request_size_ = readAheadMinSize;
+  }
+  const tOffset size = std::max(end - start, state.request_size_);
+  MemoryReservation reservation;
+  if (size > end - start && !reservation.Reserve(size)) {
+    // no room for the bytes ahead, only the range is requested and the next
+    // requests are smaller
+    state.request_size_ = std::max(state.request_size_ / 2, readAheadMinSize);
+    state.growing_ = false;
+    return DownloadFileRangeToBuffer(multifile.bucketname_, part_name, buffer,
+                                     start, end,
+                                     GetPartGeneration(multifile, part_idx));
+  }
+
+  const auto request_start = Clock::now();
+  auto maybe_data =
+      FetchBlock(multifile.bucketname_, part_name,
+                 GetPartGeneration(multifile, part_idx), start, size);
+  RETURN_STATUS_ON_ERROR(maybe_data);
+  const std::chrono::duration<double> elapsed = Clock::now() - request_start;
+  nbReadAheadRequests++;
+
+  IoBuffer &data = *maybe_data;
+  const tOffset fetched = static_cast<tOffset>(data.size());
+  const tOffset copied = std::min(fetched, end - start);
+  if (copied > 0) {
+    std::memcpy(buffer, data.data(), static_cast<size_t>(copied));
+  }
+  AdaptRequestSize(state, size, fetched, elapsed.count());
+
+  if (fetched > copied) {
+    auto block = std::make_shared<PrefetchedBlock>();
+    block->part_idx_ = part_idx;
+    block->start_ = start;
+    block->size_ = size;
+    block->data_ = std::move(data);
+    block->read_ahead_ = true;
+    block->reservation_ = std::move(reservation);
+    multifile.prefetched_.push_back(std::move(block));
+  }
+  return copied;
+}
+
+gc::StatusOr<long long> ReadPartRange(MultiPartFile &multifile, size_t part_idx,
+                                      const std::string &part_name,
+                                      char *buffer, tOffset start,
+                                      tOffset end) {
+  if (Compression::kNone != multifile.compression_) {
+    return DecodeRangeToBuffer(multifile, part_idx, buffer, start, end);
+  }
+
+  bool object_end{false};
+  const tOffset prefetched =
+      multifile.prefetched_.empty()
+          ? 0
+          : ReadPrefetched(multifile, part_idx, buffer, start, end, object_end);
+  if (start + prefetched == end || object_end) {
+    return prefetched;
+  }
+
+  if (readAheadMaxSize > 0 &&
+      multifile.read_ahead_.sequential_reads_ >= read_ahead_sequential_reads) {
+    auto maybe_read = ReadAheadPartRange(multifile, part_idx, part_name,
+                                         buffer + prefetched,
+                                         start + prefetched, end);
+    RETURN_STATUS_ON_ERROR(maybe_read);
+    return prefetched + *maybe_read;
+  }
+
+  auto maybe_read = DownloadFileRangeToBuffer(
+      multifile.bucketname_, part_name, buffer + prefetched,
+      static_cast<int64_t>(start + prefetched), static_cast<int64_t>(end),
+      GetPartGeneration(multifile, part_idx));
+  RETURN_STATUS_ON_ERROR(maybe_read);
+  return prefetched + *maybe_read;
+}
+
+// Place the read cursor on the part containing the current offset
+void PlaceReadCursor(MultiPartFile &multifile) {
+  const auto &cumul_sizes = multifile.cumulativeSize_;
+  const tOffset offset = multifile.offset_;
+  ReadCursor &cursor = multifile.cursor_;
+
+  auto greater_than_offset_it =
+      std::upper_bound(cumul_sizes.begin(), cumul_sizes.end(), offset);
+  size_t idx = static_cast<size_t>(
+      std::distance(cumul_sizes.begin(), greater_than_offset_it));
+  if (idx == cumul_sizes.size()) {
+    // at the end of the multifile: nothing left in the last part
+    idx--;
+  }
+  const tOffset part_start = idx == 0 ? 0 : cumul_sizes[idx - 1];
+
+  cursor.offset_ = offset;
+  cursor.part_idx_ = idx;
+  cursor.part_name_ = multifile.filenames_[idx];
+  cursor.part_pos_ =
+      offset - part_start + (idx == 0 ? 0 : multifile.commonHeaderLength_);
+  cursor.part_remaining_ = std::max<tOffset>(cumul_sizes[idx] - offset, 0);
+
+  LOG_HOT_DEBUG("Use item {} to read @ {} (end = {})", idx, offset,
+                cumul_sizes[idx]);
+}
+
+gc::StatusOr<long long> ReadBytesInFile(MultiPartFile &multifile, char *buffer,
+                                        tOffset to_read) {
+  tOffset &offset = multifile.offset_;
+  ReadCursor &cursor = multifile.cursor_;
+
+  // a small object is read from memory
+  if (multifile.content_) {
+    const std::vector<char> &content = *multifile.content_;
+    const tOffset available =
+        std::max<tOffset>(static_cast<tOffset>(content.size()) - offset, 0);
+    const tOffset copied = std::min(to_read, available);
+    if (copied > 0) {
+      std::memcpy(buffer, content.data() + offset, static_cast<size_t>(copied));
+    }
+    offset += copied;
+    return copied;
+  }
+
+  TrackReadPosition(multifile);
+
+  // a single part is read at the offset of the multifile
+  if (multifile.filenames_.size() == 1) {
+    if (cursor.part_name_.empty()) {
+      cursor.part_name_ = multifile.filenames_[0];
+    }
+    const tOffset end =
+        std::min(offset + to_read, multifile.cumulativeSize_.front());
+    auto maybe_read = ReadPartRange(multifile, 0, cursor.part_name_, buffer,
+                                    offset, end);
+    if (maybe_read) {
+      offset += *maybe_read;
+      multifile.read_ahead_.next_offset_ = offset;
+    }
+    return maybe_read;
+  }
+
+  // Start at the cursor, placed again only if the offset moved since the last
+  // read (seek). Advance through file chunks, advancing buffer pointer, until
+  // last requested byte was read or error occured
+  if (cursor.offset_ != offset) {
+    PlaceReadCursor(multifile);
+  }
+
+  const tOffset offset_bak = offset; // in case of irrecoverable error, leave
+                                     // the multifile in its starting state
+  tOffset bytes_read{0};
+
+  while (to_read > 0) {
+    if (0 == cursor.part_remaining_) {
+      // continue with the next file, after its header
+      const auto &cumul_sizes = multifile.cumulativeSize_;
+      const size_t idx = cursor.part_idx_ + 1;
+      if (idx >= cumul_sizes.size()) {
+        break;
+      }
+      cursor.part_idx_ = idx;
+      cursor.part_name_ = multifile.filenames_[idx];
+      cursor.part_pos_ = multifile.commonHeaderLength_;
+      cursor.part_remaining_ = cumul_sizes[idx] - cumul_sizes[idx - 1];
+      continue;
+    }
+
+    const tOffset expected_read = std::min(to_read, cursor.part_remaining_);
+    auto maybe_actual_read =
+        ReadPartRange(multifile, cursor.part_idx_, cursor.part_name_,
+                      buffer + bytes_read, cursor.part_pos_,
+                      cursor.part_pos_ + expected_read);
+    if (!maybe_actual_read) {
+      offset = offset_bak;
+      cursor.offset_ = -1;
+      RETURN_STATUS(maybe_actual_read);
+    }
+
+    const tOffset actual_read = *maybe_actual_read;
+    bytes_read += actual_read;
+    offset += actual_read;
+    cursor.offset_ = offset;
+    cursor.part_pos_ += actual_read;
+    cursor.part_remaining_ -= actual_read;
+
+    if (actual_read < expected_read) {
+      LOG_HOT_DEBUG("End of file encountered");
+      break;
+    }
+    to_read -= actual_read;
+  }
+
+  multifile.read_ahead_.next_offset_ = offset;
+  return bytes_read;
+}
+
+// Small objects support
+//
+// The objects up to GCS_SMALL_OBJECT_SIZE bytes (0 to disable) are fetched in
+// one request when opened for reading, their reads and seeks are then served
+// from memory. Only single uncompressed objects qualify, whose listed size is
+// the one presented to the reader.
+constexpr long long default_small_object_size{1024 * 1024};
+long long smallObjectSize{default_small_object_size};
+
+gc::Status FetchSmallObject(MultiPartFile &multifile) {
+  const tOffset size = multifile.total_size_;
+  if (multifile.filenames_.size() != 1 ||
+      Compression::kNone != multifile.compression_ || size <= 0 ||
+      size > smallObjectSize) {
+    return {};
+  }
+
+  // the reservation is released along with the content
+  auto reservation = std::make_shared<MemoryReservation>();
+  if (!reservation->Reserve(size)) {
+    return {};
+  }
+  const std::string name = multifile.filenames_[0];
+  std::shared_ptr<std::vector<char>> content(
+      new std::vector<char>(static_cast<size_t>(size)),
+      [reservation](std::vector<char> *p) { delete p; });
+  auto maybe_read =
+      DownloadFileRangeToBuffer(multifile.bucketname_, name, content->data(),
+                                0, size, GetPartGeneration(multifile, 0));
+  RETURN_STATUS_ON_ERROR(maybe_read);
+  content->resize(static_cast<size_t>(*maybe_read));
+
+  if (!multifile.checksums_.empty()) {
+    gc::Status status = CheckCrc32c(
+        name, ExtendCrc32c(0, content->data(), content->size()),
+        multifile.checksums_[0]);
+    if (!status.ok()) {
+      return status;
+    }
+  }
+
+  spdlog::debug("Fetched {} bytes of {}", content->size(), name);
+  multifile.content_ = std::move(content);
+  return {};
+}
+
+struct ParseUriResult {
+  std::string bucket;
+  std::string object;
+};
+
+gc::StatusOr<ParseUriResult> ParseGcsUri(const std::string &gcs_uri) {
+  char const *prefix = "gs://";
+  const size_t prefix_size{std::strlen(prefix)};
+  if (gcs_uri.compare(0, prefix_size, prefix) != 0) {
+    return gc::Status{gc::StatusCode::kInvalidArgument,
+                      "Invalid GCS URI: " + gcs_uri};
+  }
+
+  const size_t pos = gcs_uri.find('/', prefix_size);
+  if (pos == std::string::npos) {
+    return gc::Status{gc::StatusCode::kInvalidArgument,
+                      "Invalid GCS URI, missing object name: " + gcs_uri};
+  }
+
+  return ParseUriResult{gcs_uri.substr(prefix_size, pos - prefix_size),
+                        gcs_uri.substr(pos + 1)};
+}
+
+gc::StatusOr<ParseUriResult> GetBucketAndObjectNames(
+    const char *sFilePathName) //, std::string &bucket, std::string &object)
+{
+  auto maybe_parse_res = ParseGcsUri(sFilePathName);
+  if (!maybe_parse_res) {
+    return maybe_parse_res;
+  }
+
+  // fallback to default bucket if bucket empty
+  if (maybe_parse_res->bucket.empty()) {
+    if (globalBucketName.empty()) {
+      maybe_parse_res =
+          gc::Status{gc::StatusCode::kInternal,
+                     "No bucket specified and GCS_BUCKET_NAME is not set!"};
+    } else {
+      maybe_parse_res->bucket = globalBucketName;
+    }
+  }
+  return maybe_parse_res;
+}
+
+std::string ToLower(const std::string &str) {
+  std::string low{str};
+  const size_t cnt = low.length();
+  for (size_t i = 0; i < cnt; i++) {
+    low[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(
+        low[i]))); // see https://en.cppreference.com/w/cpp/string/byte/tolower
+  }
+  return low;
+}
+
+std::string GetEnvironmentVariableOrDefault(const std::string &variable_name,
+                                            const std::string &default_value) {
+#ifdef _WIN32
+  size_t len;
+  char value[2048];
+  getenv_s(&len, value, 2048, variable_name.c_str());
+#else
+  char *value = getenv(variable_name.c_str());
+#endif
+
+  if (value && std::strlen(value) > 0) {
+    return value;
+  }
+
+  const std::string low_key = ToLower(variable_name);
+  if (low_key.find("token") || low_key.find("password") ||
+      low_key.find("key") || low_key.find("secret")) {
+    spdlog::debug("No {} specified, using **REDACTED** as default.",
+                  variable_name);
+  } else {
+    spdlog::debug("No {} specified, using '{}' as default.", variable_name,
+                  default_value);
+  }
+
+  return default_value;
+}
+
+long long GetEnvironmentVariableAsLong(const std::string &variable_name,
+                                      long long default_value) {
+  const std::string value = GetEnvironmentVariableOrDefault(
+      variable_name, std::to_string(default_value));
+  char *end{nullptr};
+  const long long parsed = std::strtoll(value.c_str(), &end, 10);
+  if (end == value.c_str() || *end != '\0') {
+    spdlog::warn("Invalid value '{}' for {}, using {} instead", value,
+                 variable_name, default_value);
+    return default_value;
+  }
+  return parsed;
+}
+
+// Number of worker threads used by the parallel operations of the driver.
+// Default value is the number of cores, can be overriden by setting
+// GCS_DRIVER_THREADS
+size_t GetDriverThreads() {
+  const long long nb_cores{
+      std::max(1LL, static_cast<long long>(std::thread::hardware_concurrency()))};
+  return static_cast<size_t>(
+      std::max(1LL, GetEnvironmentVariableAsLong("GCS_DRIVER_THREADS", nb_cores)));
+}
+
+// The worker threads started by the parallel operations are counted over all
+// the operations, so that nested ones, e.g. the listings of the patterns of a
+// batch lookup, do not multiply the threads. A worker is started only within
+// the budget, the calling thread takes the tasks left otherwise.
+constexpr size_t max_workers_per_thread{4};
+std::atomic<size_t> nbParallelWorkers{0};
+
+bool AcquireWorkerSlot() {
+  const size_t max_workers = GetDriverThreads() * max_workers_per_thread;
+  size_t nb_workers = nbParallelWorkers.load();
+  while (nb_workers < max_workers) {
+    if (nbParallelWorkers.compare_exchange_weak(nb_workers, nb_workers + 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void ReleaseWorkerSlots(size_t count) { nbParallelWorkers -= count; }
+
+// Run task(i) for each i in [0, count) on at most max_workers threads, the
+// calling thread included. Returns the first failure, if any. No new task is
+// started once a task has failed.
+gc::Status ParallelFor(size_t count, size_t max_workers,
+                       const std::function<gc::Status(size_t)> &task) {
+  std::atomic<size_t> next{0};
+  std::atomic<bool> failed{false};
+  std::mutex failure_mutex;
+  gc::Status first_failure;
+
+  auto work = [&]() {
+    for (size_t i = next++; i < count && !failed; i = next++) {
+      gc::Status status = task(i);
+      if (!status.ok()) {
+        std::lock_guard<std::mutex> lock{failure_mutex};
+        if (!failed.exchange(true)) {
+          first_failure = std::move(status);
+        }
+      }
+    }
+  };
+
+  const size_t nb_workers = std::min(count, max_workers);
+  std::vector<std::future<void>> workers;
+  for (size_t i = 1; i < nb_workers && AcquireWorkerSlot(); i++) {
+    try {
+      workers.push_back(std::async(std::launch::async, work));
+    } catch (const std::system_error &e) {
+      spdlog::debug("Running with {} workers, no more threads: {}",
+                    workers.size() + 1, e.what());
+      ReleaseWorkerSlots(1);
+      break;
+    }
+  }
+  work();
+  for (auto &worker : workers) {
+    worker.get();
+  }
+  ReleaseWorkerSlots(workers.size());
+
+  return first_failure;
+}
+
+bool WillSizeCountProductOverflow(size_t size, size_t count) {
+  constexpr size_t max_prod_usable{
+      static_cast<size_t>(std::numeric_limits<tOffset>::max())};
+  return (max_prod_usable / size < count || max_prod_usable / count < size);
+}
+
+// The listings ask for the largest pages, and only for the fields used by the
+// driver
+constexpr std::int64_t max_list_page_size{1000};
+constexpr const char *list_objects_fields =
+    "items(name,size,generation,crc32c,contentEncoding),nextPageToken";
+
+gc::StatusOr<gcs::ListObjectsReader>
+ListObjects(const std::string &bucket_name, const std::string &object_name) {
+  auto list = client.ListObjects(bucket_name, gcs::MatchGlob{object_name},
+                                 gcs::Fields(list_objects_fields),
+                                 gcs::MaxResults(max_list_page_size));
+  auto first = list.begin();
+  if (first == list.end()) {
+    return gc::Status{gc::StatusCode::kNotFound,
+                      "Error while searching object : not found"};
+  }
+  if (!first->ok()) {
+    return std::move(*first).status();
+  }
+  return list;
+}
+
+// Names without any glob character are looked up directly, which costs less
+// than a listing. The other ones are taken as patterns: an object whose name
+// holds glob characters is matched only where they match themselves, as '*'
+// and '?' do, so driver_remove tries the exact name first.
+bool IsGlobPattern(const std::string &object_name) {
+  return object_name.find_first_of("*?[]{}\\") != std::string::npos;
+}
+
+constexpr const char *object_metadata_fields =
+    "name,size,generation,crc32c,contentEncoding";
+
+gc::StatusOr<gcs::ObjectMetadata>
+GetObjectMetadata(const std::string &bucket_name,
+                  const std::string &object_name) {
+  auto maybe_meta = client.GetObjectMetadata(
+      bucket_name, object_name, gcs::Fields(object_metadata_fields));
+  if (!maybe_meta &&
+      gc::StatusCode::kNotFound == maybe_meta.status().code()) {
+    return gc::Status{gc::StatusCode::kNotFound,
+                      "Error while searching object : not found"};
+  }
+  return maybe_meta;
+}
+
+// Parallel listings
+//
+// A glob listing starts as a single range of names, after the literal prefix of
+// the pattern, listed by the calling thread. Each time the listing of a range
+// has gone through a full page while a worker is idle, or can be started
+// within the worker budget, the rest of the range is split at a name in the
+// middle, and the upper part is handed to that worker. A listing of a single
+// page starts no thread. The ranges are disjoint, their results are
+// concatenated in the order of the ranges.
+namespace gcsplugin {
+struct ListRange {
+  std::string start_;
+  std::string end_; // unbounded if empty
+  std::vector<gcs::ObjectMetadata> objects_;
+};
+} // namespace gcsplugin
+
+std::string GetLiteralPrefix(const std::string &pattern) {
+  return pattern.substr(0, pattern.find_first_of("*?[]{}\\"));
+}
+
+// Returns a name strictly between last and end, made of a part of last and of
+// one printable ASCII character, so that the split does not break a UTF-8
+// sequence. The names matching the pattern share its literal prefix, which
+// bounds an unbounded end. The character is taken in the middle of the class
+// (digits, upper or lower case letters) of the one in last, the names of
+// shards being mostly numbered. Returns an empty string if there is no room.
+std::string GetMiddleName(const std::string &last, const std::string &end,
+                          const std::string &prefix) {
+  constexpr unsigned lowest{0x20};
+  constexpr unsigned highest{0x7f}; // excluded
+  auto byte_at = [](const std::string &name, size_t i) -> unsigned {
+    return i < name.size() ? static_cast<unsigned char>(name[i]) : 0;
+  };
+  auto class_end = [](unsigned c) -> unsigned {
+    if (c >= '0' && c <= '9') {
+      return '9' + 1;
+    }
+    if (c >= 'A' && c <= 'Z') {
+      return 'Z' + 1;
+    }
+    if (c >= 'a' && c <= 'z') {
+      return 'z' + 1;
+    }
+    return highest;
+  };
+
+  const std::string bound =
+      end.empty() ? prefix + static_cast<char>(highest) : end;
+  size_t i{0};
+  while (i < bound.size() && byte_at(last, i) == byte_at(bound, i)) {
+    i++;
+  }
+  if (i < bound.size() && byte_at(last, i) < byte_at(bound, i)) {
+    const unsigned lo = std::max(byte_at(last, i), lowest);
+    const unsigned hi =
+        std::min(byte_at(bound, i), class_end(byte_at(last, i)));
+    if (hi > lo + 1) {
+      return last.substr(0, i) + static_cast<char>((lo + hi) / 2);
+    }
+  }
+
+  // no room at this byte: keep it as in last, and split on a following byte
+  for (size_t j = i + 1; j <= last.size(); j++) {
+    const unsigned c = byte_at(last, j);
+    const unsigned lo = std::max(c, lowest);
+    const unsigned hi = class_end(c);
+    if (c < highest && hi > lo + 1) {
+      return last.substr(0, j) + static_cast<char>((lo + hi) / 2);
+    }
+  }
+  return {};
+}
+
+// Metadata of the objects matching a glob pattern, in the order of their names
+gc::StatusOr<std::vector<gcs::ObjectMetadata>>
+ListObjectsInParallel(const std::string &bucket_name,
+                      const std::string &pattern) {
+  const size_t max_workers = GetDriverThreads();
+  std::deque<ListRange> ranges; // references stay valid on push_back
+  std::deque<ListRange *> pending;
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<std::future<void>> workers; // besides the calling thread
+  size_t nb_busy{0};
+  std::atomic<bool> failed{false};
+  gc::Status first_failure;
+
+  const std::string prefix = GetLiteralPrefix(pattern);
+  ranges.push_back(ListRange{prefix, {}, {}});
+  pending.push_back(&ranges.back());
+
+  std::function<void()> work;
+
+  // start a worker for a split, returns false if none can be started
+  auto start_worker = [&]() {
+    if (workers.size() + 1 >= max_workers || !AcquireWorkerSlot()) {
+      return false;
+    }
+    try {
+      workers.push_back(std::async(std::launch::async, work));
+    } catch (const std::system_error &e) {
+      spdlog::debug("Listing with {} workers, no more threads: {}",
+                    workers.size() + 1, e.what());
+      ReleaseWorkerSlots(1);
+      return false;
+    }
+    return true;
+  };
+
+  // hand the rest of the range after last to an idle or a new worker, if any
+  auto try_split = [&](ListRange &range, const std::string &last) {
+    std::lock_guard<std::mutex> lock{mutex};
+    std::string middle = GetMiddleName(last, range.end_, prefix);
+    if (middle.empty()) {
+      return false;
+    }
+    const bool idle_worker = nb_busy + pending.size() < workers.size() + 1;
+    if (!idle_worker && !start_worker()) {
+      return false;
+    }
+    ranges.push_back(ListRange{middle, range.end_, {}});
+    pending.push_back(&ranges.back());
+    range.end_ = std::move(middle);
+    cv.notify_one();
+    return true;
+  };
+
+  auto list_range = [&](ListRange &range) -> gc::Status {
+    std::string start = range.start_;
+    std::string last; // the listing is restarted at the last name on a split
+    bool split{true};
+    while (split && !failed) {
+      split = false;
+      auto list = client.ListObjects(
+          bucket_name, gcs::MatchGlob{pattern},
+          start.empty() ? gcs::StartOffset() : gcs::StartOffset(start),
+          range.end_.empty() ? gcs::EndOffset() : gcs::EndOffset(range.end_),
+          gcs::Fields(list_objects_fields), gcs::MaxResults(max_list_page_size));
+      std::int64_t nb_listed{0};
+      for (auto &&maybe_object : list) {
+        RETURN_STATUS_ON_ERROR(maybe_object);
+        if (!last.empty() && maybe_object->name() <= last) {
+          continue;
+        }
+        last = maybe_object->name();
+        range.objects_.push_back(std::move(*maybe_object));
+        if (++nb_listed % max_list_page_size == 0 && try_split(range, last)) {
+          split = true;
+          start = last;
+          break;
+        }
+      }
+    }
+    return {};
+  };
+
+  work = [&]() {
+    std::unique_lock<std::mutex> lock{mutex};
+    for (;;) {
+      cv.wait(lock, [&] { return !pending.empty() || nb_busy == 0 || failed; });
+      if (pending.empty() || failed) {
+        cv.notify_all();
+        return;
+      }
+      ListRange &range = *pending.front();
+      pending.pop_front();
+      nb_busy++;
+      lock.unlock();
+      gc::Status status = list_range(range);
+      lock.lock();
+      nb_busy--;
+      if (!status.ok() && !failed.exchange(true)) {
+        first_failure = std::move(status);
+      }
+      cv.notify_all();
+    }
+  };
+
+  // the workers started by the splits are done once the calling thread is,
+  // no range being left
+  work();
+  for (auto &worker : workers) {
+    worker.get();
+  }
+  ReleaseWorkerSlots(workers.size());
+  if (failed) {
+    return first_failure;
+  }
+
+  std::sort(ranges.begin(), ranges.end(),
+            [](const ListRange &a, const ListRange &b) {
+              return a.start_ < b.start_;
+            });
+  std::vector<gcs::ObjectMetadata> objects;
+  for (auto &range : ranges) {
+    std::move(range.objects_.begin(), range.objects_.end(),
+              std::back_inserter(objects));
+  }
+  if (objects.empty()) {
+    return gc::Status{gc::StatusCode::kNotFound,
+                      "Error while searching object : not found"};
+  }
+  return objects;
+}
+
+// Metadata cache
+//
+// The files looked up by driver_getFilesMetadata are kept for
+// GCS_METADATA_CACHE_TTL seconds, so that the opens and size queries following
+// a pre-flight check do not look them up again. Only the files found are kept.
+// The entries of a bucket are dropped when the driver writes or deletes objects
+// in it.
+namespace gcsplugin {
+struct CachedMetadata {
+  Clock::time_point expiry_;
+  std::vector<gcs::ObjectMetadata> objects_;
+  long long size_{-1}; // as presented by a reader
+};
+} // namespace gcsplugin
+
+constexpr long long default_metadata_cache_ttl{60};
+long long metadataCacheTtl{default_metadata_cache_ttl};
+std::mutex metadata_cache_mutex;
+std::unordered_map<std::string, CachedMetadata> metadata_cache;
+std::atomic<long long> nbMetadataCacheHits{0};
+
+bool FindCachedMetadata(const std::string &bucket_name,
+                        const std::string &object_name, CachedMetadata &found) {
+  std::lock_guard<std::mutex> lock{metadata_cache_mutex};
+  auto it = metadata_cache.find(bucket_name + '/' + object_name);
+  if (it == metadata_cache.end()) {
+    return false;
+  }
+  if (Clock::now() >= it->second.expiry_) {
+    metadata_cache.erase(it);
+    return false;
+  }
+  found = it->second;
+  nbMetadataCacheHits++;
+  return true;
 }
 
-void EraseRemove(HandleIt pos) {
-  *pos = std::move(active_handles.back());
-  active_handles.pop_back();
+void CacheMetadata(const std::string &bucket_name,
+                   const std::string &object_name,
+                   std::vector<gcs::ObjectMetadata> objects, long long size) {
+  if (metadataCacheTtl <= 0) {
+    return;
+  }
+  CachedMetadata entry{Clock::now() + std::chrono::seconds(metadataCacheTtl),
+                       std::move(objects), size};
+  std::lock_guard<std::mutex> lock{metadata_cache_mutex};
+  metadata_cache[bucket_name + '/' + object_name] = std::move(entry);
 }
 
-// Definition of helper functions
-gc::StatusOr<long long int>
-DownloadFileRangeToBuffer(const std::string &bucket_name,
-                          const std::string &object_name, char *buffer,
-                          std::int64_t start_range, std::int64_t end_range) {
-  auto reader = client.ReadObject(bucket_name, object_name,
-                                  gcs::ReadRange(start_range, end_range));
-  if (!reader) {
-    auto &o_status = reader.status();
-    return gc::Status{o_status.code(), "Error while creating reading stream; " +
-                                           o_status.message()};
+// A new object may match any pattern of its bucket: all the entries of the
+// bucket are dropped
+void ForgetBucketMetadata(const std::string &bucket_name) {
+  const std::string prefix = bucket_name + '/';
+  std::lock_guard<std::mutex> lock{metadata_cache_mutex};
+  for (auto it = metadata_cache.begin(); it != metadata_cache.end();) {
+    if (it->first.compare(0, prefix.size(), prefix) == 0) {
+      it = metadata_cache.erase(it);
+    } else {
+      ++it;
+    }
   }
+}
 
-  reader.read(buffer, end_range - start_range);
-  if (reader.bad()) {
-    auto &o_status = reader.status();
-    return gc::Status{o_status.code(), "Error while creating reading stream; " +
-                                           o_status.message()};
+// Metadata of the objects matching a name or a glob pattern, kNotFound if none
+gc::StatusOr<std::vector<gcs::ObjectMetadata>>
+LookUpObjectsMetadata(const std::string &bucket_name,
+                      const std::string &object_name) {
+  if (IsGlobPattern(object_name)) {
+    return ListObjectsInParallel(bucket_name, object_name);
   }
 
-  long long int num_read = static_cast<long long>(reader.gcount());
-  spdlog::debug("read = {}", num_read);
-
-  return num_read;
+  auto maybe_meta = GetObjectMetadata(bucket_name, object_name);
+  RETURN_STATUS_ON_ERROR(maybe_meta);
+  return std::vector<gcs::ObjectMetadata>{std::move(*maybe_meta)};
 }
 
-gc::StatusOr<long long> ReadBytesInFile(MultiPartFile &multifile, char *buffer,
-                                        tOffset to_read) {
-  // Start at first usable file chunk
-  // Advance through file chunks, advancing buffer pointer
-  // Until last requested byte was read
-  // Or error occured
-
-  tOffset bytes_read{0};
-
-  // Lookup item containing initial bytes at requested offset
-  const auto &cumul_sizes = multifile.cumulativeSize_;
-  const tOffset common_header_length = multifile.commonHeaderLength_;
-  const std::string &bucket_name = multifile.bucketname_;
-  const auto &filenames = multifile.filenames_;
-  char *buffer_pos = buffer;
-  tOffset &offset = multifile.offset_;
-  const tOffset offset_bak = offset; // in case of irrecoverable error, leave
-                                     // the multifile in its starting state
+// Same, served by the metadata cache when the file is there
+gc::StatusOr<std::vector<gcs::ObjectMetadata>>
+GetObjectsMetadata(const std::string &bucket_name,
+                   const std::string &object_name) {
+  CachedMetadata cached;
+  if (FindCachedMetadata(bucket_name, object_name, cached)) {
+    return std::move(cached.objects_);
+  }
+  return LookUpObjectsMetadata(bucket_name, object_name);
+}
 
-  auto greater_than_offset_it =
-      std::upper_bound(cumul_sizes.begin(), cumul_sizes.end(), offset);
-  size_t idx = static_cast<size_t>(
-      std::distance(cumul_sizes.begin(), greater_than_offset_it));
+// Compressed outputs support
+//
+// Objects written with a .gz or .zst name, or with a compression set by
+// GCS_WRITE_COMPRESSION, are compressed by blocks on worker threads. Each block
+// makes an independent gzip member or zstd frame, and the concatenation of the
+// blocks is a valid gzip stream or a zstd stream in the seekable format. The
+// compressed blocks are uploaded in order, while the next blocks are compressed.
+namespace gcsplugin {
+struct CompressState {
+  Compression compression_{Compression::kNone};
+  std::string pending_; // bytes waiting for a complete block
+  std::deque<std::future<gc::StatusOr<std::string>>> in_flight_;
+  std::deque<MemoryReservation> reservations_; // of the blocks in flight
+  // zstd seek table entries: compressed and uncompressed sizes of the frames
+  std::vector<std::pair<uint32_t, uint32_t>> frames_;
+  // gzip size member: sizes of the blocks pushed and uploaded
+  uint64_t uncompressed_size_{0};
+  uint64_t stored_size_{0};
+  size_t nb_uploaded_{0};
+  bool has_output_{false};
+};
+} // namespace gcsplugin
+
+// Default values below can be overriden by setting GCS_COMPRESSION_BLOCK_SIZE
+// and GCS_COMPRESSION_LEVEL. A level of 0 selects the default level of the
+// library.
+constexpr long long default_compression_block_size = 4 * 1024 * 1024;
+constexpr long long max_compression_block_size = 1024 * 1024 * 1024;
+long long compressionBlockSize{default_compression_block_size};
+int compressionLevel{0};
+
+// Compression of the written objects whose name does not tell it, set by
+// GCS_WRITE_COMPRESSION to gzip or zstd
+Compression writeCompression{Compression::kNone};
+
+bool HasExtension(const std::string &name, const std::string &ext) {
+  return name.size() > ext.size() &&
+         ToLower(name.substr(name.size() - ext.size())) == ext;
+}
 
-  spdlog::debug("Use item {} to read @ {} (end = {})", idx, offset,
-                *greater_than_offset_it);
+Compression GetCompressionFromName(const std::string &name) {
+  if (HasExtension(name, ".gz")) {
+    return Compression::kGzip;
+  }
+  if (HasExtension(name, ".zst")) {
+    return Compression::kZstd;
+  }
+  return Compression::kNone;
+}
 
-  auto read_range_and_update = [&](const std::string &filename, tOffset start,
-                                   tOffset end) -> gc::Status {
-    auto maybe_actual_read = DownloadFileRangeToBuffer(
-        bucket_name, filename, buffer_pos, static_cast<int64_t>(start),
-        static_cast<int64_t>(end));
-    if (!maybe_actual_read) {
-      offset = offset_bak;
-      RETURN_STATUS(maybe_actual_read);
-    }
+// Content-Encoding of the objects, set on the objects compressed on writing
+// without a name telling it
+Compression GetCompressionFromEncoding(const std::string &encoding) {
+  if (encoding == "gzip") {
+    return Compression::kGzip;
+  }
+  if (encoding == "zstd") {
+    return Compression::kZstd;
+  }
+  return Compression::kNone;
+}
 
-    tOffset actual_read = *maybe_actual_read;
+const char *GetContentEncoding(Compression compression) {
+  return Compression::kZstd == compression ? "zstd" : "gzip";
+}
 
-    bytes_read += actual_read;
-    buffer_pos += actual_read;
-    offset += actual_read;
+Compression GetWriteCompression(const std::string &name) {
+  const Compression from_name = GetCompressionFromName(name);
+  return Compression::kNone != from_name ? from_name : writeCompression;
+}
 
-    if (actual_read < (end - start) /*expected read*/) {
-      spdlog::debug("End of file encountered");
-      to_read = 0;
-    } else {
-      to_read -= actual_read;
+gc::StatusOr<std::string> CompressBlock(Compression compression,
+                                        const std::string &block) {
+  if (Compression::kZstd == compression) {
+    std::string out(ZSTD_compressBound(block.size()), '\0');
+    const size_t ret = ZSTD_compress(&out[0], out.size(), block.data(),
+                                     block.size(), compressionLevel);
+    if (ZSTD_isError(ret)) {
+      return gc::Status{gc::StatusCode::kInternal,
+                        std::string("Error while compressing data: ") +
+                            ZSTD_getErrorName(ret)};
     }
-
-    return {};
-  };
-
-  // first file read
-
-  const tOffset file_start =
-      (idx == 0) ? offset
-                 : offset - cumul_sizes[idx - 1] + common_header_length;
-  const tOffset read_end =
-      std::min(file_start + to_read, file_start + cumul_sizes[idx] - offset);
-
-  gc::Status read_status =
-      read_range_and_update(filenames[idx], file_start, read_end);
-
-  // continue with the next files
-  while (read_status.ok() && to_read) {
-    // read the missing bytes in the next files as necessary
-    idx++;
-    const tOffset start = common_header_length;
-    const tOffset end = std::min(start + to_read, start + cumul_sizes[idx] -
-                                                      cumul_sizes[idx - 1]);
-
-    read_status = read_range_and_update(filenames[idx], start, end);
+    out.resize(ret);
+    return out;
   }
 
-  return read_status.ok() ? bytes_read : gc::StatusOr<long long>{read_status};
+  // windowBits 15 + 16 for a gzip wrapper around the deflate stream
+  z_stream strm{};
+  const int level = compressionLevel != 0 ? compressionLevel : Z_DEFAULT_COMPRESSION;
+  if (deflateInit2(&strm, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) !=
+      Z_OK) {
+    return gc::Status{gc::StatusCode::kInternal,
+                      "Error while initializing the gzip encoder"};
+  }
+  std::string out(deflateBound(&strm, static_cast<uLong>(block.size())), '\0');
+  strm.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(block.data()));
+  strm.avail_in = static_cast<uInt>(block.size());
+  strm.next_out = reinterpret_cast<Bytef *>(&out[0]);
+  strm.avail_out = static_cast<uInt>(out.size());
+  const int ret = deflate(&strm, Z_FINISH);
+  out.resize(strm.total_out);
+  deflateEnd(&strm);
+  if (ret != Z_STREAM_END) {
+    return gc::Status{gc::StatusCode::kInternal,
+                      "Error while compressing data: " + std::to_string(ret)};
+  }
+  return out;
 }
 
-struct ParseUriResult {
-  std::string bucket;
-  std::string object;
-};
-
-gc::StatusOr<ParseUriResult> ParseGcsUri(const std::string &gcs_uri) {
-  char const *prefix = "gs://";
-  const size_t prefix_size{std::strlen(prefix)};
-  if (gcs_uri.compare(0, prefix_size, prefix) != 0) {
-    return gc::Status{gc::StatusCode::kInvalidArgument,
-                      "Invalid GCS URI: " + gcs_uri};
+// Upload the oldest compressed block
+gc::Status PopCompressedBlock(WriteFile &writer_h) {
+  CompressState &state = *writer_h.compressor_;
+  auto maybe_block = state.in_flight_.front().get();
+  state.in_flight_.pop_front();
+  MemoryReservation reservation = std::move(state.reservations_.front());
+  state.reservations_.pop_front();
+  RETURN_STATUS_ON_ERROR(maybe_block);
+
+  if (Compression::kZstd == state.compression_) {
+    state.frames_[state.nb_uploaded_].first =
+        static_cast<uint32_t>(maybe_block->size());
   }
+  state.stored_size_ += maybe_block->size();
+  state.nb_uploaded_++;
 
-  const size_t pos = gcs_uri.find('/', prefix_size);
-  if (pos == std::string::npos) {
-    return gc::Status{gc::StatusCode::kInvalidArgument,
-                      "Invalid GCS URI, missing object name: " + gcs_uri};
+  auto &writer = writer_h.writer_;
+  WriteToObject(writer_h, maybe_block->data(),
+                static_cast<std::streamsize>(maybe_block->size()));
+  if (writer.bad()) {
+    return writer.last_status();
   }
-
-  return ParseUriResult{gcs_uri.substr(prefix_size, pos - prefix_size),
-                        gcs_uri.substr(pos + 1)};
+  return {};
 }
 
-gc::StatusOr<ParseUriResult> GetBucketAndObjectNames(
-    const char *sFilePathName) //, std::string &bucket, std::string &object)
-{
-  auto maybe_parse_res = ParseGcsUri(sFilePathName);
-  if (!maybe_parse_res) {
-    return maybe_parse_res;
+gc::Status PushCompressedBlock(WriteFile &writer_h, std::string block) {
+  CompressState &state = *writer_h.compressor_;
+
+  // keep a bounded number of blocks in memory: the writer waits for the
+  // upload of the oldest block when all workers are busy, or when the block
+  // does not fit in the memory budget. A single block is always allowed.
+  const size_t max_in_flight = 2 * GetDriverThreads();
+  const long long block_size = static_cast<long long>(block.size());
+  MemoryReservation reservation;
+  while (state.in_flight_.size() >= max_in_flight ||
+         !reservation.Reserve(block_size, state.in_flight_.empty())) {
+    gc::Status status = PopCompressedBlock(writer_h);
+    if (!status.ok()) {
+      return status;
+    }
   }
 
-  // fallback to default bucket if bucket empty
-  if (maybe_parse_res->bucket.empty()) {
-    if (globalBucketName.empty()) {
-      maybe_parse_res =
-          gc::Status{gc::StatusCode::kInternal,
-                     "No bucket specified and GCS_BUCKET_NAME is not set!"};
-    } else {
-      maybe_parse_res->bucket = globalBucketName;
-    }
+  if (Compression::kZstd == state.compression_) {
+    // the compressed size is recorded once the block is compressed
+    state.frames_.emplace_back(0, static_cast<uint32_t>(block.size()));
   }
-  return maybe_parse_res;
+  state.uncompressed_size_ += block.size();
+  const Compression compression = state.compression_;
+  state.reservations_.push_back(std::move(reservation));
+  state.in_flight_.push_back(std::async(
+      std::launch::async, [compression](std::string b) {
+        return CompressBlock(compression, b);
+      },
+      std::move(block)));
+  state.has_output_ = true;
+  return {};
 }
 
-std::string ToLower(const std::string &str) {
-  std::string low{str};
-  const size_t cnt = low.length();
-  for (size_t i = 0; i < cnt; i++) {
-    low[i] = static_cast<char>(std::tolower(static_cast<unsigned char>(
-        low[i]))); // see https://en.cppreference.com/w/cpp/string/byte/tolower
+gc::Status WriteCompressed(WriteFile &writer_h, const char *data,
+                           long long size) {
+  CompressState &state = *writer_h.compressor_;
+  const size_t block_size = static_cast<size_t>(compressionBlockSize);
+
+  while (size > 0) {
+    const size_t to_copy = std::min(block_size - state.pending_.size(),
+                                    static_cast<size_t>(size));
+    state.pending_.append(data, to_copy);
+    data += to_copy;
+    size -= static_cast<long long>(to_copy);
+
+    if (state.pending_.size() == block_size) {
+      std::string block;
+      block.reserve(block_size);
+      std::swap(block, state.pending_);
+      gc::Status status = PushCompressedBlock(writer_h, std::move(block));
+      if (!status.ok()) {
+        return status;
+      }
+    }
   }
-  return low;
+  return {};
 }
 
-std::string GetEnvironmentVariableOrDefault(const std::string &variable_name,
-                                            const std::string &default_value) {
-#ifdef _WIN32
-  size_t len;
-  char value[2048];
-  getenv_s(&len, value, 2048, variable_name.c_str());
-#else
-  char *value = getenv(variable_name.c_str());
-#endif
+// Compress and upload all the written bytes. On closing, the stream is
+// completed with the zstd seek table or the gzip size member.
+gc::Status FlushCompressed(WriteFile &writer_h, bool closing) {
+  CompressState &state = *writer_h.compressor_;
+
+  // an empty object still needs a gzip member or a zstd frame to be valid
+  if (!state.pending_.empty() || (closing && !state.has_output_)) {
+    std::string block;
+    std::swap(block, state.pending_);
+    gc::Status status = PushCompressedBlock(writer_h, std::move(block));
+    if (!status.ok()) {
+      return status;
+    }
+  }
 
-  if (value && std::strlen(value) > 0) {
-    return value;
+  while (!state.in_flight_.empty()) {
+    gc::Status status = PopCompressedBlock(writer_h);
+    if (!status.ok()) {
+      return status;
+    }
   }
 
-  const std::string low_key = ToLower(variable_name);
-  if (low_key.find("token") || low_key.find("password") ||
-      low_key.find("key") || low_key.find("secret")) {
-    spdlog::debug("No {} specified, using **REDACTED** as default.",
-                  variable_name);
-  } else {
-    spdlog::debug("No {} specified, using '{}' as default.", variable_name,
-                  default_value);
+  if (!closing) {
+    return {};
   }
 
-  return default_value;
-}
+  if (Compression::kGzip == state.compression_) {
+    const std::string member = MakeGzipSizeMember(
+        state.uncompressed_size_, state.stored_size_ + gzip_size_member_size);
+    WriteToObject(writer_h, member.data(),
+                  static_cast<std::streamsize>(member.size()));
+    if (writer_h.writer_.bad()) {
+      return writer_h.writer_.last_status();
+    }
+    return {};
+  }
 
-bool WillSizeCountProductOverflow(size_t size, size_t count) {
-  constexpr size_t max_prod_usable{
-      static_cast<size_t>(std::numeric_limits<tOffset>::max())};
-  return (max_prod_usable / size < count || max_prod_usable / count < size);
+  // seek table, in a skippable frame ignored by the decoders
+  const size_t entry_size = 8;
+  std::string table(zstd_skippable_header_size +
+                        state.frames_.size() * entry_size +
+                        zstd_seek_footer_size,
+                    '\0');
+  char *p = &table[0];
+  WriteLE32(p, zstd_skippable_magic);
+  WriteLE32(p + 4,
+            static_cast<uint32_t>(table.size() - zstd_skippable_header_size));
+  p += zstd_skippable_header_size;
+  for (const auto &frame : state.frames_) {
+    WriteLE32(p, frame.first);
+    WriteLE32(p + 4, frame.second);
+    p += entry_size;
+  }
+  WriteLE32(p, static_cast<uint32_t>(state.frames_.size()));
+  p[4] = 0; // no checksums
+  WriteLE32(p + 5, zstd_seekable_magic);
+
+  WriteToObject(writer_h, table.data(),
+                static_cast<std::streamsize>(table.size()));
+  if (writer_h.writer_.bad()) {
+    return writer_h.writer_.last_status();
+  }
+  return {};
 }
 
-gc::StatusOr<gcs::ListObjectsReader>
-ListObjects(const std::string &bucket_name, const std::string &object_name) {
-  auto list = client.ListObjects(bucket_name, gcs::MatchGlob{object_name});
-  auto first = list.begin();
-  if (first == list.end()) {
-    return gc::Status{gc::StatusCode::kNotFound,
-                      "Error while searching object : not found"};
+// Complete the upload of a writer: compressed writers first complete the
+// compression of their blocks. A corrupted object is not left in place.
+gc::StatusOr<gcs::ObjectMetadata> CompleteUpload(WriteFile &writer_h) {
+  if (writer_h.compressor_) {
+    gc::Status status = FlushCompressed(writer_h, true);
+    if (!status.ok()) {
+      return gc::Status{status.code(),
+                        "Error while compressing the data; " + status.message()};
+    }
   }
-  if (!first->ok()) {
-    return std::move(*first).status();
+
+  // close the stream to flush all remaining bytes in the put area
+  auto &writer = writer_h.writer_;
+  writer.Close();
+  gc::StatusOr<gcs::ObjectMetadata> maybe_meta = writer.metadata();
+  if (maybe_meta) {
+    gc::Status crc_status =
+        CheckCrc32c(writer_h.filename_, writer_h.crc32c_, maybe_meta->crc32c());
+    if (!crc_status.ok()) {
+      client.DeleteObject(writer_h.bucketname_, writer_h.filename_);
+      maybe_meta = std::move(crc_status);
+    }
   }
-  return list;
+  return maybe_meta;
 }
 
 // pre condition: stream is of a writing type. do not call otherwise.
 gc::Status CloseWriterStream(Handle &stream) {
-  gc::StatusOr<gcs::ObjectMetadata> maybe_meta;
   std::ostringstream err_msg_os;
 
-  // close the stream to flush all remaining bytes in the put area
-  auto &writer = stream.GetWriter().writer_;
-  writer.Close();
-  maybe_meta = writer.metadata();
+  auto &writer_h = stream.GetWriter();
+  gc::StatusOr<gcs::ObjectMetadata> maybe_meta = CompleteUpload(writer_h);
   if (!maybe_meta) {
     err_msg_os << "Error during upload";
   } else if (HandleType::kAppend == stream.type) {
     // the tmp file is valid and ready for composition with the source
-    const auto &writer_h = stream.GetWriter();
     const std::string &bucket = writer_h.bucketname_;
     const std::string &append_source = writer_h.filename_;
     const std::string &dest = writer_h.append_target_;
     std::vector<gcs::ComposeSourceObject> source_objects = {
         {dest, {}, {}}, {append_source, {}, {}}};
-    maybe_meta = client.ComposeObject(bucket, std::move(source_objects), dest);
+    // the composition does not keep the Content-Encoding of the target,
+    // that tells the compression when the name does not
+    gcs::WithObjectMetadata dest_meta;
+    if (writer_h.compressor_) {
+      const Compression compression = writer_h.compressor_->compression_;
+      if (GetCompressionFromName(dest) != compression) {
+        dest_meta = gcs::WithObjectMetadata(gcs::ObjectMetadata().set_content_encoding(
+            GetContentEncoding(compression)));
+      }
+    }
+    maybe_meta = client.ComposeObject(bucket, std::move(source_objects), dest,
+                                      std::move(dest_meta));
 
     // whatever happened, delete the tmp file
     gc::Status delete_status = client.DeleteObject(bucket, append_source);
@@ -406,6 +3716,20 @@ void *test_addWriterHandle(bool appendMode, bool create_with_mock_client,
   return InsertHandle<WriterPtr, HandleType::kWrite>(std::move(writer_struct));
 }
 
+std::string test_getMiddleName(const std::string &last, const std::string &end,
+                               const std::string &prefix) {
+  return GetMiddleName(last, end, prefix);
+}
+
+const void *test_takeIoBuffer(size_t size) {
+  IoBuffer buffer(size);
+  return buffer.data();
+}
+
+long long test_getCoalescedRequests() { return nbCoalescedRequests.load(); }
+
+long long test_getReservedMemory() { return reservedMemory.load(); }
+
 const char *driver_getDriverName() { return driver_name; }
 
 const char *driver_getVersion() { return version; }
@@ -415,6 +3739,9 @@ const char *driver_getScheme() { return driver_scheme; }
 int driver_isReadOnly() { return kFalse; }
 
 int driver_connect() {
+  if (GetEnvironmentVariableOrDefault("GCS_DRIVER_LOG_ASYNC", "0") != "0") {
+    UseAsyncLogger();
+  }
   const std::string loglevel =
       GetEnvironmentVariableOrDefault("GCS_DRIVER_LOGLEVEL", "info");
   if (loglevel == "debug")
@@ -428,6 +3755,83 @@ int driver_connect() {
 
   // Initialize variables from environment
   globalBucketName = GetEnvironmentVariableOrDefault("GCS_BUCKET_NAME", "");
+  compressedIndexSpan = std::max(
+      1LL, GetEnvironmentVariableAsLong("GCS_COMPRESSED_INDEX_SPAN",
+                                        default_compressed_index_span));
+  compressedIndexDir =
+      GetEnvironmentVariableOrDefault("GCS_COMPRESSED_INDEX_DIR", "");
+  stallMinRate = std::min<long long>(
+      std::numeric_limits<std::uint32_t>::max(),
+      std::max(0LL, GetEnvironmentVariableAsLong("GCS_STALL_MIN_RATE",
+                                                 default_stall_min_rate)));
+  stallTimeout = std::max(0LL, GetEnvironmentVariableAsLong("GCS_STALL_TIMEOUT", 0));
+  diskCacheDir = GetEnvironmentVariableOrDefault("GCS_DISK_CACHE_DIR", "");
+  sharedCacheSize =
+      std::max(0LL, GetEnvironmentVariableAsLong("GCS_SHARED_CACHE_SIZE", 0));
+  sharedCacheBlockSize = std::max(
+      1LL, GetEnvironmentVariableAsLong("GCS_SHARED_CACHE_BLOCK_SIZE",
+                                        default_shared_cache_block_size));
+#ifdef _WIN32
+  const std::string default_shared_cache_name{"khiops-gcs-cache"};
+#else
+  const std::string default_shared_cache_name{"/khiops-gcs-cache-" +
+                                              std::to_string(getuid())};
+#endif
+  sharedCacheName = GetEnvironmentVariableOrDefault("GCS_SHARED_CACHE_NAME",
+                                                    default_shared_cache_name);
+  AttachSharedCache();
+  prefetchSize = std::max(
+      0LL, GetEnvironmentVariableAsLong("GCS_PREFETCH_SIZE",
+                                        driver_getSystemPreferredBufferSize()));
+  prefetchLast = GetEnvironmentVariableAsLong("GCS_PREFETCH_LAST", 0) != 0;
+  bufferPoolSize = std::max(
+      0LL, GetEnvironmentVariableAsLong("GCS_BUFFER_POOL_SIZE",
+                                        default_buffer_pool_size));
+  memoryBudget = std::max(
+      0LL, GetEnvironmentVariableAsLong("GCS_MEMORY_BUDGET",
+                                        default_memory_budget));
+  metadataCacheTtl = std::max(
+      0LL, GetEnvironmentVariableAsLong("GCS_METADATA_CACHE_TTL",
+                                        default_metadata_cache_ttl));
+  readAheadMinSize = std::max(
+      1LL, GetEnvironmentVariableAsLong("GCS_READ_AHEAD_MIN_SIZE",
+                                        default_read_ahead_min_size));
+  readAheadMaxSize = std::max(
+      0LL, GetEnvironmentVariableAsLong("GCS_READ_AHEAD_MAX_SIZE",
+                                        default_read_ahead_max_size));
+  smallObjectSize = std::max(
+      0LL, GetEnvironmentVariableAsLong("GCS_SMALL_OBJECT_SIZE",
+                                        default_small_object_size));
+  readResumeAttempts = std::max(
+      0LL, GetEnvironmentVariableAsLong("GCS_READ_RESUME_ATTEMPTS",
+                                        default_read_resume_attempts));
+  const std::string validate_checksums =
+      ToLower(GetEnvironmentVariableOrDefault("GCS_VALIDATE_CHECKSUMS", "1"));
+  hedgeReads = GetEnvironmentVariableAsLong("GCS_HEDGE_READS", 0) != 0;
+  hedgePercentile = std::min(
+      100LL, std::max(1LL, GetEnvironmentVariableAsLong("GCS_HEDGE_PERCENTILE",
+                                                        hedgePercentile)));
+  hedgeMaxPercent = std::max(
+      0LL, GetEnvironmentVariableAsLong("GCS_HEDGE_MAX_PERCENT", hedgeMaxPercent));
+  validateChecksums = validate_checksums != "0" &&
+                      validate_checksums != "false" &&
+                      validate_checksums != "off";
+  compressionBlockSize = std::min(
+      max_compression_block_size,
+      std::max(1LL, GetEnvironmentVariableAsLong(
+                        "GCS_COMPRESSION_BLOCK_SIZE",
+                        default_compression_block_size)));
+  compressionLevel =
+      static_cast<int>(GetEnvironmentVariableAsLong("GCS_COMPRESSION_LEVEL", 0));
+  const std::string write_compression =
+      ToLower(GetEnvironmentVariableOrDefault("GCS_WRITE_COMPRESSION", ""));
+  writeCompression = GetCompressionFromEncoding(write_compression);
+  if (Compression::kNone == writeCompression && !write_compression.empty() &&
+      write_compression != "none") {
+    spdlog::warn("Invalid value '{}' for GCS_WRITE_COMPRESSION, objects are "
+                 "written uncompressed",
+                 write_compression);
+  }
 
   gc::Options options{};
 
@@ -477,6 +3881,69 @@ int driver_disconnect() {
   }
   active_handles.clear();
 
+  if (nbStalledRequests > 0) {
+    spdlog::info("Stalled transfers: {} requests aborted and resumed",
+                 nbStalledRequests.load());
+  }
+
+  if (nbAllocatedBuffers > 0) {
+    spdlog::info("Buffer pool: {} buffers allocated, {} reused",
+                 nbAllocatedBuffers.load(), nbPooledBuffers.load());
+  }
+  EmptyBufferPool();
+
+  if (peakReservedMemory > 0) {
+    spdlog::info("Memory budget: {} bytes reserved at the peak, {} still "
+                 "reserved, {} reservations declined (budget {})",
+                 peakReservedMemory.load(), reservedMemory.load(),
+                 nbDeclinedReservations.load(), memoryBudget);
+  }
+
+  if (nbReadAheadRequests > 0) {
+    spdlog::info("Read-ahead: {} extended requests, preferred buffer size {}",
+                 nbReadAheadRequests.load(),
+                 driver_getSystemPreferredBufferSize());
+  }
+
+  if (nbMetadataCacheHits > 0) {
+    spdlog::info("Metadata cache: {} lookups served from the cache",
+                 nbMetadataCacheHits.load());
+  }
+  {
+    std::lock_guard<std::mutex> lock{metadata_cache_mutex};
+    metadata_cache.clear();
+  }
+
+  if (nbDiskCacheReads > 0) {
+    spdlog::info("Disk cache: {} reads served from {}", nbDiskCacheReads.load(),
+                 diskCacheDir);
+  }
+  {
+    std::lock_guard<std::mutex> lock{staged_files_mutex};
+    staged_files.clear();
+  }
+
+  if (sharedCacheHeader) {
+    spdlog::info("Shared cache: {} blocks read from the cache, {} downloads",
+                 nbSharedCacheHits.load(), nbSharedCacheMisses.load());
+    DetachSharedCache();
+  }
+
+  if (nbCoalescedRequests > 0) {
+    spdlog::info("Single-flight requests: {} ranges served by concurrent "
+                 "requests",
+                 nbCoalescedRequests.load());
+  }
+
+  if (hedgeReads) {
+    WaitForHedgeAttempts();
+    spdlog::info("Hedged reads: {} of {} ranged requests hedged, {} won by the "
+                 "hedge",
+                 nbHedgedRequests.load(), nbRangeRequests.load(),
+                 nbHedgeWins.load());
+  }
+
+  UseSyncLogger();
   bIsConnected = false;
 
   if (failures.empty()) {
@@ -495,8 +3962,10 @@ int driver_disconnect() {
 int driver_isConnected() { return bIsConnected ? 1 : 0; }
 
 long long int driver_getSystemPreferredBufferSize() {
+  const long long learned_size = learnedRequestSize.load();
   std::string configured_preferred_size = GetEnvironmentVariableOrDefault(
-      "GCS_PREFERRED_BUFFER_SIZE", std::to_string(preferred_buffer_size));
+      "GCS_PREFERRED_BUFFER_SIZE",
+      std::to_string(learned_size > 0 ? learned_size : preferred_buffer_size));
   return std::stoi(configured_preferred_size);
 }
 
@@ -536,11 +4005,18 @@ int driver_fileExists(const char *sFilePathName) {
   auto maybe_parsed_names = GetBucketAndObjectNames(sFilePathName);
   ERROR_ON_NAMES(maybe_parsed_names, kFalse);
 
-  auto maybe_list =
-      ListObjects(maybe_parsed_names->bucket, maybe_parsed_names->object);
-  if (!maybe_list) {
-    if (maybe_list.status().code() != gc::StatusCode::kNotFound) {
-      LogBadStatus((maybe_list).status(), ("Error checking if file exists"));
+  const auto &names = *maybe_parsed_names;
+  CachedMetadata cached;
+  if (FindCachedMetadata(names.bucket, names.object, cached)) {
+    return kTrue;
+  }
+  const gc::Status status =
+      IsGlobPattern(names.object)
+          ? ListObjects(names.bucket, names.object).status()
+          : GetObjectMetadata(names.bucket, names.object).status();
+  if (!status.ok()) {
+    if (status.code() != gc::StatusCode::kNotFound) {
+      LogBadStatus(status, ("Error checking if file exists"));
     }
     return kFalse;
   }
@@ -549,77 +4025,430 @@ int driver_fileExists(const char *sFilePathName) {
   return kTrue; // L'objet existe
 }
 
-int driver_dirExists(const char *sFilePathName) {
-  ERROR_ON_NULL_ARG(sFilePathName, "Error passing null pointer to dirExists",
-                    kFalse);
+int driver_dirExists(const char *sFilePathName) {
+  ERROR_ON_NULL_ARG(sFilePathName, "Error passing null pointer to dirExists",
+                    kFalse);
+
+  spdlog::debug("dirExist {}", sFilePathName);
+  return kTrue;
+}
+
+gc::StatusOr<std::string> ReadHeader(const std::string &bucket_name,
+                                     const std::string &filename,
+                                     std::int64_t generation) {
+  std::string line;
+  std::ifstream staged;
+  std::int64_t staged_size{0};
+  if (!diskCacheDir.empty() && 0 != generation &&
+      OpenDiskCacheFile(MakeObjectKey(bucket_name, filename, generation),
+                        staged, staged_size)) {
+    std::getline(staged, line, '\n');
+    if (!staged.eof()) {
+      line.push_back('\n');
+    }
+  } else {
+    gcs::ObjectReadStream stream =
+        client.ReadObject(bucket_name, filename, gcs::AcceptEncodingGzip(),
+                          MakeDownloadStallOptions());
+    std::getline(stream, line, '\n');
+    if (stream.bad()) {
+      return stream.status();
+    }
+    if (!stream.eof()) {
+      line.push_back('\n');
+    }
+  }
+  if (line.empty()) {
+    return gc::Status{gc::StatusCode::kInternal, "Got an empty header"};
+  }
+  return line;
+}
+
+Compression GetObjectCompression(const gcs::ObjectMetadata &object) {
+  const Compression from_name = GetCompressionFromName(object.name());
+  if (Compression::kNone != from_name) {
+    return from_name;
+  }
+  return GetCompressionFromEncoding(object.content_encoding());
+}
+
+// Lazy multifile opening
+//
+// A multifile is readable as soon as its parts are listed and its first part
+// resolved: the header and, for compressed parts, the index of the other parts
+// are obtained in the background. Their offsets depend on all the headers being
+// the same, the reads past the first part wait for the resolution of all of
+// them, as do the seeks from the end and the requests of the size.
+namespace gcsplugin {
+struct PendingParts {
+  // inputs
+  std::string bucket_name_;
+  std::string key_; // of the part tables
+  PartNames filenames_;
+  std::vector<long long> sizes_; // uncompressed once the index is built
+  PartGenerations generations_;
+  PartChecksums checksums_;
+  Compression compression_{Compression::kNone};
+  PartIndexes::Storage indexes_; // completed by the resolution
+  tOffset first_block_size_{0}; // prefetched for the handle if not 0
+  std::promise<gc::StatusOr<IoBuffer>> first_block_;
+
+  // results
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool done_{false};
+  gc::Status status_;
+  tOffset common_header_length_{0};
+  std::vector<tOffset> cumulative_sizes_;
+
+  std::atomic<bool> cancelled_{false};
+  std::future<void> task_;
+
+  ~PendingParts() {
+    // the handle is closed: stop between two parts
+    cancelled_ = true;
+    if (task_.valid()) {
+      task_.wait();
+    }
+  }
+};
+} // namespace gcsplugin
+
+// Build the index of a compressed part, that gives its uncompressed size
+gc::Status ResolvePartIndex(
+    const std::string &bucket_name, const std::string &filename,
+    std::int64_t generation, Compression compression,
+    const std::string &checksum, long long &size,
+    std::shared_ptr<const CompressedPartIndex> &index) {
+  if (Compression::kNone == compression) {
+    return {};
+  }
+  auto maybe_index = GetCompressedPartIndex(bucket_name, filename, generation,
+                                            compression, size, checksum);
+  RETURN_STATUS_ON_ERROR(maybe_index);
+  index = std::move(*maybe_index);
+  size = index->uncompressed_size_;
+  return {};
+}
+
+gc::StatusOr<std::string>
+ReadPartHeader(const std::string &bucket_name, const std::string &filename,
+               std::int64_t generation,
+               const std::shared_ptr<const CompressedPartIndex> &index) {
+  if (!index) {
+    return ReadHeader(bucket_name, filename, generation);
+  }
+  if (index->first_line_.empty()) {
+    return gc::Status{gc::StatusCode::kInternal, "Got an empty header"};
+  }
+  return index->first_line_;
+}
+
+// Part tables of the open multifiles, shared between the handles opened on the
+// same URI as long as they list the same parts. The tables of the closed
+// multifiles are forgotten when a table is shared.
+std::mutex part_tables_mutex;
+template <typename Storage>
+using PartTableCache =
+    std::unordered_map<std::string, std::weak_ptr<const Storage>>;
+PartTableCache<PartNames::Storage> part_names_cache;
+PartTableCache<PartSizes::Storage> part_sizes_cache;
+PartTableCache<PartGenerations::Storage> part_generations_cache;
+PartTableCache<PartChecksums::Storage> part_checksums_cache;
+PartTableCache<PartIndexes::Storage> part_indexes_cache;
+
+template <typename Storage>
+std::shared_ptr<const Storage> ShareStorage(PartTableCache<Storage> &cache,
+                                            const std::string &key,
+                                            std::shared_ptr<const Storage> storage) {
+  std::lock_guard<std::mutex> lock{part_tables_mutex};
+  for (auto it = cache.begin(); it != cache.end();) {
+    if (it->second.expired() && it->first != key) {
+      it = cache.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  auto &entry = cache[key];
+  std::shared_ptr<const Storage> cached = entry.lock();
+  if (cached && *cached == *storage) {
+    return cached;
+  }
+  entry = storage;
+  return storage;
+}
+
+template <typename Table>
+Table ShareTable(PartTableCache<typename Table::Storage> &cache,
+                 const std::string &key, typename Table::Storage values) {
+  return Table{ShareStorage(
+      cache, key,
+      std::make_shared<const typename Table::Storage>(std::move(values)))};
+}
+
+// The header of a part from its first block, empty if the block does not hold
+// it
+std::string GetBlockHeader(const IoBuffer &data, bool whole_object) {
+  auto newline_it = std::find(data.begin(), data.end(), '\n');
+  if (newline_it != data.end()) {
+    return std::string(data.begin(), std::next(newline_it));
+  }
+  return whole_object ? std::string(data.begin(), data.end()) : std::string{};
+}
+
+// The header of the first part, taken from its first block when that block is
+// prefetched. The block is handed to the handle either way.
+gc::StatusOr<std::string> ResolveFirstHeader(PendingParts &parts) {
+  std::string header;
+  if (parts.first_block_size_ > 0) {
+    gc::StatusOr<IoBuffer> maybe_data =
+        parts.cancelled_
+            ? gc::StatusOr<IoBuffer>{gc::Status{gc::StatusCode::kCancelled,
+                                                "Stream closed"}}
+            : FetchBlock(parts.bucket_name_, parts.filenames_[0],
+                         parts.generations_[0], 0, parts.first_block_size_);
+    if (maybe_data) {
+      header = GetBlockHeader(*maybe_data,
+                              parts.first_block_size_ == parts.sizes_[0]);
+    }
+    parts.first_block_.set_value(std::move(maybe_data));
+  }
+  if (!header.empty()) {
+    return header;
+  }
+  return ReadPartHeader(parts.bucket_name_, parts.filenames_[0],
+                        parts.generations_[0], parts.indexes_[0]);
+}
+
+// Resolve the parts after the first one, and their offsets in the multifile
+void ResolvePendingParts(PendingParts &parts) {
+  const size_t nb_files = parts.filenames_.size();
+  std::atomic<bool> same_header{true};
+  std::string first_header;
+
+  auto maybe_first_header = ResolveFirstHeader(parts);
+  gc::Status status = maybe_first_header.status();
+  if (status.ok()) {
+    first_header = std::move(*maybe_first_header);
+    status = ParallelFor(
+        nb_files - 1, GetDriverThreads(), [&](size_t k) -> gc::Status {
+          if (parts.cancelled_) {
+            return gc::Status{gc::StatusCode::kCancelled, "Stream closed"};
+          }
+          const size_t i = k + 1;
+          gc::Status index_status = ResolvePartIndex(
+              parts.bucket_name_, parts.filenames_[i], parts.generations_[i],
+              parts.compression_, parts.checksums_[i], parts.sizes_[i],
+              parts.indexes_[i]);
+          if (!index_status.ok()) {
+            return index_status;
+          }
+          // the headers are no longer needed once one of them differs
+          if (!same_header) {
+            return {};
+          }
+          auto maybe_header =
+              ReadPartHeader(parts.bucket_name_, parts.filenames_[i],
+                             parts.generations_[i], parts.indexes_[i]);
+          RETURN_STATUS_ON_ERROR(maybe_header);
+          if (*maybe_header != first_header) {
+            same_header = false;
+          }
+          return {};
+        });
+  }
 
-  spdlog::debug("dirExist {}", sFilePathName);
-  return kTrue;
+  std::vector<tOffset> cumulative_sizes(nb_files);
+  tOffset common_header_length{0};
+  if (status.ok()) {
+    std::partial_sum(parts.sizes_.begin(), parts.sizes_.end(),
+                     cumulative_sizes.begin());
+    // if headers remained the same, adjust cumulative_sizes
+    if (same_header) {
+      common_header_length = static_cast<tOffset>(first_header.size());
+      for (size_t i = 0; i < nb_files; i++) {
+        cumulative_sizes[i] -= static_cast<tOffset>(i) * common_header_length;
+      }
+    }
+  }
+
+  std::lock_guard<std::mutex> lock{parts.mutex_};
+  parts.status_ = std::move(status);
+  parts.cumulative_sizes_ = std::move(cumulative_sizes);
+  parts.common_header_length_ = common_header_length;
+  parts.done_ = true;
+  parts.cv_.notify_all();
 }
 
-gc::StatusOr<std::string> ReadHeader(const std::string &bucket_name,
-                                     const std::string &filename) {
-  gcs::ObjectReadStream stream = client.ReadObject(bucket_name, filename);
-  std::string line;
-  std::getline(stream, line, '\n');
-  if (stream.bad()) {
-    return stream.status();
+// Wait for the parts of a multifile resolved in the background, if any
+gc::Status ResolveParts(MultiPartFile &multifile) {
+  if (!multifile.pending_) {
+    return {};
   }
-  if (!stream.eof()) {
-    line.push_back('\n');
+  PendingParts &parts = *multifile.pending_;
+  {
+    std::unique_lock<std::mutex> lock{parts.mutex_};
+    parts.cv_.wait(lock, [&] { return parts.done_; });
   }
-  if (line.empty()) {
-    return gc::Status{gc::StatusCode::kInternal, "Got an empty header"};
+  if (!parts.status_.ok()) {
+    return parts.status_;
   }
-  return line;
+
+  multifile.commonHeaderLength_ = parts.common_header_length_;
+  multifile.cumulativeSize_ = ShareTable<PartSizes>(
+      part_sizes_cache, parts.key_, std::move(parts.cumulative_sizes_));
+  multifile.total_size_ = multifile.cumulativeSize_.back();
+  if (Compression::kNone != multifile.compression_) {
+    multifile.indexes_ = ShareTable<PartIndexes>(
+        part_indexes_cache, parts.key_, std::move(parts.indexes_));
+  }
+  multifile.pending_.reset();
+  return {};
 }
 
-gc::StatusOr<long long> GetFileSize(const std::string &bucket_name,
-                                    const std::string &object_name) {
-  auto maybe_list = ListObjects(bucket_name, object_name);
-  RETURN_STATUS_ON_ERROR(maybe_list);
+// With prefetch, for the opening of a stream, the content expected to be read
+// first is requested as well
+gc::StatusOr<ReaderPtr>
+MakeReaderPtr(std::string bucketname, std::string objectname,
+              const std::vector<gcs::ObjectMetadata> &objects, bool prefetch) {
+  std::vector<std::string> filenames;
+  std::vector<long long> sizes;
+  std::vector<std::int64_t> generations;
+  std::vector<std::string> checksums;
+  std::vector<Compression> compressions;
+
+  for (const auto &object : objects) {
+    filenames.push_back(object.name());
+    sizes.push_back(static_cast<long long>(object.size()));
+    generations.push_back(object.generation());
+    checksums.push_back(object.crc32c());
+    compressions.push_back(GetObjectCompression(object));
+  }
 
-  auto list_it = maybe_list->begin();
-  const auto list_end = maybe_list->end();
+  const size_t nb_files = filenames.size();
+  const Compression compression =
+      nb_files > 0 ? compressions.front() : Compression::kNone;
 
-  const auto first_object_metadata = std::move(*list_it);
-  long long total_size = static_cast<long long>(first_object_metadata->size());
+  if (std::count(compressions.begin(), compressions.end(), compression) !=
+      static_cast<std::ptrdiff_t>(nb_files)) {
+    return gc::Status{
+        gc::StatusCode::kInvalidArgument,
+        "Mixing parts of different compressions is not supported"};
+  }
 
-  list_it++;
-  if (list_end == list_it) {
-    // unique file
-    return total_size;
+  // the listed sizes are the compressed ones. The uncompressed sizes and
+  // headers are obtained from the indexes of the parts.
+  PartIndexes::Storage indexes(nb_files);
+  gc::Status index_status =
+      ResolvePartIndex(bucketname, filenames[0], generations[0], compression,
+                       checksums[0], sizes[0], indexes[0]);
+  if (!index_status.ok()) {
+    return index_status;
   }
 
-  // multifile
-  // check headers
-  auto maybe_header = ReadHeader(bucket_name, first_object_metadata->name());
-  RETURN_STATUS_ON_ERROR(maybe_header);
+  const std::string key = bucketname + '/' + objectname;
+  PartNames names{ShareStorage(part_names_cache, key,
+                               PartNames{filenames}.storage())};
+  const PartGenerations shared_generations = ShareTable<PartGenerations>(
+      part_generations_cache, key, std::move(generations));
+  const PartChecksums shared_checksums = ShareTable<PartChecksums>(
+      part_checksums_cache, key, std::move(checksums));
+
+  std::shared_ptr<PendingParts> pending;
+  std::shared_ptr<PrefetchedBlock> first_block;
+  if (nb_files > 1) {
+    pending = std::make_shared<PendingParts>();
+    const long long first_block_size = std::min(prefetchSize, sizes[0]);
+    if (prefetch && prefetchSize > 0 && Compression::kNone == compression) {
+      first_block = std::make_shared<PrefetchedBlock>();
+      if (first_block->reservation_.Reserve(first_block_size)) {
+        first_block->size_ = first_block_size;
+        first_block->task_ = pending->first_block_.get_future();
+        pending->first_block_size_ = first_block_size;
+      } else {
+        first_block.reset();
+      }
+    }
+    pending->bucket_name_ = bucketname;
+    pending->key_ = key;
+    pending->filenames_ = names;
+    pending->sizes_ = sizes;
+    pending->generations_ = shared_generations;
+    pending->checksums_ = shared_checksums;
+    pending->compression_ = compression;
+    pending->indexes_ = indexes;
+    pending->task_ = std::async(std::launch::async, ResolvePendingParts,
+                                std::ref(*pending));
+  }
 
-  const std::string &header = *maybe_header;
-  const long long header_size = static_cast<long long>(header.size());
-  int header_to_subtract{0};
-  bool same_header{true};
+  // until the other parts are resolved, the multifile is its first part
+  const long long first_size = sizes[0];
+  ReaderPtr reader{new MultiPartFile{std::move(bucketname),
+                                     std::move(objectname), 0, 0,
+                                     std::move(names), {first_size}, first_size}};
+  reader->compression_ = compression;
+  if (Compression::kNone != compression) {
+    reader->indexes_ = PartIndexes{std::move(indexes)};
+  }
+  reader->checksums_ = shared_checksums;
+  reader->generations_ = shared_generations;
+  reader->pending_ = std::move(pending);
+
+  if (prefetch) {
+    gc::Status status = FetchSmallObject(*reader);
+    if (!status.ok()) {
+      return status;
+    }
+    if (first_block) {
+      reader->prefetched_.push_back(std::move(first_block));
+    }
+    StartPrefetch(*reader, sizes.back());
+  }
+  return reader;
+}
 
-  for (; list_it != list_end; list_it++) {
-    RETURN_STATUS_ON_ERROR(*list_it);
+gc::StatusOr<ReaderPtr> MakeReaderPtr(std::string bucketname,
+                                      std::string objectname,
+                                      bool prefetch = false) {
+  auto maybe_objects = GetObjectsMetadata(bucketname, objectname);
+  RETURN_STATUS_ON_ERROR(maybe_objects);
+  return MakeReaderPtr(std::move(bucketname), std::move(objectname),
+                       *maybe_objects, prefetch);
+}
 
-    if (same_header) {
-      auto maybe_curr_header = ReadHeader(bucket_name, (*list_it)->name());
-      RETURN_STATUS_ON_ERROR(maybe_curr_header);
+gc::StatusOr<long long>
+GetFileSize(const std::string &bucket_name, const std::string &object_name,
+            const std::vector<gcs::ObjectMetadata> &objects) {
+  if (objects.size() == 1 &&
+      Compression::kNone == GetObjectCompression(objects[0])) {
+    return static_cast<long long>(objects[0].size());
+  }
 
-      same_header = (header == *maybe_curr_header);
-      if (same_header) {
-        header_to_subtract++;
-      }
-    }
-    total_size += static_cast<long long>((*list_it)->size());
+  // the size of a multifile depends on the headers of its parts and, for
+  // compressed parts, on their content: the size is the one of the file the
+  // reader would present
+  auto maybe_reader = MakeReaderPtr(bucket_name, object_name, objects, false);
+  RETURN_STATUS_ON_ERROR(maybe_reader);
+  gc::Status status = ResolveParts(**maybe_reader);
+  if (!status.ok()) {
+    return status;
   }
 
-  if (!same_header) {
-    header_to_subtract = 0;
+  return (*maybe_reader)->total_size_;
+}
+
+gc::StatusOr<long long> GetFileSize(const std::string &bucket_name,
+                                    const std::string &object_name) {
+  CachedMetadata cached;
+  if (FindCachedMetadata(bucket_name, object_name, cached)) {
+    if (cached.size_ >= 0) {
+      return cached.size_;
+    }
+    return GetFileSize(bucket_name, object_name, cached.objects_);
   }
-  return total_size - header_to_subtract * header_size;
+  auto maybe_objects = GetObjectsMetadata(bucket_name, object_name);
+  RETURN_STATUS_ON_ERROR(maybe_objects);
+  return GetFileSize(bucket_name, object_name, *maybe_objects);
 }
 
 long long int driver_getFileSize(const char *filename) {
@@ -636,64 +4465,21 @@ long long int driver_getFileSize(const char *filename) {
   return *maybe_file_size;
 }
 
-gc::StatusOr<ReaderPtr> MakeReaderPtr(std::string bucketname,
-                                      std::string objectname) {
-  std::vector<std::string> filenames;
-  std::vector<long long> cumulative_sizes;
-
-  auto maybe_list = ListObjects(bucketname, objectname);
-  RETURN_STATUS_ON_ERROR(maybe_list);
-
-  auto list_it = maybe_list->begin();
-  const auto list_end = maybe_list->end();
-
-  filenames.push_back((*list_it)->name());
-  cumulative_sizes.push_back(static_cast<long long>((*list_it)->size()));
-  long long common_header_size{0};
-
-  list_it++;
-  if (list_end != list_it) {
-    // multifile
-    // check headers
-    auto maybe_header = ReadHeader(bucketname, filenames.front());
-    RETURN_STATUS_ON_ERROR(maybe_header);
-
-    const std::string &header = *maybe_header;
-    const long long header_size = static_cast<long long>(header.size());
-    bool same_header{true};
-
-    for (; list_it != list_end; list_it++) {
-      RETURN_STATUS_ON_ERROR(*list_it);
-
-      filenames.push_back((*list_it)->name());
-      cumulative_sizes.push_back(cumulative_sizes.back() +
-                                 static_cast<long long>((*list_it)->size()));
-
-      if (same_header) {
-        auto maybe_curr_header = ReadHeader(bucketname, filenames.back());
-        RETURN_STATUS_ON_ERROR(maybe_curr_header);
-        same_header = (header == *maybe_curr_header);
-      }
-    }
-
-    // if headers remained the same, adjust cumulative_sizes
-    if (same_header) {
-      common_header_size = header_size;
-      for (size_t i = 0; i < cumulative_sizes.size(); i++) {
-        cumulative_sizes[i] -= (i * common_header_size);
-      }
-    }
+gc::StatusOr<WriterPtr> MakeWriterPtr(std::string bucketname,
+                                      std::string objectname,
+                                      Compression compression) {
+  // the compression is recorded in the metadata of the objects whose name
+  // does not tell it, for the reading path to find it
+  gcs::ContentEncoding encoding;
+  if (Compression::kNone != compression &&
+      GetCompressionFromName(objectname) != compression) {
+    encoding = gcs::ContentEncoding(GetContentEncoding(compression));
   }
 
-  tOffset total_size = cumulative_sizes.back();
-  return ReaderPtr(new MultiPartFile{
-      std::move(bucketname), std::move(objectname), 0, common_header_size,
-      std::move(filenames), std::move(cumulative_sizes), total_size});
-}
-
-gc::StatusOr<WriterPtr> MakeWriterPtr(std::string bucketname,
-                                      std::string objectname) {
-  auto writer = client.WriteObject(bucketname, objectname);
+  auto writer =
+      client.WriteObject(bucketname, objectname, std::move(encoding),
+                         gcs::DisableCrc32cChecksum(true), gcs::DisableMD5Hash(true),
+                         MakeUploadStallOptions());
   if (!writer) {
     return writer.last_status();
   }
@@ -701,6 +4487,10 @@ gc::StatusOr<WriterPtr> MakeWriterPtr(std::string bucketname,
   writer_struct->bucketname_ = std::move(bucketname);
   writer_struct->filename_ = std::move(objectname);
   writer_struct->writer_ = std::move(writer);
+  if (Compression::kNone != compression) {
+    writer_struct->compressor_.reset(new CompressState);
+    writer_struct->compressor_->compression_ = compression;
+  }
   return writer_struct;
 }
 
@@ -718,20 +4508,34 @@ RegisterStream(std::function<gc::StatusOr<StreamPtr>(std::string, std::string)>
 gc::StatusOr<Handle *> RegisterReader(std::string &&bucket,
                                       std::string &&object) {
   return RegisterStream<ReaderPtr, HandleType::kRead>(
-      MakeReaderPtr, std::move(bucket), std::move(object));
+      [](std::string bucketname, std::string objectname) {
+        return MakeReaderPtr(std::move(bucketname), std::move(objectname),
+                             /*prefetch=*/true);
+      },
+      std::move(bucket), std::move(object));
 }
 
 gc::StatusOr<Handle *> RegisterWriter(std::string &&bucket,
                                       std::string &&object) {
+  const Compression compression = GetWriteCompression(object);
   return RegisterStream<WriterPtr, HandleType::kWrite>(
-      MakeWriterPtr, std::move(bucket), std::move(object));
+      [compression](std::string b, std::string o) {
+        return MakeWriterPtr(std::move(b), std::move(o), compression);
+      },
+      std::move(bucket), std::move(object));
 }
 
 gc::StatusOr<Handle *> RegisterWriterForAppend(std::string &&bucket,
                                                std::string &&tmp,
-                                               std::string append_target) {
+                                               std::string append_target,
+                                               Compression compression) {
+  // the appended data is compressed like the target, so that the composition
+  // remains a valid stream
   auto maybe_handle = RegisterStream<WriterPtr, HandleType::kAppend>(
-      MakeWriterPtr, std::move(bucket), std::move(tmp));
+      [compression](std::string b, std::string o) {
+        return MakeWriterPtr(std::move(b), std::move(o), compression);
+      },
+      std::move(bucket), std::move(tmp));
   if (maybe_handle) {
     (*maybe_handle)->GetWriter().append_target_ = std::move(append_target);
   }
@@ -776,9 +4580,9 @@ void *driver_fopen(const char *filename, char mode) {
     //
     // The actual composition will happen on closing of the append stream
 
-    auto maybe_list = ListObjects(names.bucket, names.object);
-    if (!maybe_list) {
-      auto &status = maybe_list.status();
+    auto maybe_objects = GetObjectsMetadata(names.bucket, names.object);
+    if (!maybe_objects) {
+      auto &status = maybe_objects.status();
       if (gc::StatusCode::kNotFound == status.code()) {
         // file doesn't exist, fallback to write mode
         maybe_handle =
@@ -791,29 +4595,15 @@ void *driver_fopen(const char *filename, char mode) {
       break;
     }
 
-    // go to end of list to get the target file name
-    auto list_it = maybe_list->begin();
-    const auto list_end = maybe_list->end();
-    auto to_last_item = list_it;
-    list_it++;
-    while (list_end != list_it) {
-      to_last_item = list_it;
-      list_it++;
-    }
-
-    if (!to_last_item->ok()) {
-      // data is unusable
-      maybe_handle = std::move(*to_last_item).status();
-      err_msg = "Error opening file in append mode";
-      break;
-    }
+    // the target file is the last one listed
+    const gcs::ObjectMetadata &target = maybe_objects->back();
 
     // get a writer handle
     maybe_handle = RegisterWriterForAppend(
         std::move(names.bucket),
         std::string("tmp_object_to_append_") +
             boost::uuids::to_string(boost::uuids::random_generator()()),
-        to_last_item->value().name());
+        target.name(), GetObjectCompression(target));
     err_msg = "Error opening file in append mode, cannot open tmp object";
     break;
   }
@@ -848,6 +4638,7 @@ int driver_fclose(void *stream) {
 
   if (HandleType::kRead != h_ptr->type) {
     status = CloseWriterStream(*h_ptr);
+    ForgetBucketMetadata(h_ptr->GetWriter().bucketname_);
   }
 
   EraseRemove(stream_it);
@@ -876,7 +4667,7 @@ int driver_fseek(void *stream, long long int offset, int whence) {
     return -1;
   }
 
-  spdlog::debug("fseek {} {} {}", stream, offset, whence);
+  LOG_HOT_DEBUG("fseek {} {} {}", stream, offset, whence);
 
   MultiPartFile &h = stream_h->GetReader();
 
@@ -893,7 +4684,12 @@ int driver_fseek(void *stream, long long int offset, int whence) {
     }
     computed_offset = h.offset_ + offset;
     break;
-  case std::ios::end:
+  case std::ios::end: {
+    gc::Status status = ResolveParts(h);
+    if (!status.ok()) {
+      LogBadStatus(status, "Error while resolving the parts of the file");
+      return -1;
+    }
     if (h.total_size_ > 0) {
       long long minus1 = h.total_size_ - 1;
       if (offset > max_val - minus1) {
@@ -910,6 +4706,7 @@ int driver_fseek(void *stream, long long int offset, int whence) {
     computed_offset =
         (h.total_size_ == 0) ? offset : h.total_size_ - 1 + offset;
     break;
+  }
   default:
     LogError("Invalid seek mode " + std::to_string(whence));
     return -1;
@@ -924,8 +4721,6 @@ int driver_fseek(void *stream, long long int offset, int whence) {
 }
 
 const char *driver_getlasterror() {
-  spdlog::debug("getlasterror");
-
   if (!lastError.empty()) {
     return lastError.c_str();
   }
@@ -955,7 +4750,7 @@ long long int driver_fread(void *ptr, size_t size, size_t count, void *stream) {
     return -1;
   }
 
-  spdlog::debug("fread {} {} {} {}", ptr, size, count, stream);
+  LOG_HOT_DEBUG("fread {} {} {} {}", ptr, size, count, stream);
 
   MultiPartFile &h = stream_h->GetReader();
 
@@ -979,6 +4774,15 @@ long long int driver_fread(void *ptr, size_t size, size_t count, void *stream) {
   }
   // end of overflow prevention
 
+  // the reads past the first part need all the parts
+  if (h.pending_ && offset + to_read > h.cumulativeSize_.front()) {
+    gc::Status status = ResolveParts(h);
+    if (!status.ok()) {
+      LogBadStatus(status, "Error while reading from file");
+      return -1;
+    }
+  }
+
   // special case: if offset >= total_size, error if not 0 byte required. 0 byte
   // required is already done above
   const tOffset total_size = h.total_size_;
@@ -990,11 +4794,11 @@ long long int driver_fread(void *ptr, size_t size, size_t count, void *stream) {
   // normal cases
   if (offset + to_read > total_size) {
     to_read = total_size - offset;
-    spdlog::debug(
+    LOG_HOT_DEBUG(
         "offset {}, req len {} exceeds file size ({}) -> reducing len to {}",
         offset, to_read, total_size, to_read);
   } else {
-    spdlog::debug("offset = {} to_read = {}", offset, to_read);
+    LOG_HOT_DEBUG("offset = {} to_read = {}", offset, to_read);
   }
 
   auto maybe_read = ReadBytesInFile(h, reinterpret_cast<char *>(ptr), to_read);
@@ -1013,7 +4817,7 @@ long long int driver_fwrite(const void *ptr, size_t size, size_t count,
     return -1;
   }
 
-  spdlog::debug("fwrite {} {} {} {}", ptr, size, count, stream);
+  LOG_HOT_DEBUG("fwrite {} {} {} {}", ptr, size, count, stream);
 
   auto stream_it = FindHandle(stream);
   ERROR_NO_STREAM(stream_it, -1);
@@ -1040,13 +4844,24 @@ long long int driver_fwrite(const void *ptr, size_t size, size_t count,
 
   const long long to_write = static_cast<long long>(size * count);
 
-  gcs::ObjectWriteStream &writer = stream_h.GetWriter().writer_;
-  writer.write(static_cast<const char *>(ptr), to_write);
+  WriteFile &writer_h = stream_h.GetWriter();
+  if (writer_h.compressor_) {
+    gc::Status status = WriteCompressed(
+        writer_h, static_cast<const char *>(ptr), to_write);
+    if (!status.ok()) {
+      LogBadStatus(status, "Error during upload");
+      return -1;
+    }
+    return to_write;
+  }
+
+  gcs::ObjectWriteStream &writer = writer_h.writer_;
+  WriteToObject(writer_h, static_cast<const char *>(ptr), to_write);
   if (writer.bad()) {
     LogBadStatus(writer.last_status(), "Error during upload");
     return -1;
   }
-  spdlog::debug("Write status after write: good {}, bad {}, fail {}",
+  LOG_HOT_DEBUG("Write status after write: good {}, bad {}, fail {}",
                 writer.good(), writer.bad(), writer.fail());
 
   return to_write;
@@ -1064,7 +4879,16 @@ int driver_fflush(void *stream) {
     return -1;
   }
 
-  auto &out_stream = stream_h.GetWriter().writer_;
+  WriteFile &writer_h = stream_h.GetWriter();
+  if (writer_h.compressor_) {
+    gc::Status status = FlushCompressed(writer_h, false);
+    if (!status.ok()) {
+      LogBadStatus(status, "Error during upload");
+      return -1;
+    }
+  }
+
+  auto &out_stream = writer_h.writer_;
   if (!out_stream.flush()) {
     LogBadStatus(out_stream.last_status(), "Error during upload");
     return -1;
@@ -1073,6 +4897,69 @@ int driver_fflush(void *stream) {
   return 0;
 }
 
+// Parallel deletes
+//
+// The objects are deleted by concurrent requests, the storage having no batch
+// delete in the client library. Deletes mostly wait on the network, so more
+// requests than driver threads are kept in flight. A failure does not stop the
+// other deletes; the failures are counted and the first one is reported.
+// With generations, an object is deleted only if it is still at the given
+// generation.
+constexpr size_t delete_requests_per_thread{4};
+
+gc::Status DeleteObjects(const std::string &bucket_name,
+                         const std::vector<std::string> &object_names,
+                         const std::vector<std::int64_t> &generations = {}) {
+  assert(generations.empty() || generations.size() == object_names.size());
+  std::atomic<size_t> nb_failures{0};
+  std::mutex failure_mutex;
+  gc::Status first_failure;
+
+  ParallelFor(object_names.size(),
+              GetDriverThreads() * delete_requests_per_thread, [&](size_t i) {
+                auto status = client.DeleteObject(
+                    bucket_name, object_names[i],
+                    generations.empty()
+                        ? gcs::IfGenerationMatch()
+                        : gcs::IfGenerationMatch(generations[i]));
+                // already deleted, by another worker of the job for instance
+                if (!status.ok() && status.code() != gc::StatusCode::kNotFound) {
+                  spdlog::debug("Error deleting {}: {}", object_names[i],
+                                status.message());
+                  std::lock_guard<std::mutex> lock{failure_mutex};
+                  if (nb_failures++ == 0) {
+                    first_failure = std::move(status);
+                  }
+                }
+                return gc::Status{};
+              });
+  ForgetBucketMetadata(bucket_name);
+
+  if (nb_failures > 0) {
+    return gc::Status{first_failure.code(),
+                      std::to_string(nb_failures.load()) + " of " +
+                          std::to_string(object_names.size()) +
+                          " objects not deleted, first error: " +
+                          first_failure.message()};
+  }
+  spdlog::debug("{} objects deleted", object_names.size());
+  return {};
+}
+
+// Names of the objects under a prefix, listed with the smallest fields
+gc::StatusOr<std::vector<std::string>>
+ListObjectNames(const std::string &bucket_name, const std::string &prefix) {
+  std::vector<std::string> names;
+  for (auto &&maybe_object :
+       client.ListObjects(bucket_name, gcs::Prefix(prefix),
+                          gcs::Fields("items(name),nextPageToken"),
+                          gcs::MaxResults(max_list_page_size))) {
+    RETURN_STATUS_ON_ERROR(maybe_object);
+    names.push_back(maybe_object->name());
+  }
+  return names;
+}
+
 int driver_remove(const char *filename) {
   ERROR_ON_NULL_ARG(filename, "Error passing null pointer to remove", kFailure);
 
@@ -1084,22 +4971,73 @@ int driver_remove(const char *filename) {
   ERROR_ON_NAMES(maybe_names, kFailure);
   auto &names = *maybe_names;
 
+  // the object of the exact name goes first: a name may hold glob characters
+  // that a pattern does not match by themselves, as in "run[1].csv"
   const auto status = client.DeleteObject(names.bucket, names.object);
-  if (!status.ok() && status.code() != gc::StatusCode::kNotFound) {
+  ForgetBucketMetadata(names.bucket);
+  if (status.ok()) {
+    return kSuccess;
+  }
+  if (status.code() != gc::StatusCode::kNotFound) {
     LogBadStatus(status, "Error deleting object");
     return kFailure;
   }
+  if (!IsGlobPattern(names.object)) {
+    return kSuccess;
+  }
 
+  // a pattern removes all the matching objects, the parts of a file mostly
+  auto maybe_objects = ListObjectsInParallel(names.bucket, names.object);
+  if (!maybe_objects) {
+    if (maybe_objects.status().code() == gc::StatusCode::kNotFound) {
+      return kSuccess;
+    }
+    LogBadStatus(maybe_objects.status(), "Error while listing objects");
+    return kFailure;
+  }
+  std::vector<std::string> object_names;
+  object_names.reserve(maybe_objects->size());
+  for (const auto &object : *maybe_objects) {
+    object_names.push_back(object.name());
+  }
+  const auto delete_status = DeleteObjects(names.bucket, object_names);
+  if (!delete_status.ok()) {
+    LogBadStatus(delete_status, "Error deleting objects");
+    return kFailure;
+  }
   return kSuccess;
 }
 
+// Removes the directory with all its content, that is all the objects under
+// the prefix of its name. The root of a bucket is never removed.
 int driver_rmdir(const char *filename) {
   ERROR_ON_NULL_ARG(filename, "Error passing null pointer to rmdir", kFailure);
 
   spdlog::debug("rmdir {}", filename);
 
   assert(driver_isConnected());
-  spdlog::debug("Remove dir (does nothing...)");
+
+  auto maybe_names = GetBucketAndObjectNames(filename);
+  ERROR_ON_NAMES(maybe_names, kFailure);
+  auto &names = *maybe_names;
+
+  std::string prefix = names.object;
+  if (!prefix.empty() && prefix.back() != '/') {
+    prefix += '/';
+  }
+  if (prefix.empty()) {
+    LogError("Error removing the root of bucket " + names.bucket);
+    return kFailure;
+  }
+
+  auto maybe_object_names = ListObjectNames(names.bucket, prefix);
+  RETURN_ON_ERROR(maybe_object_names, "Error while listing objects", kFailure);
+
+  const auto status = DeleteObjects(names.bucket, *maybe_object_names);
+  if (!status.ok()) {
+    LogBadStatus(status, "Error removing directory");
+    return kFailure;
+  }
   return kSuccess;
 }
 
@@ -1144,6 +5082,11 @@ int driver_copyToLocal(const char *sSourceFilePathName,
   RETURN_ON_ERROR(maybe_reader, "Error while opening Remote file", kFailure);
 
   ReaderPtr &reader = *maybe_reader;
+  gc::Status parts_status = ResolveParts(*reader);
+  if (!parts_status.ok()) {
+    LogBadStatus(parts_status, "Error while opening Remote file");
+    return kFailure;
+  }
   const size_t nb_files = reader->filenames_.size();
 
   // Open the local file
@@ -1155,15 +5098,41 @@ int driver_copyToLocal(const char *sSourceFilePathName,
     return kFailure;
   }
 
-  // Allocate a relay buffer
-  constexpr size_t buf_size{1024 * 1024};
-  std::vector<char> buffer(buf_size);
-  char *buf_data = buffer.data();
+  // Take a relay buffer
+  constexpr size_t buf_size{copy_buffer_size};
+  auto maybe_buffer = MakeIoBuffer(buf_size);
+  RETURN_ON_ERROR(maybe_buffer, "Error while taking a relay buffer", kFailure);
+  char *buf_data = maybe_buffer->data();
+
+  if (Compression::kNone != reader->compression_) {
+    // the parts are inflated by the reading path, relay the uncompressed bytes
+    const tOffset total_size = reader->total_size_;
+    while (reader->offset_ < total_size) {
+      const tOffset to_read = std::min(static_cast<tOffset>(buf_size),
+                                       total_size - reader->offset_);
+      auto maybe_read = ReadBytesInFile(*reader, buf_data, to_read);
+      RETURN_ON_ERROR(maybe_read, "Error while reading from cloud storage",
+                      kFailure);
+      if (!file_stream.write(buf_data,
+                             static_cast<std::streamsize>(*maybe_read))) {
+        LogError("Error while writing data to local file");
+        return kFailure;
+      }
+      if (*maybe_read < to_read) {
+        break;
+      }
+    }
+    spdlog::debug("Done copying");
+    return kSuccess;
+  }
 
   // create a waste buffer now, so the lambdas can reference it
   // memory allocation will occur later, before actual use
   std::vector<char> waste;
 
+  // checksum of the part being copied
+  uint32_t crc{0};
+
   auto read_and_write = [&](gcs::ObjectReadStream &from,
                             bool skip_header = false,
                             std::streamsize header_size = 0) {
@@ -1186,12 +5155,14 @@ int driver_copyToLocal(const char *sSourceFilePathName,
         LogBadStatus(from.status(), err_msg);
         return false;
       }
+      crc = ExtendCrc32c(crc, waste.data(), static_cast<size_t>(header_size));
     }
 
     const std::streamsize buf_size_cast =
         static_cast<std::streamsize>(buf_size);
     while (from.read(buf_data, buf_size_cast) &&
            file_stream.write(buf_data, buf_size_cast)) {
+      crc = ExtendCrc32c(crc, buf_data, buf_size);
     }
     // what made the process stop?
     if (!file_stream) {
@@ -1206,6 +5177,7 @@ int driver_copyToLocal(const char *sSourceFilePathName,
         LogError("Error while writing data to local file");
         return false;
       }
+      crc = ExtendCrc32c(crc, buf_data, static_cast<size_t>(rem));
     } else if (from.bad()) {
       // something went wrong on read side
       LogBadStatus(from.status(), "Error while reading from cloud storage");
@@ -1215,19 +5187,31 @@ int driver_copyToLocal(const char *sSourceFilePathName,
     return true;
   };
 
-  auto operation = [&](gcs::ObjectReadStream &from, const std::string &filename,
+  auto &filenames = reader->filenames_;
+
+  auto operation = [&](gcs::ObjectReadStream &from, size_t part_idx,
                        bool skip_header = false, tOffset header_size = 0) {
-    from = client.ReadObject(bucket_name, filename);
+    const std::string &filename = filenames[part_idx];
+    from = client.ReadObject(bucket_name, filename, gcs::AcceptEncodingGzip(),
+                             gcs::DisableCrc32cChecksum(true),
+                             gcs::DisableMD5Hash(true), MakeDownloadStallOptions());
+    crc = 0;
     bool res = read_and_write(from, skip_header, header_size);
     from.Close();
+    if (res) {
+      gc::Status crc_status =
+          CheckCrc32c(filename, crc, reader->checksums_[part_idx]);
+      if (!crc_status.ok()) {
+        LogBadStatus(crc_status, "Error while reading from cloud storage");
+        res = false;
+      }
+    }
     return res;
   };
 
-  auto &filenames = reader->filenames_;
-
   // Read the whole first file
   gcs::ObjectReadStream read_stream;
-  if (!operation(read_stream, filenames.front())) {
+  if (!operation(read_stream, 0)) {
     return kFailure;
   }
 
@@ -1239,10 +5223,10 @@ int driver_copyToLocal(const char *sSourceFilePathName,
   // Read from the next files
   const tOffset header_size = reader->commonHeaderLength_;
   const bool skip_header = header_size > 0;
-  waste.reserve(static_cast<size_t>(header_size));
+  waste.resize(static_cast<size_t>(header_size));
 
   for (size_t i = 1; i < nb_files; i++) {
-    if (!operation(read_stream, filenames[i], skip_header, header_size)) {
+    if (!operation(read_stream, i, skip_header, header_size)) {
       return kFailure;
     }
   }
@@ -1278,7 +5262,10 @@ int driver_copyFromLocal(const char *sSourceFilePathName,
 
   // Create a WriteObject stream
   const auto &names = *maybe_names;
-  auto writer = client.WriteObject(names.bucket, names.object);
+  auto writer =
+      client.WriteObject(names.bucket, names.object,
+                         gcs::DisableCrc32cChecksum(true), gcs::DisableMD5Hash(true),
+                         MakeUploadStallOptions());
   if (!writer || !writer.IsOpen()) {
     LogBadStatus(writer.metadata().status(),
                  "Error initializing upload stream to remote storage");
@@ -1286,12 +5273,15 @@ int driver_copyFromLocal(const char *sSourceFilePathName,
   }
 
   // Read from the local file and write to the GCS object
-  constexpr size_t buf_size{1024};
-  std::array<char, buf_size> buffer{};
-  char *buf_data = buffer.data();
+  constexpr size_t buf_size{copy_buffer_size};
+  auto maybe_buffer = MakeIoBuffer(buf_size);
+  RETURN_ON_ERROR(maybe_buffer, "Error while taking a relay buffer", kFailure);
+  char *buf_data = maybe_buffer->data();
 
+  uint32_t crc{0};
   while (file_stream.read(buf_data, buf_size) &&
          writer.write(buf_data, buf_size)) {
+    crc = ExtendCrc32c(crc, buf_data, buf_size);
   }
   // what made the process stop?
   if (!writer) {
@@ -1304,6 +5294,7 @@ int driver_copyFromLocal(const char *sSourceFilePathName,
       LogError("Error while copying to remote storage");
       return kFailure;
     }
+    crc = ExtendCrc32c(crc, buf_data, static_cast<size_t>(rem));
   } else if (file_stream.bad()) {
     LogError("Error while reading on local storage");
     return kFailure;
@@ -1311,10 +5302,461 @@ int driver_copyFromLocal(const char *sSourceFilePathName,
 
   // Close the GCS WriteObject stream to complete the upload
   writer.Close();
+  ForgetBucketMetadata(names.bucket);
 
   auto &maybe_meta = writer.metadata();
   RETURN_ON_ERROR(maybe_meta, "Error during file upload to remote storage",
                   kFailure);
 
+  // a corrupted object is not left in place
+  gc::Status crc_status = CheckCrc32c(names.object, crc, maybe_meta->crc32c());
+  if (!crc_status.ok()) {
+    client.DeleteObject(names.bucket, names.object);
+    LogBadStatus(crc_status, "Error during file upload to remote storage");
+    return kFailure;
+  }
+
+  return kSuccess;
+}
+
+// Download a part to the disk cache, unless it is there already
+gc::Status StageObject(const std::string &bucket_name,
+                       const gcs::ObjectMetadata &object) {
+  if (Compression::kNone != GetObjectCompression(object)) {
+    spdlog::info("{} is compressed, its reads are not served by the disk "
+                 "cache and it is not staged",
+                 object.name());
+    return {};
+  }
+
+  const std::string key =
+      MakeObjectKey(bucket_name, object.name(), object.generation());
+  {
+    std::ifstream staged;
+    std::int64_t staged_size{0};
+    if (OpenDiskCacheFile(key, staged, staged_size)) {
+      return {};
+    }
+  }
+
+  auto maybe_buffer = MakeIoBuffer(copy_buffer_size);
+  RETURN_STATUS_ON_ERROR(maybe_buffer);
+  IoBuffer &buffer = *maybe_buffer;
+
+  const std::string path = GetDiskCacheFilePath(key);
+  const std::string tmp_path =
+      path + '.' + boost::uuids::to_string(boost::uuids::random_generator()());
+  std::ofstream file(tmp_path, std::ios::binary);
+  const uint64_t key_size = key.size();
+  const uint64_t size = object.size();
+  file.write(disk_cache_magic, sizeof(disk_cache_magic));
+  file.write(reinterpret_cast<const char *>(&key_size), sizeof(key_size));
+  file.write(key.data(), static_cast<std::streamsize>(key.size()));
+  file.write(reinterpret_cast<const char *>(&size), sizeof(size));
+
+  gcs::ObjectReadStream from = client.ReadObject(
+      bucket_name, object.name(), MakeGenerationOption(object.generation()),
+      gcs::AcceptEncodingGzip(), gcs::DisableCrc32cChecksum(true),
+      gcs::DisableMD5Hash(true), MakeDownloadStallOptions());
+  uint32_t crc{0};
+  uint64_t copied{0};
+  while (from && file) {
+    from.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    const std::streamsize count = from.gcount();
+    crc = ExtendCrc32c(crc, buffer.data(), static_cast<size_t>(count));
+    file.write(buffer.data(), count);
+    copied += static_cast<uint64_t>(count);
+  }
+  from.Close();
+  file.close();
+
+  gc::Status status;
+  if (from.bad()) {
+    status = from.status();
+  } else if (!file) {
+    status = gc::Status{gc::StatusCode::kInternal, "Error while writing " + tmp_path};
+  } else if (copied != size) {
+    status = gc::Status{gc::StatusCode::kDataLoss,
+                        "Unexpected size of " + object.name()};
+  } else {
+    status = CheckCrc32c(object.name(), crc, object.crc32c());
+  }
+
+  // the rename makes the object visible to the readers only once complete
+  if (status.ok() && std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+    status = gc::Status{gc::StatusCode::kInternal, "Error while writing " + path};
+  }
+  if (!status.ok()) {
+    std::remove(tmp_path.c_str());
+  }
+  return status;
+}
+
+int driver_warmDiskCache(const char *filename) {
+  ERROR_ON_NULL_ARG(filename, "Error passing null pointer to warmDiskCache",
+                    kFailure);
+
+  spdlog::debug("warmDiskCache {}", filename);
+
+  if (diskCacheDir.empty()) {
+    LogError("GCS_DISK_CACHE_DIR is not set, there is no disk cache to warm");
+    return kFailure;
+  }
+
+  auto maybe_names = GetBucketAndObjectNames(filename);
+  ERROR_ON_NAMES(maybe_names, kFailure);
+
+  // the parts are the ones a reader would open
+  auto maybe_objects =
+      GetObjectsMetadata(maybe_names->bucket, maybe_names->object);
+  RETURN_ON_ERROR(maybe_objects, "Error while listing the parts", kFailure);
+
+  const auto &objects = *maybe_objects;
+  gc::Status status =
+      ParallelFor(objects.size(), GetDriverThreads(), [&](size_t i) {
+        return StageObject(maybe_names->bucket, objects[i]);
+      });
+  if (!status.ok()) {
+    LogBadStatus(status, "Error while staging the parts");
+    return kFailure;
+  }
+
+  spdlog::info("Staged {} parts of {} in {}", objects.size(), filename,
+               diskCacheDir);
+  return kSuccess;
+}
+
+// Server-side copies
+//
+// driver_copy and driver_rename copy objects within the storage: a rewrite
+// request copies an object without its bytes going through the client. The
+// storage may complete a large rewrite in several requests, each one resumed
+// from the token returned by the previous one. The parts of a multifile are
+// composed into the destination, by rounds of at most 32 sources (into a
+// temporary object of the source bucket, then rewritten, for another bucket),
+// unless the parts repeat a common header: the storage cannot compose a range
+// of an object, the bytes are then relayed by the driver.
+constexpr size_t max_compose_sources{32};
+
+gc::StatusOr<gcs::ObjectMetadata>
+RewriteObject(const std::string &bucket_name, const gcs::ObjectMetadata &source,
+              const std::string &dest_bucket, const std::string &dest_name) {
+  gcs::ObjectRewriter rewriter =
+      client.RewriteObject(bucket_name, source.name(), dest_bucket, dest_name,
+                           gcs::SourceGeneration(source.generation()));
+  for (;;) {
+    auto maybe_progress = rewriter.Iterate();
+    RETURN_STATUS_ON_ERROR(maybe_progress);
+    spdlog::debug("Rewrote {} of {} bytes of {} (token {})",
+                  maybe_progress->total_bytes_rewritten,
+                  maybe_progress->object_size, source.name(),
+                  rewriter.token());
+    if (maybe_progress->done) {
+      return rewriter.Result();
+    }
+  }
+}
+
+// Compose the sources into dest, through temporary objects when there are
+// more sources than a composition takes
+gc::StatusOr<gcs::ObjectMetadata>
+ComposeObjects(const std::string &bucket_name,
+               std::vector<gcs::ComposeSourceObject> sources,
+               const std::string &dest, gcs::WithObjectMetadata dest_meta) {
+  std::vector<std::string> tmp_names;
+  auto delete_tmp_objects = [&]() {
+    for (const auto &name : tmp_names) {
+      client.DeleteObject(bucket_name, name);
+    }
+  };
+
+  while (sources.size() > max_compose_sources) {
+    std::vector<gcs::ComposeSourceObject> composed;
+    for (size_t i = 0; i < sources.size(); i += max_compose_sources) {
+      const size_t last = std::min(i + max_compose_sources, sources.size());
+      if (last - i == 1) {
+        composed.push_back(std::move(sources[i]));
+        continue;
+      }
+      std::vector<gcs::ComposeSourceObject> group(
+          std::make_move_iterator(sources.begin() + i),
+          std::make_move_iterator(sources.begin() + last));
+      const std::string tmp_name =
+          dest + '.' +
+          boost::uuids::to_string(boost::uuids::random_generator()());
+      auto maybe_meta =
+          client.ComposeObject(bucket_name, std::move(group), tmp_name);
+      if (!maybe_meta) {
+        delete_tmp_objects();
+        return maybe_meta;
+      }
+      tmp_names.push_back(tmp_name);
+      composed.push_back({tmp_name, maybe_meta->generation(), {}});
+    }
+    sources = std::move(composed);
+  }
+
+  auto maybe_meta = client.ComposeObject(bucket_name, std::move(sources), dest,
+                                         std::move(dest_meta));
+  delete_tmp_objects();
+  return maybe_meta;
+}
+
+// Write the bytes read from a multifile to dest. The bytes read from
+// compressed parts are decoded: they are compressed again, with the
+// compression told by the name of dest or else with the one of the parts.
+gc::Status RelayFile(MultiPartFile &reader, const std::string &dest_bucket,
+                     const std::string &dest_name) {
+  Compression compression = GetCompressionFromName(dest_name);
+  if (Compression::kNone == compression) {
+    compression = reader.compression_;
+  }
+  auto maybe_writer = MakeWriterPtr(dest_bucket, dest_name, compression);
+  RETURN_STATUS_ON_ERROR(maybe_writer);
+  WriteFile &writer_h = **maybe_writer;
+  if (!writer_h.writer_.IsOpen()) {
+    return writer_h.writer_.metadata().status();
+  }
+
+  auto maybe_buffer = MakeIoBuffer(copy_buffer_size);
+  RETURN_STATUS_ON_ERROR(maybe_buffer);
+  IoBuffer &buffer = *maybe_buffer;
+  while (reader.offset_ < reader.total_size_) {
+    const tOffset to_read =
+        std::min(static_cast<tOffset>(buffer.size()),
+                 reader.total_size_ - reader.offset_);
+    auto maybe_read = ReadBytesInFile(reader, buffer.data(), to_read);
+    RETURN_STATUS_ON_ERROR(maybe_read);
+    if (writer_h.compressor_) {
+      gc::Status status = WriteCompressed(writer_h, buffer.data(), *maybe_read);
+      if (!status.ok()) {
+        return status;
+      }
+    } else {
+      WriteToObject(writer_h, buffer.data(),
+                    static_cast<std::streamsize>(*maybe_read));
+      if (writer_h.writer_.bad()) {
+        return writer_h.writer_.last_status();
+      }
+    }
+    if (*maybe_read < to_read) {
+      break;
+    }
+  }
+
+  auto maybe_meta = CompleteUpload(writer_h);
+  RETURN_STATUS_ON_ERROR(maybe_meta);
+  return {};
+}
+
+// Copy a file to dest. The copied parts are returned, for a rename to delete
+// them.
+gc::StatusOr<std::vector<gcs::ObjectMetadata>>
+CopyFile(const std::string &bucket_name, const std::string &object_name,
+         const std::string &dest_bucket, const std::string &dest_name) {
+  auto maybe_objects = GetObjectsMetadata(bucket_name, object_name);
+  RETURN_STATUS_ON_ERROR(maybe_objects);
+  const auto &objects = *maybe_objects;
+
+  if (objects.size() == 1) {
+    auto maybe_meta =
+        RewriteObject(bucket_name, objects[0], dest_bucket, dest_name);
+    RETURN_STATUS_ON_ERROR(maybe_meta);
+    return maybe_objects;
+  }
+
+  // the header of the parts is known once they are opened
+  auto maybe_reader = MakeReaderPtr(bucket_name, object_name, objects, false);
+  RETURN_STATUS_ON_ERROR(maybe_reader);
+  MultiPartFile &reader = **maybe_reader;
+  gc::Status status = ResolveParts(reader);
+  if (!status.ok()) {
+    return status;
+  }
+
+  if (reader.commonHeaderLength_ > 0) {
+    spdlog::info("Copying {} through the driver, its parts share a header",
+                 object_name);
+    status = RelayFile(reader, dest_bucket, dest_name);
+    if (!status.ok()) {
+      return status;
+    }
+    return maybe_objects;
+  }
+
+  std::vector<gcs::ComposeSourceObject> sources;
+  for (const auto &object : objects) {
+    sources.push_back({object.name(), object.generation(), {}});
+  }
+  gcs::WithObjectMetadata dest_meta;
+  if (Compression::kNone != reader.compression_ &&
+      GetCompressionFromName(dest_name) != reader.compression_) {
+    dest_meta = gcs::WithObjectMetadata(
+        gcs::ObjectMetadata().set_content_encoding(
+            GetContentEncoding(reader.compression_)));
+  }
+  if (bucket_name == dest_bucket) {
+    auto maybe_meta = ComposeObjects(bucket_name, std::move(sources),
+                                     dest_name, std::move(dest_meta));
+    RETURN_STATUS_ON_ERROR(maybe_meta);
+    return maybe_objects;
+  }
+
+  const std::string tmp_name =
+      dest_name + '.' +
+      boost::uuids::to_string(boost::uuids::random_generator()());
+  auto maybe_tmp = ComposeObjects(bucket_name, std::move(sources), tmp_name,
+                                  std::move(dest_meta));
+  RETURN_STATUS_ON_ERROR(maybe_tmp);
+  auto maybe_meta = RewriteObject(bucket_name, *maybe_tmp, dest_bucket,
+                                  dest_name);
+  client.DeleteObject(bucket_name, tmp_name);
+  RETURN_STATUS_ON_ERROR(maybe_meta);
+  return maybe_objects;
+}
+
+int driver_copy(const char *sourcefilename, const char *destfilename) {
+  ERROR_ON_NULL_ARG(sourcefilename, "Error passing null pointer to copy",
+                    kFailure);
+  ERROR_ON_NULL_ARG(destfilename, "Error passing null pointer to copy",
+                    kFailure);
+
+  spdlog::debug("copy {} {}", sourcefilename, destfilename);
+
+  auto maybe_source = GetBucketAndObjectNames(sourcefilename);
+  ERROR_ON_NAMES(maybe_source, kFailure);
+  auto maybe_dest = GetBucketAndObjectNames(destfilename);
+  ERROR_ON_NAMES(maybe_dest, kFailure);
+
+  auto maybe_copied = CopyFile(maybe_source->bucket, maybe_source->object,
+                               maybe_dest->bucket, maybe_dest->object);
+  ForgetBucketMetadata(maybe_dest->bucket);
+  RETURN_ON_ERROR(maybe_copied, "Error while copying", kFailure);
+  return kSuccess;
+}
+
+int driver_rename(const char *sourcefilename, const char *destfilename) {
+  ERROR_ON_NULL_ARG(sourcefilename, "Error passing null pointer to rename",
+                    kFailure);
+  ERROR_ON_NULL_ARG(destfilename, "Error passing null pointer to rename",
+                    kFailure);
+
+  spdlog::debug("rename {} {}", sourcefilename, destfilename);
+
+  auto maybe_source = GetBucketAndObjectNames(sourcefilename);
+  ERROR_ON_NAMES(maybe_source, kFailure);
+  auto maybe_dest = GetBucketAndObjectNames(destfilename);
+  ERROR_ON_NAMES(maybe_dest, kFailure);
+  if (maybe_source->bucket == maybe_dest->bucket &&
+      maybe_source->object == maybe_dest->object) {
+    return kSuccess;
+  }
+
+  auto maybe_copied = CopyFile(maybe_source->bucket, maybe_source->object,
+                               maybe_dest->bucket, maybe_dest->object);
+  ForgetBucketMetadata(maybe_dest->bucket);
+  RETURN_ON_ERROR(maybe_copied, "Error while copying", kFailure);
+
+  // the parts are deleted only if they did not change since they were copied
+  std::vector<std::string> object_names;
+  std::vector<std::int64_t> generations;
+  object_names.reserve(maybe_copied->size());
+  generations.reserve(maybe_copied->size());
+  for (const auto &object : *maybe_copied) {
+    object_names.push_back(object.name());
+    generations.push_back(object.generation());
+  }
+  const auto status =
+      DeleteObjects(maybe_source->bucket, object_names, generations);
+  if (!status.ok()) {
+    LogBadStatus(status, "Error while deleting the source of the rename");
+    return kFailure;
+  }
+  return kSuccess;
+}
+
+// Batch lookups
+//
+// The files are looked up by concurrent requests, more than the driver threads
+// since the lookups mostly wait on the network, within the worker budget of
+// the parallel operations. The files found are kept in the metadata cache.
+constexpr size_t lookup_requests_per_thread{4};
+
+gc::Status LookUpFile(const char *filename, tFileMetadata &result) {
+  if (!filename) {
+    return gc::Status{gc::StatusCode::kInvalidArgument, "Null file name"};
+  }
+  auto maybe_names = GetBucketAndObjectNames(filename);
+  RETURN_STATUS_ON_ERROR(maybe_names);
+  const auto &names = *maybe_names;
+
+  CachedMetadata cached;
+  if (!FindCachedMetadata(names.bucket, names.object, cached)) {
+    auto maybe_objects = LookUpObjectsMetadata(names.bucket, names.object);
+    if (!maybe_objects) {
+      return maybe_objects.status().code() == gc::StatusCode::kNotFound
+                 ? gc::Status{}
+                 : maybe_objects.status();
+    }
+    // the size of a plain object is the one of its metadata, only the other
+    // files are opened to be sized
+    auto maybe_size = GetFileSize(names.bucket, names.object, *maybe_objects);
+    RETURN_STATUS_ON_ERROR(maybe_size);
+    cached.objects_ = std::move(*maybe_objects);
+    cached.size_ = *maybe_size;
+    CacheMetadata(names.bucket, names.object, cached.objects_, cached.size_);
+  }
+
+  result.exists = 1;
+  result.size = cached.size_;
+  result.nb_parts = static_cast<long long>(cached.objects_.size());
+  for (const auto &object : cached.objects_) {
+    result.generation = std::max(result.generation,
+                                 static_cast<long long>(object.generation()));
+  }
+  return {};
+}
+
+int driver_getFilesMetadata(const char **filenames, int count,
+                            tFileMetadata *metadata) {
+  ERROR_ON_NULL_ARG(filenames, "Error passing null pointer to getFilesMetadata",
+                    kFailure);
+  ERROR_ON_NULL_ARG(metadata, "Error passing null pointer to getFilesMetadata",
+                    kFailure);
+
+  spdlog::debug("getFilesMetadata {} files", count);
+
+  assert(driver_isConnected());
+
+  const size_t nb_files = static_cast<size_t>(std::max(0, count));
+  std::atomic<size_t> nb_failures{0};
+  std::mutex failure_mutex;
+  gc::Status first_failure;
+
+  ParallelFor(nb_files, GetDriverThreads() * lookup_requests_per_thread,
+              [&](size_t i) {
+                metadata[i] = tFileMetadata{0, -1, 0, 0};
+                gc::Status status = LookUpFile(filenames[i], metadata[i]);
+                if (!status.ok()) {
+                  spdlog::debug("Error looking up {}: {}",
+                                filenames[i] ? filenames[i] : "(null)",
+                                status.message());
+                  std::lock_guard<std::mutex> lock{failure_mutex};
+                  if (nb_failures++ == 0) {
+                    first_failure = std::move(status);
+                  }
+                }
+                return gc::Status{};
+              });
+
+  if (nb_failures > 0) {
+    LogBadStatus(gc::Status{first_failure.code(),
+                            std::to_string(nb_failures.load()) + " of " +
+                                std::to_string(nb_files) +
+                                " files not looked up, first error: " +
+                                first_failure.message()},
+                 "Error getting files metadata");
+    return kFailure;
+  }
   return kSuccess;
 }
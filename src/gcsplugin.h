@@ -121,13 +121,15 @@ VISIBLE long long int driver_fwrite(const void *ptr, size_t size, size_t count,
 // Returns 0 on success, -1 on error.
 VISIBLE int driver_fflush(void *stream);
 
-// Returns 1 in case of success, 0 otherwise
+// Removes the file, or all the files matching a glob pattern. Returns 1 in case
+// of success, 0 otherwise
 VISIBLE int driver_remove(const char *filename);
 
 // Returns 1 in case of success, 0 otherwise
 VISIBLE int driver_mkdir(const char *pathname);
 
-// Returns 1 in case of success, 0 otherwise
+// Removes the directory and all the files under it. Returns 1 in case of
+// success, 0 otherwise
 VISIBLE int driver_rmdir(const char *pathname);
 
 // Returns the available space, -1 on error
@@ -147,6 +149,41 @@ VISIBLE int driver_copyToLocal(const char *sourcefilename,
 VISIBLE int driver_copyFromLocal(const char *sourcefilename,
                                  const char *destfilename);
 
+///////////////////////////////////////////////////////////////////////////////////
+// The following functions are specific to this driver
+
+// Download the parts of the file to the disk cache set by GCS_DISK_CACHE_DIR,
+// for the following reads of the file to be served from local disk
+// Returns 1 on success, 0 on error
+VISIBLE int driver_warmDiskCache(const char *filename);
+
+// Copy sourcefilename to destfilename within the storage, the bytes are not
+// transferred through the driver unless the parts of sourcefilename repeat a
+// common header. The parts of a multi-part source are joined in destfilename
+// Returns 1 on success, 0 on error
+VISIBLE int driver_copy(const char *sourcefilename, const char *destfilename);
+
+// Move sourcefilename to destfilename: copy as driver_copy, then delete the
+// parts of sourcefilename
+// Returns 1 on success, 0 on error
+VISIBLE int driver_rename(const char *sourcefilename, const char *destfilename);
+
+// Metadata of a file, as returned by driver_getFilesMetadata
+typedef struct {
+  int exists;           // 1 if the file exists, 0 otherwise
+  long long size;       // size as returned by driver_getFileSize, -1 if unknown
+  long long nb_parts;   // number of objects making the file
+  long long generation; // highest generation of the objects of the file
+} tFileMetadata;
+
+// Look up count files at once, filling metadata[i] for filenames[i]. The
+// lookups are concurrent, and the files found are kept for
+// GCS_METADATA_CACHE_TTL seconds for their opens and size queries
+// Returns 1 on success, 0 if a lookup failed for another reason than a missing
+// file
+VISIBLE int driver_getFilesMetadata(const char **filenames, int count,
+                                    tFileMetadata *metadata);
+
 #ifdef __cplusplus
 } /* extern "C" */
 #endif /* __cplusplus */
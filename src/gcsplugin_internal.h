@@ -1,5 +1,8 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <initializer_list>
 #include <memory>
 #include <string>
 #include <vector>
@@ -45,6 +48,21 @@ VISIBLE void *test_addWriterHandle(bool appendMode = false,
 } /* extern "C" */
 #endif /* __cplusplus */
 
+// Internal functions checked by the tests
+VISIBLE std::string test_getMiddleName(const std::string &last,
+                                       const std::string &end,
+                                       const std::string &prefix);
+
+// Address of a buffer of size bytes taken from the pool of the transfer
+// buffers, and given back at once, null if it cannot be allocated
+VISIBLE const void *test_takeIoBuffer(size_t size);
+
+// Number of requests that waited for a concurrent request of their range
+VISIBLE long long test_getCoalescedRequests();
+
+// Bytes reserved from the memory budget by the buffers kept by the driver
+VISIBLE long long test_getReservedMemory();
+
 namespace gcsplugin {
 constexpr int kSuccess{1};
 constexpr int kFailure{0};
@@ -57,15 +75,196 @@ constexpr int kTrue{1};
 
 using tOffset = long long;
 
+// Encoding of the stored parts of a multifile. Compressed parts are inflated on
+// the fly by the reading path, offsets and sizes are expressed in uncompressed
+// bytes.
+enum class Compression { kNone, kGzip, kZstd };
+
+// Streaming decoder state and checkpoint index of a compressed part, and state
+// of the compression of a written object, defined in the implementation file
+struct DecodeState;
+struct CompressedPartIndex;
+struct CompressState;
+struct PendingParts;
+struct PrefetchedBlock;
+
+// Names of the parts of a multifile, front coded: each name is stored as the
+// suffix following the prefix it shares with the previous name, with a full
+// name at regular intervals to bound the cost of an access. The storage is
+// immutable and shared by the copies.
+class PartNames {
+public:
+  // the object names are at most 1024 bytes long
+  struct Storage {
+    std::string suffixes_;
+    std::vector<size_t> restart_offsets_; // in suffixes_
+    std::vector<std::uint16_t> prefix_lengths_;
+    std::vector<std::uint16_t> suffix_lengths_;
+
+    bool operator==(const Storage &other) const {
+      return suffixes_ == other.suffixes_ &&
+             prefix_lengths_ == other.prefix_lengths_ &&
+             suffix_lengths_ == other.suffix_lengths_;
+    }
+  };
+
+  PartNames() = default;
+
+  PartNames(std::initializer_list<std::string> names)
+      : PartNames(std::vector<std::string>(names)) {}
+
+  PartNames(const std::vector<std::string> &names) {
+    std::shared_ptr<Storage> storage = std::make_shared<Storage>();
+    const std::string *previous{nullptr};
+    for (size_t i = 0; i < names.size(); i++) {
+      const std::string &name = names[i];
+      size_t prefix_length{0};
+      if (i % restart_interval == 0) {
+        storage->restart_offsets_.push_back(storage->suffixes_.size());
+      } else {
+        const size_t max_length = std::min(previous->size(), name.size());
+        while (prefix_length < max_length &&
+               (*previous)[prefix_length] == name[prefix_length]) {
+          prefix_length++;
+        }
+      }
+      storage->suffixes_.append(name, prefix_length, std::string::npos);
+      storage->prefix_lengths_.push_back(
+          static_cast<std::uint16_t>(prefix_length));
+      storage->suffix_lengths_.push_back(
+          static_cast<std::uint16_t>(name.size() - prefix_length));
+      previous = &name;
+    }
+    storage->suffixes_.shrink_to_fit();
+    storage_ = std::move(storage);
+  }
+
+  explicit PartNames(std::shared_ptr<const Storage> storage)
+      : storage_(std::move(storage)) {}
+
+  size_t size() const {
+    return storage_ ? storage_->prefix_lengths_.size() : 0;
+  }
+
+  bool empty() const { return size() == 0; }
+
+  std::string operator[](size_t i) const {
+    std::string name;
+    size_t start = storage_->restart_offsets_[i / restart_interval];
+    for (size_t j = i - i % restart_interval; j <= i; j++) {
+      name.resize(storage_->prefix_lengths_[j]);
+      name.append(storage_->suffixes_, start, storage_->suffix_lengths_[j]);
+      start += storage_->suffix_lengths_[j];
+    }
+    return name;
+  }
+
+  const std::shared_ptr<const Storage> &storage() const { return storage_; }
+
+  bool operator==(const PartNames &other) const {
+    return storage_ == other.storage_ || (empty() && other.empty()) ||
+           (storage_ && other.storage_ && *storage_ == *other.storage_);
+  }
+
+private:
+  static constexpr size_t restart_interval{16};
+  std::shared_ptr<const Storage> storage_;
+};
+
+// Value of each part of a multifile, in a single array, immutable and shared by
+// the copies
+template <typename T> class PartTable {
+public:
+  using Storage = std::vector<T>;
+  using const_iterator = typename Storage::const_iterator;
+
+  PartTable() = default;
+
+  PartTable(std::initializer_list<T> values) : PartTable(Storage(values)) {}
+
+  PartTable(Storage values)
+      : storage_(std::make_shared<const Storage>(std::move(values))) {}
+
+  explicit PartTable(std::shared_ptr<const Storage> storage)
+      : storage_(std::move(storage)) {}
+
+  size_t size() const { return storage_ ? storage_->size() : 0; }
+  bool empty() const { return size() == 0; }
+  const T &operator[](size_t i) const { return (*storage_)[i]; }
+  const T &front() const { return storage_->front(); }
+  const T &back() const { return storage_->back(); }
+  const_iterator begin() const { return Get().begin(); }
+  const_iterator end() const { return Get().end(); }
+
+  const std::shared_ptr<const Storage> &storage() const { return storage_; }
+
+  bool operator==(const PartTable &other) const { return Get() == other.Get(); }
+
+private:
+  const Storage &Get() const {
+    static const Storage no_values;
+    return storage_ ? *storage_ : no_values;
+  }
+
+  std::shared_ptr<const Storage> storage_;
+};
+
+// Cumulative sizes of the parts
+using PartSizes = PartTable<tOffset>;
+// Generations and CRC32C of the parts, as listed
+using PartGenerations = PartTable<std::int64_t>;
+using PartChecksums = PartTable<std::string>;
+// Indexes of compressed parts, null for the parts not resolved yet
+using PartIndexes = PartTable<std::shared_ptr<const CompressedPartIndex>>;
+
+// Position of the next read in the parts of a multifile, kept between reads so
+// that sequential reads do not look the part up again
+struct ReadCursor {
+  tOffset offset_{-1}; // offset in the multifile it stands for, -1 if unset
+  size_t part_idx_{0};
+  std::string part_name_;
+  tOffset part_pos_{0};       // offset in the part object
+  tOffset part_remaining_{0}; // bytes left to read in the part
+};
+
+// Sizing of the requests of a handle reading sequentially, which ask for more
+// than the reads and keep the rest for the next ones
+struct ReadAhead {
+  tOffset next_offset_{-1}; // offset following the last read, -1 if none
+  int sequential_reads_{0}; // reads in a row starting at next_offset_
+  tOffset request_size_{0}; // 0 until the first extended request
+  double last_rate_{0};     // bytes/s of the last extended request
+  bool growing_{true};
+};
+
 struct MultiPartFile {
   std::string bucketname_;
   std::string filename_;
   tOffset offset_{0};
   // Added for multifile support
   tOffset commonHeaderLength_{0};
-  std::vector<std::string> filenames_;
-  std::vector<tOffset> cumulativeSize_;
+  PartNames filenames_;
+  PartSizes cumulativeSize_;
   tOffset total_size_{0};
+  // Added for compressed inputs support
+  Compression compression_{Compression::kNone};
+  std::shared_ptr<DecodeState> decoder_{};
+  PartIndexes indexes_{};
+  // Added for checksums validation: CRC32C of the parts, as listed
+  PartChecksums checksums_{};
+  // Added for resumed downloads: generation of the parts, as listed
+  PartGenerations generations_{};
+  // Added for lazy opening: parts still resolved in the background, the
+  // multifile is limited to its first part until they are
+  std::shared_ptr<PendingParts> pending_{};
+  // Added for sequential reads
+  ReadCursor cursor_{};
+  // Added for small objects: their whole content, fetched at opening
+  std::shared_ptr<const std::vector<char>> content_{};
+  // Added for prefetching: blocks requested at opening, ahead of the reads
+  std::vector<std::shared_ptr<PrefetchedBlock>> prefetched_{};
+  // Added for adaptive request sizing
+  ReadAhead read_ahead_{};
 };
 
 struct WriteFile {
@@ -73,6 +272,10 @@ struct WriteFile {
   std::string filename_;
   std::string append_target_;
   google::cloud::storage::ObjectWriteStream writer_;
+  // Added for compressed outputs support
+  std::shared_ptr<CompressState> compressor_{};
+  // Added for checksums validation: CRC32C of the uploaded bytes
+  uint32_t crc32c_{0};
 };
 
 using Reader = MultiPartFile;
@@ -138,7 +341,8 @@ bool operator==(const MultiPartFile &op1, const MultiPartFile &op2) {
           op1.commonHeaderLength_ == op2.commonHeaderLength_ &&
           op1.filenames_ == op2.filenames_ &&
           op1.cumulativeSize_ == op2.cumulativeSize_ &&
-          op1.total_size_ == op2.total_size_);
+          op1.total_size_ == op2.total_size_ &&
+          op1.compression_ == op2.compression_);
 }
 
 bool operator==(const WriteFile &op1, const WriteFile &op2) {
@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__unix__) || defined(__unix) ||                                    \
+    (defined(__APPLE__) && defined(__MACH__))
+#define __unix_or_mac__
+#else
+#define __windows__
+#endif
+
+#ifdef __unix_or_mac__
+#include <dlfcn.h>
+#else
+#include "errhandlingapi.h"
+#include <windows.h>
+#endif
+
+/* API functions definition, that must be defined in the library */
+int (*ptr_driver_connect)();
+int (*ptr_driver_disconnect)();
+const char *(*ptr_driver_getlasterror)();
+int (*ptr_driver_warmDiskCache)(const char *filename);
+
+/* functions prototype */
+void usage();
+void *load_shared_library(const char *library_name);
+int free_shared_library(void *library_handle);
+void *get_shared_library_function(void *library_handle,
+                                  const char *function_name);
+
+/* error indicator in case of error */
+int global_error = 0;
+
+// Stage the files given on the command line in the disk cache of the driver,
+// set by GCS_DISK_CACHE_DIR, before the job reading them starts
+int main(int argc, char *argv[]) {
+  if (argc < 3)
+    usage();
+
+  // Try to load the shared library
+  void *library_handle = load_shared_library(argv[1]);
+  if (!library_handle) {
+    fprintf(stderr, "Error while loading library %s", argv[1]);
+#ifdef __unix_or_mac__
+    fprintf(stderr, " (%s). ", dlerror());
+#else
+    fwprintf(stderr, L" (0x%x). ", GetLastError());
+#endif
+    fprintf(stderr,
+            "Check LD_LIBRARY_PATH or set the library with its full path\n");
+    exit(EXIT_FAILURE);
+  }
+
+  *(void **)(&ptr_driver_connect) =
+      get_shared_library_function(library_handle, "driver_connect");
+  *(void **)(&ptr_driver_disconnect) =
+      get_shared_library_function(library_handle, "driver_disconnect");
+  *(void **)(&ptr_driver_getlasterror) =
+      get_shared_library_function(library_handle, "driver_getlasterror");
+  *(void **)(&ptr_driver_warmDiskCache) =
+      get_shared_library_function(library_handle, "driver_warmDiskCache");
+
+  if (!global_error) {
+    if (ptr_driver_connect()) {
+      for (int i = 2; i < argc; i++) {
+        printf("Staging %s\n", argv[i]);
+        if (!ptr_driver_warmDiskCache(argv[i])) {
+          fprintf(stderr, "Error while staging %s: %s\n", argv[i],
+                  ptr_driver_getlasterror());
+          global_error = 1;
+        }
+      }
+      ptr_driver_disconnect();
+    } else {
+      fprintf(stderr, "Error while connecting: %s\n",
+              ptr_driver_getlasterror());
+      global_error = 1;
+    }
+  }
+
+  free_shared_library(library_handle);
+  if (global_error) {
+    printf("Warm-up failed\n");
+    exit(EXIT_FAILURE);
+  }
+  printf("Warm-up done\n");
+  return EXIT_SUCCESS;
+}
+
+void usage() {
+  printf("Usage : gcswarmcache libraryname file_uri [file_uri ...]\n");
+  printf("example : GCS_DISK_CACHE_DIR=/mnt/cache gcswarmcache "
+         "libkhiopsdriver_file_gcs.so gs://bucket/dataset/part-*.txt\n");
+  exit(EXIT_FAILURE);
+}
+
+void *load_shared_library(const char *library_name) {
+#if defined(__windows__)
+  void *handle = (void *)LoadLibrary(library_name);
+  return handle;
+#elif defined(__unix_or_mac__)
+  return dlopen(library_name, RTLD_NOW);
+#endif
+}
+
+int free_shared_library(void *library_handle) {
+#if defined(__windows__)
+  return FreeLibrary((HINSTANCE)library_handle);
+#elif defined(__unix_or_mac__)
+  return dlclose(library_handle);
+#endif
+}
+
+void *get_shared_library_function(void *library_handle,
+                                  const char *function_name) {
+  void *ptr;
+#if defined(__windows__)
+  ptr = (void *)GetProcAddress((HINSTANCE)library_handle, function_name);
+#elif defined(__unix_or_mac__)
+  ptr = dlsym(library_handle, function_name);
+#endif
+  if (ptr == NULL) {
+    global_error = 1;
+#ifdef __unix_or_mac__
+    fprintf(stderr, "Unable to load %s (%s)\n", function_name, dlerror());
+#else
+    fprintf(stderr, "Unable to load %s", function_name);
+    fwprintf(stderr, L"(0x%x)\n", GetLastError());
+#endif
+  }
+  return ptr;
+}
@@ -5,10 +5,17 @@
 #include <cstring>
 #include <fstream>
 #include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
 #include <limits>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <random>
+#include <set>
 #include <sstream>
+#include <thread>
 
 #include <boost/process/environment.hpp>
 
@@ -16,9 +23,18 @@
 #include <boost/uuid/uuid_generators.hpp> // generators
 #include <boost/uuid/uuid_io.hpp>         // streaming operators etc.
 
+#include "google/cloud/internal/options.h"
 #include "google/cloud/storage/testing/mock_client.h"
 #include <gtest/gtest.h>
 
+#include <zlib.h>
+
+#ifndef _WIN32
+#include <dirent.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 using namespace gcsplugin;
 
 namespace gc = ::google::cloud;
@@ -26,6 +42,7 @@ namespace gcs = gc::storage;
 
 using ::testing::Return;
 using LOReturnType = gc::StatusOr<gcs::internal::ListObjectsResponse>;
+using OMReturnType = gc::StatusOr<gcs::ObjectMetadata>;
 
 TEST(GCSDriverTest, GetDriverName) {
   ASSERT_STREQ(driver_getDriverName(), "GCS driver");
@@ -141,7 +158,7 @@ TEST(GCSDriverTest, GetFileSizeInvalidCredentialsFailure) {
 
 TEST(GCSDriverTest, RmDir) {
   ASSERT_EQ(driver_connect(), kSuccess);
-  ASSERT_EQ(driver_rmdir("dummy"), kSuccess);
+  ASSERT_EQ(driver_rmdir("dummy"), kFailure);
   ASSERT_EQ(driver_disconnect(), kSuccess);
 }
 
@@ -264,6 +281,11 @@ public:
         .WillOnce(Return<LOReturnType>(std::move(result)));
   }
 
+  void PrepareGetObjectMetadata(OMReturnType result) {
+    EXPECT_CALL(*mock_client, GetObjectMetadata)
+        .WillOnce(Return<OMReturnType>(std::move(result)));
+  }
+
   HandleContainer *GetHandles() {
     return reinterpret_cast<HandleContainer *>(test_getActiveHandles());
   }
@@ -271,25 +293,34 @@ public:
   void CheckHandlesEmpty() { ASSERT_TRUE(GetHandles()->empty()); }
   void CheckHandlesSize(size_t size) { ASSERT_EQ(GetHandles()->size(), size); }
 
-  void *OpenReadOnly() {
-    return driver_fopen("gs://mock_bucket/mock_file", 'r');
+  // names without glob characters are looked up directly, the others listed
+  static constexpr const char *mock_read_uri = "gs://mock_bucket/mock_file";
+  static constexpr const char *mock_glob_uri = "gs://mock_bucket/mock_file_*";
+
+  void *OpenReadOnly(const char *uri = mock_read_uri) {
+    return driver_fopen(uri, 'r');
   }
 
   void *OpenWriteOnly() { return driver_fopen(mock_uri, 'w'); }
 
-  void OpenSuccess(const Reader &expected) {
-    void *res = OpenReadOnly();
+  void OpenSuccess(const Reader &expected, const char *uri = mock_read_uri) {
+    void *res = OpenReadOnly(uri);
     ASSERT_NE(res, nullptr);
 
     CheckHandlesSize(1);
 
+    // the parts after the first one are resolved in the background, seeking
+    // from the end waits for them
+    ASSERT_EQ(driver_fseek(res, 0, std::ios::end), 0);
+    ASSERT_EQ(driver_fseek(res, 0, std::ios::beg), 0);
+
     Handle *res_cast{reinterpret_cast<Handle *>(res)};
     ASSERT_EQ(res_cast->type, HandleType::kRead);
     ASSERT_EQ(res_cast->GetReader(), expected);
   }
 
-  void OpenFailure() {
-    void *res = OpenReadOnly();
+  void OpenFailure(const char *uri = mock_read_uri) {
+    void *res = OpenReadOnly(uri);
     EXPECT_EQ(res, nullptr);
     CheckHandlesEmpty();
   }
@@ -318,6 +349,51 @@ public:
     return [&](void *buf, size_t n) { return SimulateRead(buf, n, args); };
   }
 
+  using Range = std::pair<std::int64_t, std::int64_t>;
+
+  // ReadObject action serving the requested range of a content, in reads of
+  // any size. The ranges requested are added to requests if given.
+  static std::function<
+      gc::StatusOr<std::unique_ptr<gcs::internal::ObjectReadSource>>(
+          gcs::internal::ReadObjectRangeRequest const &)>
+  ServeContent(std::string content, std::vector<Range> *requests = nullptr) {
+    auto requests_mutex = std::make_shared<std::mutex>();
+    return [=](gcs::internal::ReadObjectRangeRequest const &request) {
+      // the stored bytes, not transcoded by the service
+      const auto encoding = request.GetOption<gcs::AcceptEncoding>();
+      EXPECT_TRUE(encoding.has_value() && encoding.value() == "gzip");
+      const std::int64_t size = static_cast<std::int64_t>(content.size());
+      const std::int64_t begin = std::min(request.StartingByte(), size);
+      const std::int64_t end =
+          request.HasOption<gcs::ReadRange>()
+              ? std::min(request.GetOption<gcs::ReadRange>().value().end, size)
+              : size;
+      if (requests) {
+        std::lock_guard<std::mutex> lock{*requests_mutex};
+        requests->emplace_back(begin, end);
+      }
+      const std::string served = content.substr(
+          static_cast<size_t>(begin), static_cast<size_t>(end - begin));
+
+      std::unique_ptr<gcs::testing::MockObjectReadSource> mock_source{
+          new gcs::testing::MockObjectReadSource};
+      auto offset = std::make_shared<size_t>(0);
+      EXPECT_CALL(*mock_source, IsOpen()).WillRepeatedly([=]() {
+        return *offset < served.size();
+      });
+      EXPECT_CALL(*mock_source, Read).WillRepeatedly([=](void *buf, size_t n) {
+        const size_t l = std::min(n, served.size() - *offset);
+        std::memcpy(buf, served.data() + *offset, l);
+        *offset += l;
+        return gcs::internal::ReadSourceResult{
+            l, gcs::internal::HttpResponse{200, {}, {}}};
+      });
+      return gc::make_status_or<
+          std::unique_ptr<gcs::internal::ObjectReadSource>>(
+          std::move(mock_source));
+    };
+  }
+
   void TestMultifileOpenSuccess(LOReturnType arg,
                                 ReadSimulatorParams &mock_file_1,
                                 ReadSimulatorParams &mock_file_2,
@@ -326,7 +402,7 @@ public:
     EXPECT_CALL(*mock_client, ReadObject)
         .WillOnce(READ_MOCK_LAMBDA(GenerateReadSimulator(mock_file_1)))
         .WillOnce(READ_MOCK_LAMBDA(GenerateReadSimulator(mock_file_2)));
-    OpenSuccess(expected);
+    OpenSuccess(expected, mock_glob_uri);
 
     *mock_file_1.offset = 0;
     *mock_file_2.offset = 0;
@@ -377,16 +453,26 @@ MakeLOR(const std::string &bucket_name, const std::vector<std::string> &names,
 TEST_F(GCSDriverTestFixture, FileExists) {
   CheckInvalidURIs(driver_fileExists, kFalse);
 
+  EXPECT_CALL(*mock_client, GetObjectMetadata)
+      .WillOnce(Return<OMReturnType>(
+          MakeObjectMetadata("mock_bucket", "mock_name", 1, 10))) // file exists
+      .WillOnce(Return<OMReturnType>(
+          gc::Status{gc::StatusCode::kNotFound, "not found"})) // no file found
+      .WillOnce(Return<OMReturnType>({}));                     // return error
+
+  ASSERT_EQ(driver_fileExists("gs://mock_bucket/mock_name"), kTrue);
+  ASSERT_EQ(driver_fileExists("gs://mock_bucket/no_match"), kFalse);
+  ASSERT_EQ(driver_fileExists("gs://mock_bucket/error"), kFalse);
+
+  // glob patterns are listed
   EXPECT_CALL(*mock_client, ListObjects)
       .WillOnce(Return<LOReturnType>(
           MakeLOR("mock_bucket", {"mock_name"}, {10}))) // file exists
       .WillOnce(Return<LOReturnType>(
-          gcs::internal::ListObjectsResponse{})) // no file found
-      .WillOnce(Return<LOReturnType>({}));       // return error
+          gcs::internal::ListObjectsResponse{})); // no file found
 
-  ASSERT_EQ(driver_fileExists("gs://mock_bucket/mock_name"), kTrue);
-  ASSERT_EQ(driver_fileExists("gs://mock_bucket/no_match"), kFalse);
-  ASSERT_EQ(driver_fileExists("gs://mock_bucket/error"), kFalse);
+  ASSERT_EQ(driver_fileExists("gs://mock_bucket/mock_*"), kTrue);
+  ASSERT_EQ(driver_fileExists("gs://mock_bucket/no_match*"), kFalse);
 }
 
 TEST_F(GCSDriverTestFixture, DirExists) {
@@ -403,17 +489,21 @@ TEST_F(GCSDriverTestFixture, GetFileSize) {
   };
 
   // dir passed as argument, not a file. same behaviour as "no file found"
-  prepare_list_objects(MakeLOR("mock_bucket", {}, {}));
+  PrepareGetObjectMetadata(gc::Status{gc::StatusCode::kNotFound, "not found"});
   ASSERT_EQ(driver_getFileSize("gs://mock_bucket/dir_name/"), -1);
 
-  // valid URI, but ListObjects returns unusable data
-  prepare_list_objects({});
+  // valid URI, but GetObjectMetadata returns unusable data
+  PrepareGetObjectMetadata({});
   ASSERT_EQ(driver_getFileSize("gs://mock_bucket/error"), -1);
 
+  // glob pattern matching no file
+  prepare_list_objects(MakeLOR("mock_bucket", {}, {}));
+  ASSERT_EQ(driver_getFileSize("gs://mock_bucket/dir_name/*"), -1);
+
   // single file
   constexpr uint64_t expected_size{10};
-  prepare_list_objects(
-      MakeLOR("mock_bucket", {"mock_object"}, {expected_size}));
+  PrepareGetObjectMetadata(
+      MakeObjectMetadata("mock_bucket", "mock_object", 1, expected_size));
   ASSERT_EQ(driver_getFileSize("gs://mock_bucket/mock_object"),
             static_cast<long long>(expected_size));
 
@@ -462,7 +552,7 @@ TEST_F(GCSDriverTestFixture, GetFileSize) {
       .WillOnce(READ_MOCK_LAMBDA(
           generate_simulator(mock_content_2, mock_content_2_size, offset_2)));
 
-  ASSERT_EQ(driver_getFileSize("gs://mock_bucket/mock_object"),
+  ASSERT_EQ(driver_getFileSize("gs://mock_bucket/mock_file_*"),
             mock_content_total_size);
 
   // multifile, 2 files, same header
@@ -484,7 +574,7 @@ TEST_F(GCSDriverTestFixture, GetFileSize) {
       .WillOnce(READ_MOCK_LAMBDA(
           generate_simulator(mock_content_3, mock_content_3_size, offset_3)));
 
-  ASSERT_EQ(driver_getFileSize("gs://mock_bucket/mock_object"),
+  ASSERT_EQ(driver_getFileSize("gs://mock_bucket/mock_file_*"),
             expected_size_common_header);
 
   // multifile, with a read failure on first file
@@ -496,7 +586,7 @@ TEST_F(GCSDriverTestFixture, GetFileSize) {
                                {mock_content_1_size, mock_content_3_size}));
 
   EXPECT_CALL(*mock_client, ReadObject).WillOnce(READ_MOCK_LAMBDA_FAILURE);
-  ASSERT_EQ(driver_getFileSize("gs://mock_bucket/mock_object"), -1);
+  ASSERT_EQ(driver_getFileSize("gs://mock_bucket/mock_file_*"), -1);
 
   // multi file, read failure on second file
 
@@ -508,9 +598,155 @@ TEST_F(GCSDriverTestFixture, GetFileSize) {
           generate_simulator(mock_content_1, mock_content_1_size, offset_1)))
       .WillOnce(READ_MOCK_LAMBDA_FAILURE);
 
-  ASSERT_EQ(driver_getFileSize("gs://mock_bucket/mock_object"), -1);
+  ASSERT_EQ(driver_getFileSize("gs://mock_bucket/mock_file_*"), -1);
+}
+
+TEST_F(GCSDriverTestFixture, GetFilesMetadata) {
+  const char *uris[] = {"gs://mock_bucket/batch_file",
+                        "gs://mock_bucket/batch_missing"};
+  tFileMetadata metadata[2];
+  ASSERT_EQ(driver_getFilesMetadata(nullptr, 2, metadata), kFailure);
+  ASSERT_EQ(driver_getFilesMetadata(uris, 2, nullptr), kFailure);
+
+  // the lookups are concurrent, in any order, and a plain object is sized by
+  // its metadata
+  EXPECT_CALL(*mock_client, ReadObject).Times(0);
+  EXPECT_CALL(*mock_client, GetObjectMetadata)
+      .Times(2)
+      .WillRepeatedly(
+          [](gcs::internal::GetObjectMetadataRequest const &request)
+              -> OMReturnType {
+            if (request.object_name() == "batch_file") {
+              return MakeObjectMetadata("mock_bucket", "batch_file", 3, 10);
+            }
+            return gc::Status{gc::StatusCode::kNotFound, "not found"};
+          });
+
+  ASSERT_EQ(driver_getFilesMetadata(uris, 2, metadata), kSuccess);
+  ASSERT_EQ(metadata[0].exists, 1);
+  ASSERT_EQ(metadata[0].size, 10);
+  ASSERT_EQ(metadata[0].nb_parts, 1);
+  ASSERT_EQ(metadata[0].generation, 3);
+  ASSERT_EQ(metadata[1].exists, 0);
+  ASSERT_EQ(metadata[1].size, -1);
+
+  // the file found is not looked up again
+  ASSERT_EQ(driver_fileExists(uris[0]), kTrue);
+  ASSERT_EQ(driver_getFileSize(uris[0]), 10);
+}
+
+TEST_F(GCSDriverTestFixture, ListObjects_ProjectsFields) {
+  // the listings and the lookups only ask for the fields read by the driver,
+  // the listings by the largest pages
+  EXPECT_CALL(*mock_client, ListObjects)
+      .WillOnce([](gcs::internal::ListObjectsRequest const &request)
+                    -> LOReturnType {
+        EXPECT_EQ(request.GetOption<gcs::Fields>().value(),
+                  "items(name,size,generation,crc32c,contentEncoding),"
+                  "nextPageToken");
+        EXPECT_EQ(request.GetOption<gcs::MaxResults>().value(), 1000);
+        gcs::internal::ListObjectsResponse response;
+        response.items.push_back(
+            MakeObjectMetadata("mock_bucket", "projected_0", 1, 15));
+        response.items.push_back(
+            MakeObjectMetadata("mock_bucket", "projected_1", 1, 15));
+        return response;
+      });
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillRepeatedly(ServeContent("mock_header\nabc"));
+  ASSERT_EQ(driver_getFileSize("gs://mock_bucket/projected_*"), 18);
+
+  EXPECT_CALL(*mock_client, GetObjectMetadata)
+      .WillOnce([](gcs::internal::GetObjectMetadataRequest const &request)
+                    -> OMReturnType {
+        EXPECT_EQ(request.GetOption<gcs::Fields>().value(),
+                  "name,size,generation,crc32c,contentEncoding");
+        return MakeObjectMetadata("mock_bucket", "projected_file", 1, 10);
+      });
+  ASSERT_EQ(driver_getFileSize("gs://mock_bucket/projected_file"), 10);
+}
+
+TEST(GCSDriverTest, IoBufferPool) {
+  // the buffers are page-aligned, a released one is taken again by the next
+  // buffer of its size class
+  const void *buffer = test_takeIoBuffer(1000);
+  ASSERT_NE(buffer, nullptr);
+  ASSERT_EQ(reinterpret_cast<uintptr_t>(buffer) % 4096, 0);
+  ASSERT_EQ(test_takeIoBuffer(4096), buffer);
+
+  // a buffer that cannot be allocated is reported, not thrown
+  ASSERT_EQ(test_takeIoBuffer(std::numeric_limits<size_t>::max()), nullptr);
+}
+
+TEST(GCSDriverTest, PartNames_FrontCoding) {
+  // names of varied lengths sharing prefixes, over several restart intervals
+  std::vector<std::string> names;
+  for (int i = 0; i < 40; i++) {
+    std::ostringstream name;
+    name << "dir/part_" << std::setw(5) << std::setfill('0') << i * 7;
+    if (i % 5 == 0) {
+      name << "_extra";
+    }
+    names.push_back(name.str());
+  }
+  names.push_back("dir/");
+  names.push_back("dir/");
+  names.push_back("other");
+  names.push_back("");
+
+  const PartNames part_names{names};
+  ASSERT_EQ(part_names.size(), names.size());
+  for (size_t i = 0; i < names.size(); i++) {
+    ASSERT_EQ(part_names[i], names[i]) << i;
+  }
+
+  // the copies share the storage, an equal listing compares equal
+  const PartNames copy = part_names;
+  ASSERT_EQ(copy.storage(), part_names.storage());
+  ASSERT_EQ(PartNames{names}, part_names);
+  names.back() = "last";
+  ASSERT_FALSE(PartNames{names} == part_names);
+  ASSERT_TRUE(PartNames{} == PartNames{std::vector<std::string>{}});
+}
+
+TEST(GCSDriverTest, GetMiddleName) {
+  // the split of a range of numbered shards is taken among the digits
+  ASSERT_EQ(test_getMiddleName("part_10", "part_50", "part_"), "part_3");
+  ASSERT_EQ(test_getMiddleName("part_10", "", "part_"), "part_5");
+
+  struct Params {
+    std::string last_;
+    std::string end_;
+    std::string prefix_;
+  };
+  const std::vector<Params> cases = {
+      {"part_1", "part_2", "part_"},       // no room on the differing byte
+      {"part_00999", "", "part_"},         // unbounded end
+      {"part_a", "part_b", "part_"},       // letters
+      {"part_zzz", "", "part_"},           // last of its class
+      {"part_", "part_0", "part_"},        // last is the prefix
+      {"dir/x~~", "dir/y", "dir/"},        // past the printable characters
+      {"part_\xc3\xa9", "", "part_"},    // multi-byte UTF-8 name
+  };
+  for (const auto &params : cases) {
+    const std::string middle =
+        test_getMiddleName(params.last_, params.end_, params.prefix_);
+    ASSERT_FALSE(middle.empty()) << params.last_;
+    ASSERT_LT(params.last_, middle);
+    if (!params.end_.empty()) {
+      ASSERT_LT(middle, params.end_) << params.last_;
+    }
+    ASSERT_EQ(middle.compare(0, params.prefix_.size(), params.prefix_), 0);
+    const unsigned char added = static_cast<unsigned char>(middle.back());
+    ASSERT_TRUE(added >= 0x20 && added < 0x7f) << params.last_;
+  }
+
+  // there is no name between a name and its successor
+  ASSERT_EQ(test_getMiddleName("part_1", std::string("part_1\0", 7), "part_"),
+            "");
 }
 
+
 TEST_F(GCSDriverTestFixture, Open_InvalidURIs_AllModes) {
   constexpr char modes[3] = {'r', 'w', 'a'};
   for (char m : modes) {
@@ -586,12 +822,18 @@ TEST_F(GCSDriverTestFixture, OpenReadModeAndClose_OneFileSuccess) {
   MultiPartFile expected_struct{"mock_bucket", "mock_file", 0, 0,
                                 {"mock_file"}, {10},        10};
 
-  PrepareListObjects(MakeLOR("mock_bucket", {"mock_file"}, {10}));
+  size_t mock_offset{0};
+  ReadSimulatorParams mock_read_params{"mock_conte", 10, &mock_offset};
+
+  PrepareGetObjectMetadata(MakeObjectMetadata("mock_bucket", "mock_file", 1, 10));
+  // a small object is fetched in whole at opening
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillOnce(READ_MOCK_LAMBDA(GenerateReadSimulator(mock_read_params)));
   OpenSuccess(expected_struct);
 }
 
 TEST_F(GCSDriverTestFixture, OpenReadModeAndClose_OneFileFailure) {
-  PrepareListObjects({});
+  PrepareGetObjectMetadata({});
   OpenFailure();
 }
 
@@ -616,7 +858,7 @@ TEST_F(GCSDriverTestFixture,
   constexpr size_t total_size{mock_file_0_size + mock_file_1_size};
 
   MultiPartFile expected_struct{"mock_bucket",
-                                "mock_file",
+                                "mock_file_*",
                                 0,
                                 0,
                                 {"mock_file_0", "mock_file_1"},
@@ -650,7 +892,7 @@ TEST_F(GCSDriverTestFixture, OpenReadModeAndClose_TwoFilesCommonHeaderSuccess) {
                               mock_header_size};
 
   MultiPartFile expected_struct{"mock_bucket",
-                                "mock_file",
+                                "mock_file_*",
                                 0,
                                 static_cast<long long>(mock_header_size),
                                 {"mock_file_0", "mock_file_1"},
@@ -673,8 +915,18 @@ TEST_F(GCSDriverTestFixture,
               {mock_file_0_size, mock_file_1_size});
 
   PrepareListObjects(file0_file1_response);
-  EXPECT_CALL(*mock_client, ReadObject).WillOnce(READ_MOCK_LAMBDA_FAILURE);
-  OpenFailure();
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillRepeatedly(READ_MOCK_LAMBDA_FAILURE);
+
+  // the first block, that holds the header, is fetched in the background: the
+  // failure is met on the first read
+  void *res = OpenReadOnly(mock_glob_uri);
+  ASSERT_NE(res, nullptr);
+  char buf[mock_file_0_size];
+  ASSERT_EQ(driver_fread(buf, 1, sizeof(buf), res), -1);
+  ASSERT_EQ(driver_fseek(res, 0, std::ios::end), -1);
+  ASSERT_EQ(driver_fclose(res), kCloseSuccess);
+  CheckHandlesEmpty();
 }
 
 TEST_F(GCSDriverTestFixture,
@@ -696,7 +948,16 @@ TEST_F(GCSDriverTestFixture,
   EXPECT_CALL(*mock_client, ReadObject)
       .WillOnce(READ_MOCK_LAMBDA(GenerateReadSimulator(mock_file_0)))
       .WillOnce(READ_MOCK_LAMBDA_FAILURE);
-  OpenFailure();
+
+  // the stream opens on its first part, the failure on the header of the
+  // second part is met when the parts after the first one are needed
+  void *res = OpenReadOnly(mock_glob_uri);
+  ASSERT_NE(res, nullptr);
+  ASSERT_EQ(driver_fseek(res, 0, std::ios::end), -1);
+  char buf[mock_file_0_size + 1];
+  ASSERT_EQ(driver_fread(buf, 1, sizeof(buf), res), -1);
+  ASSERT_EQ(driver_fclose(res), kCloseSuccess);
+  CheckHandlesEmpty();
 }
 
 TEST_F(GCSDriverTestFixture, Seek_BadArgs) {
@@ -1035,6 +1296,38 @@ TEST_F(GCSDriverTestFixture, Read_OneFile) {
   }
 }
 
+TEST_F(GCSDriverTestFixture, Read_SmallObjectFromMemory) {
+  constexpr const char *mock_content{"mock_content"};
+  constexpr size_t mock_size{12};
+  size_t mock_offset{0};
+  ReadSimulatorParams mock_read_params{mock_content, mock_size, &mock_offset};
+
+  // the only request is the one fetching the object at opening
+  PrepareGetObjectMetadata(
+      MakeObjectMetadata("mock_bucket", "mock_file", 1, mock_size));
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillOnce(READ_MOCK_LAMBDA(GenerateReadSimulator(mock_read_params)));
+
+  void *stream = OpenReadOnly();
+  ASSERT_NE(stream, nullptr);
+
+  char buff[16] = {};
+  ASSERT_EQ(driver_fread(buff, 1, 4, stream), 4);
+  ASSERT_EQ(std::string(buff, 4), "mock");
+
+  ASSERT_EQ(driver_fseek(stream, 5, std::ios::beg), 0);
+  ASSERT_EQ(driver_fread(buff, 1, sizeof(buff), stream), 7);
+  ASSERT_EQ(std::string(buff, 7), "content");
+
+  ASSERT_EQ(driver_fread(buff, 1, 1, stream), -1);
+
+  ASSERT_EQ(driver_fseek(stream, -6, std::ios::end), 0);
+  ASSERT_EQ(driver_fread(buff, 1, 3, stream), 3);
+  ASSERT_EQ(std::string(buff, 3), "con");
+
+  ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+}
+
 TEST_F(GCSDriverTestFixture, Read_NFiles_NoCommonHeader) {
   constexpr const char *mock_content_0{"mock_header\nmock_content0"};
   constexpr const char *mock_content_1{"mock_content1"};
@@ -1336,6 +1629,334 @@ TEST_F(GCSDriverTestFixture, Read_NFiles_ReadFailures) {
   }
 }
 
+std::string GzipCompress(const std::string &content) {
+  z_stream strm{};
+  // windowBits 15 + 16: gzip wrapper
+  deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+               Z_DEFAULT_STRATEGY);
+  std::string res(deflateBound(&strm, static_cast<uLong>(content.size())),
+                  '\0');
+  strm.next_in =
+      reinterpret_cast<Bytef *>(const_cast<char *>(content.data()));
+  strm.avail_in = static_cast<uInt>(content.size());
+  strm.next_out = reinterpret_cast<Bytef *>(&res[0]);
+  strm.avail_out = static_cast<uInt>(res.size());
+  deflate(&strm, Z_FINISH);
+  res.resize(strm.total_out);
+  deflateEnd(&strm);
+  return res;
+}
+
+// Decode the concatenated members of a gzip stream
+std::string GzipDecompress(const std::string &compressed) {
+  z_stream strm{};
+  inflateInit2(&strm, 15 + 32);
+  strm.next_in =
+      reinterpret_cast<Bytef *>(const_cast<char *>(compressed.data()));
+  strm.avail_in = static_cast<uInt>(compressed.size());
+  std::string res;
+  char out[16384];
+  int ret{Z_OK};
+  while (ret == Z_OK || (ret == Z_STREAM_END && strm.avail_in > 0)) {
+    if (ret == Z_STREAM_END) {
+      inflateReset(&strm);
+    }
+    strm.next_out = reinterpret_cast<Bytef *>(out);
+    strm.avail_out = sizeof(out);
+    ret = inflate(&strm, Z_NO_FLUSH);
+    res.append(out, sizeof(out) - strm.avail_out);
+  }
+  inflateEnd(&strm);
+  return ret == Z_STREAM_END ? res : std::string{};
+}
+
+TEST_F(GCSDriverTestFixture, Read_SequentialReadsAcrossParts) {
+  // parts sharing a header, of different sizes
+  const std::string header{"cursor_header\n"};
+  const std::vector<std::string> names{"cursor_part_0", "cursor_part_1",
+                                       "cursor_part_2"};
+  std::map<std::string, std::string> parts;
+  std::string expected{header};
+  for (size_t i = 0; i < names.size(); i++) {
+    std::string body;
+    for (size_t j = 0; j < 30 + 15 * i; j++) {
+      body.push_back(static_cast<char>('a' + (i * 7 + j) % 26));
+    }
+    parts[names[i]] = header + body;
+    expected += body;
+  }
+  const long long expected_size = static_cast<long long>(expected.size());
+
+  PrepareListObjects(MakeLOR(mock_bucket, names,
+                             {parts[names[0]].size(), parts[names[1]].size(),
+                              parts[names[2]].size()}));
+  std::map<std::string, decltype(ServeContent(""))> serve;
+  for (const auto &part : parts) {
+    serve[part.first] = ServeContent(part.second);
+  }
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillRepeatedly(
+          [&](gcs::internal::ReadObjectRangeRequest const &request) {
+            return serve.at(request.object_name())(request);
+          });
+
+  void *stream = driver_fopen("gs://mock_bucket/cursor_part_*", 'r');
+  ASSERT_NE(stream, nullptr);
+  const MultiPartFile &reader =
+      reinterpret_cast<Handle *>(stream)->GetReader();
+
+  // the reads in a row advance the cursor through the parts, after their
+  // header
+  std::string read;
+  std::vector<char> buff(20);
+  while (read.size() < expected.size()) {
+    const long long nb_read = driver_fread(buff.data(), 1, 7, stream);
+    ASSERT_GT(nb_read, 0);
+    read.append(buff.data(), static_cast<size_t>(nb_read));
+    ASSERT_EQ(reader.cursor_.offset_, static_cast<tOffset>(read.size()));
+  }
+  ASSERT_EQ(read, expected);
+  ASSERT_EQ(reader.cursor_.part_idx_, 2u);
+  ASSERT_EQ(reader.cursor_.part_remaining_, 0);
+
+  // a seek places it again, in the part of the new offset
+  const long long middle = static_cast<long long>(header.size()) + 40;
+  ASSERT_EQ(driver_fseek(stream, middle, std::ios::beg), 0);
+  ASSERT_EQ(driver_fread(buff.data(), 1, 7, stream), 7);
+  ASSERT_EQ(std::string(buff.data(), 7),
+            expected.substr(static_cast<size_t>(middle), 7));
+  ASSERT_EQ(reader.cursor_.part_idx_, 1u);
+  ASSERT_EQ(reader.cursor_.part_name_, names[1]);
+  ASSERT_EQ(reader.cursor_.part_pos_,
+            static_cast<tOffset>(header.size()) + 40 - 30 + 7);
+
+  // from the end, that is its last byte
+  ASSERT_EQ(driver_fseek(stream, -9, std::ios::end), 0);
+  ASSERT_EQ(driver_fread(buff.data(), 1, 20, stream), 10);
+  ASSERT_EQ(std::string(buff.data(), 10),
+            expected.substr(expected.size() - 10));
+  ASSERT_EQ(reader.cursor_.offset_, expected_size);
+  ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+}
+
+TEST_F(GCSDriverTestFixture, Read_CoalescesConcurrentRequests) {
+  std::string content(3 * 1024 * 1024, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = static_cast<char>('a' + i % 17);
+  }
+  EXPECT_CALL(*mock_client, GetObjectMetadata)
+      .WillRepeatedly(Return<OMReturnType>(MakeObjectMetadata(
+          "mock_bucket", "coalesced_file", 4, content.size())));
+
+  // the first request answers once the second handle waits for it
+  const long long nb_coalesced = test_getCoalescedRequests();
+  std::vector<Range> requests;
+  auto serve = ServeContent(content, &requests);
+  std::atomic<int> nb_requests{0};
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillRepeatedly(
+          [&](gcs::internal::ReadObjectRangeRequest const &request) {
+            if (nb_requests++ == 0) {
+              const auto deadline =
+                  std::chrono::steady_clock::now() + std::chrono::seconds(5);
+              while (test_getCoalescedRequests() == nb_coalesced &&
+                     std::chrono::steady_clock::now() < deadline) {
+                std::this_thread::yield();
+              }
+            }
+            return serve(request);
+          });
+
+  // both handles prefetch their first block when opened
+  void *stream_1 = driver_fopen("gs://mock_bucket/coalesced_file", 'r');
+  ASSERT_NE(stream_1, nullptr);
+  void *stream_2 = driver_fopen("gs://mock_bucket/coalesced_file", 'r');
+  ASSERT_NE(stream_2, nullptr);
+
+  std::vector<char> buff(1000);
+  for (void *stream : {stream_1, stream_2}) {
+    ASSERT_EQ(driver_fread(buff.data(), 1, buff.size(), stream), 1000);
+    ASSERT_TRUE(std::equal(buff.begin(), buff.end(), content.begin()));
+    ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+  }
+  ASSERT_EQ(requests.size(), 1u);
+  ASSERT_EQ(requests[0].first, 0);
+  ASSERT_EQ(test_getCoalescedRequests(), nb_coalesced + 1);
+}
+
+TEST_F(GCSDriverTestFixture, Read_GzipFile) {
+  const std::string content{"mock_header\nmock_content_in_a_gzip_file"};
+  const std::string compressed = GzipCompress(content);
+  const long long content_size = static_cast<long long>(content.size());
+
+  std::vector<Range> requests;
+  PrepareGetObjectMetadata(MakeObjectMetadata(mock_bucket, "mock_gzip_file.gz",
+                                              1, compressed.size()));
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillRepeatedly(ServeContent(compressed, &requests));
+
+  void *stream = driver_fopen("gs://mock_bucket/mock_gzip_file.gz", 'r');
+  ASSERT_NE(stream, nullptr);
+
+  // without the size member of the objects written by the driver, the size
+  // is learned by decoding the object from its start
+  const auto &reader = reinterpret_cast<Handle *>(stream)->GetReader();
+  ASSERT_EQ(reader.compression_, Compression::kGzip);
+  ASSERT_EQ(reader.total_size_, content_size);
+  ASSERT_FALSE(requests.empty());
+  ASSERT_EQ(requests.back(),
+            Range(0, static_cast<std::int64_t>(compressed.size())));
+
+  std::vector<char> buff(content.size());
+  ASSERT_EQ(driver_fread(buff.data(), 1, buff.size(), stream), content_size);
+  ASSERT_EQ(std::string(buff.begin(), buff.end()), content);
+  ASSERT_EQ(reader.offset_, content_size);
+
+  ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+}
+
+TEST_F(GCSDriverTestFixture, Read_GzipFile_SeveralMembers) {
+  // the trailer of the last member does not give the size of the object,
+  // whether the last member is small or holds most of the content
+  std::string first_member{"mock_header\n"};
+  for (int i = 0; i < 1000; i++) {
+    first_member += std::to_string(i * i) + ' ';
+  }
+  std::string large_member;
+  while (large_member.size() < 200000) {
+    large_member += "a line repeated in the large member\n";
+  }
+  const std::vector<std::pair<std::string, std::string>> members{
+      {first_member, "last member\n"}, {"mock_header\n", large_member}};
+
+  for (size_t i = 0; i < members.size(); i++) {
+    const std::string content = members[i].first + members[i].second;
+    const std::string compressed =
+        GzipCompress(members[i].first) + GzipCompress(members[i].second);
+    const long long content_size = static_cast<long long>(content.size());
+    const std::string name = "mock_members_file_" + std::to_string(i) + ".gz";
+
+    EXPECT_CALL(*mock_client, GetObjectMetadata)
+        .WillRepeatedly(Return<OMReturnType>(
+            MakeObjectMetadata(mock_bucket, name, 1, compressed.size())));
+    EXPECT_CALL(*mock_client, ReadObject)
+        .WillRepeatedly(ServeContent(compressed));
+
+    ASSERT_EQ(driver_getFileSize(("gs://mock_bucket/" + name).c_str()),
+              content_size);
+    void *stream = driver_fopen(("gs://mock_bucket/" + name).c_str(), 'r');
+    ASSERT_NE(stream, nullptr);
+    ASSERT_EQ(reinterpret_cast<Handle *>(stream)->GetReader().total_size_,
+              content_size);
+
+    std::vector<char> buff(content.size());
+    ASSERT_EQ(driver_fread(buff.data(), 1, buff.size(), stream), content_size);
+    ASSERT_EQ(std::string(buff.begin(), buff.end()), content);
+    ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+  }
+}
+
+TEST_F(GCSDriverTestFixture, Read_GzipFile_SeekBackwards) {
+  const std::string content{"mock_header\nmock_content_in_a_gzip_file"};
+  const std::string compressed = GzipCompress(content);
+
+  // reading again before the position of the decoder restarts it from the
+  // closest checkpoint, here the start of the object
+  std::vector<Range> requests;
+  PrepareGetObjectMetadata(MakeObjectMetadata(
+      mock_bucket, "mock_seek_gzip_file.gz", 1, compressed.size()));
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillRepeatedly(ServeContent(compressed, &requests));
+
+  void *stream = driver_fopen("gs://mock_bucket/mock_seek_gzip_file.gz", 'r');
+  ASSERT_NE(stream, nullptr);
+
+  std::vector<char> buff(content.size());
+  ASSERT_EQ(driver_fread(buff.data(), 1, 20, stream), 20);
+  ASSERT_EQ(std::string(buff.data(), 20), content.substr(0, 20));
+
+  const size_t nb_requests = requests.size();
+  ASSERT_EQ(driver_fseek(stream, 5, std::ios::beg), 0);
+  ASSERT_EQ(driver_fread(buff.data(), 1, 10, stream), 10);
+  ASSERT_EQ(std::string(buff.data(), 10), content.substr(5, 10));
+  ASSERT_EQ(requests.size(), nb_requests + 1);
+  ASSERT_EQ(requests.back().first, 0);
+
+  ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+}
+
+TEST_F(GCSDriverTestFixture, Read_ResumesInterruptedDownload) {
+  std::string content(3 * 1024 * 1024, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = static_cast<char>('a' + i % 23);
+  }
+  const long long content_size = static_cast<long long>(content.size());
+  constexpr size_t failure_offset{1536 * 1024};
+
+  // the connection of the first request resets after some bytes, the next
+  // requests start at the first missing byte of the same generation
+  PrepareGetObjectMetadata(MakeObjectMetadata(mock_bucket, "mock_resumed_file",
+                                              7, content.size()));
+  std::mutex requests_mutex;
+  std::vector<Range> requests;
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillRepeatedly([&](gcs::internal::ReadObjectRangeRequest const
+                              &request) {
+        EXPECT_EQ(request.GetOption<gcs::Generation>().value(), 7);
+        const std::int64_t begin = request.StartingByte();
+        const std::int64_t end =
+            request.HasOption<gcs::ReadRange>()
+                ? std::min(request.GetOption<gcs::ReadRange>().value().end,
+                           static_cast<std::int64_t>(content_size))
+                : content_size;
+        bool fails{false};
+        {
+          std::lock_guard<std::mutex> lock{requests_mutex};
+          fails = requests.empty();
+          requests.emplace_back(begin, end);
+        }
+        const std::string served = content.substr(
+            static_cast<size_t>(begin), static_cast<size_t>(end - begin));
+
+        std::unique_ptr<gcs::testing::MockObjectReadSource> mock_source{
+            new gcs::testing::MockObjectReadSource};
+        auto offset = std::make_shared<size_t>(0);
+        EXPECT_CALL(*mock_source, IsOpen()).WillRepeatedly([=]() {
+          return *offset < served.size();
+        });
+        EXPECT_CALL(*mock_source, Read)
+            .WillRepeatedly([=](void *buf, size_t n)
+                                -> gc::StatusOr<gcs::internal::ReadSourceResult> {
+              if (fails && *offset >= failure_offset) {
+                return gc::Status{gc::StatusCode::kUnavailable,
+                                  "Connection reset"};
+              }
+              const size_t l = std::min(n, served.size() - *offset);
+              std::memcpy(buf, served.data() + *offset, l);
+              *offset += l;
+              return gcs::internal::ReadSourceResult{
+                  l, gcs::internal::HttpResponse{200, {}, {}}};
+            });
+        return gc::make_status_or<
+            std::unique_ptr<gcs::internal::ObjectReadSource>>(
+            std::move(mock_source));
+      });
+
+  void *stream = driver_fopen("gs://mock_bucket/mock_resumed_file", 'r');
+  ASSERT_NE(stream, nullptr);
+  std::vector<char> buff(content.size());
+  ASSERT_EQ(driver_fread(buff.data(), 1, buff.size(), stream), content_size);
+  ASSERT_TRUE(std::equal(buff.begin(), buff.end(), content.begin()));
+  ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+
+  // the bytes received before the failure are kept, in chunks of 1 MiB at
+  // least
+  ASSERT_EQ(requests.size(), 2u);
+  ASSERT_GE(requests[1].first, 1024 * 1024);
+  ASSERT_LT(requests[1].first, content_size);
+  ASSERT_EQ(requests[1].second, requests[0].second);
+}
+
 TEST_F(GCSDriverTestFixture, OpenWriteMode_OK) {
   using gcs::internal::CreateResumableUploadResponse;
 
@@ -1365,6 +1986,80 @@ TEST_F(GCSDriverTestFixture, OpenWriteMode_OK) {
   ASSERT_TRUE(sub_writer.last_status().ok());
 }
 
+TEST_F(GCSDriverTestFixture, OpenWriteMode_CompressedName) {
+  using gcs::internal::CreateResumableUploadResponse;
+  using gcs::internal::QueryResumableUploadResponse;
+  using gcs::internal::UploadChunkRequest;
+
+  ON_CALL(*mock_client, CreateResumableUpload)
+      .WillByDefault(Return(CreateResumableUploadResponse{"mock_upload_id"}));
+
+  // the name of the object selects the compression of the written bytes
+  void *plain = driver_fopen("gs://mock_bucket/mock_object", 'w');
+  ASSERT_NE(plain, nullptr);
+  ASSERT_EQ(reinterpret_cast<Handle *>(plain)->GetWriter().compressor_,
+            nullptr);
+
+  std::string content{"written_header\n"};
+  for (int i = 0; i < 20000; i++) {
+    content += std::to_string(i * 7919 % 10007) + (i % 10 == 9 ? '\n' : ' ');
+  }
+
+  std::string uploaded;
+  EXPECT_CALL(*mock_client, UploadChunk)
+      .WillRepeatedly([&](UploadChunkRequest const &request) {
+        for (auto const &buffer : request.payload()) {
+          uploaded.append(buffer.data(), buffer.size());
+        }
+        QueryResumableUploadResponse response;
+        response.committed_size = request.offset() + request.payload_size();
+        if (request.last_chunk()) {
+          response.payload = MakeObjectMetadata(mock_bucket, "mock_object", 1,
+                                                uploaded.size());
+        }
+        return gc::make_status_or(response);
+      });
+
+  for (const char *name : {"mock_object.gz", "mock_object.zst"}) {
+    uploaded.clear();
+    const std::string uri = std::string("gs://mock_bucket/") + name;
+    void *compressed = driver_fopen(uri.c_str(), 'w');
+    ASSERT_NE(compressed, nullptr);
+    ASSERT_NE(reinterpret_cast<Handle *>(compressed)->GetWriter().compressor_,
+              nullptr);
+    ASSERT_EQ(driver_fwrite(content.data(), 1, content.size(), compressed),
+              static_cast<long long>(content.size()));
+    ASSERT_EQ(driver_fclose(compressed), kCloseSuccess);
+    ASSERT_LT(uploaded.size(), content.size()) << name;
+
+    // the gzip members are decoded by zlib as a single stream
+    if (std::string(name) == "mock_object.gz") {
+      ASSERT_EQ(GzipDecompress(uploaded), content);
+    }
+
+    // read back, sized from the end of the object, asked for as stored: no
+    // request starts at its beginning before the first line is read
+    const std::string read_name = std::string("mock_written_") + name;
+    std::vector<Range> requests;
+    PrepareGetObjectMetadata(
+        MakeObjectMetadata(mock_bucket, read_name, 1, uploaded.size()));
+    EXPECT_CALL(*mock_client, ReadObject)
+        .WillRepeatedly(ServeContent(uploaded, &requests));
+    void *reader = driver_fopen(("gs://mock_bucket/" + read_name).c_str(), 'r');
+    ASSERT_NE(reader, nullptr) << name;
+    ASSERT_EQ(reinterpret_cast<Handle *>(reader)->GetReader().total_size_,
+              static_cast<long long>(content.size()))
+        << name;
+    ASSERT_GT(requests.front().first, 0) << name;
+
+    std::vector<char> buff(content.size());
+    ASSERT_EQ(driver_fread(buff.data(), 1, buff.size(), reader),
+              static_cast<long long>(content.size()));
+    ASSERT_EQ(std::string(buff.begin(), buff.end()), content) << name;
+    ASSERT_EQ(driver_fclose(reader), kCloseSuccess);
+  }
+}
+
 TEST_F(GCSDriverTestFixture, OpenWriteMode_FailClientWriteObject) {
   using gcs::internal::CreateResumableUploadResponse;
 
@@ -1513,4 +2208,1150 @@ TEST_F(GCSDriverTestFixture, Write_Upload_OK) {
 // EXPECT_CALL(*mock_client, UploadChunk)
 //     .WillOnce(Return(QueryResumableUploadResponse{
 //             /*.committed_size=*/absl::nullopt,
-//             /*.object_metadata=*/expected_metadata }));
\ No newline at end of file
+//             /*.object_metadata=*/expected_metadata }));
+
+TEST_F(GCSDriverTestFixture, Crc32c_ValidatesTransfers) {
+  using gcs::internal::CreateResumableUploadResponse;
+  using gcs::internal::DeleteObjectRequest;
+  using gcs::internal::EmptyResponse;
+  using gcs::internal::QueryResumableUploadResponse;
+  using gcs::internal::UploadChunkRequest;
+
+  ON_CALL(*mock_client, CreateResumableUpload)
+      .WillByDefault(Return(CreateResumableUploadResponse{"mock_upload_id"}));
+
+  // CRC32C of the check string of the CRC catalogues, 0xE3069283, base64
+  // encoded in big-endian order as in the object metadata
+  const std::string content{"123456789"};
+  auto write_object = [&](const std::string &stored_crc32c) {
+    EXPECT_CALL(*mock_client, UploadChunk)
+        .WillOnce([&](UploadChunkRequest const &request) {
+          gcs::ObjectMetadata metadata = MakeObjectMetadata(
+              mock_bucket, "mock_crc_object", 1, request.payload_size());
+          metadata.set_crc32c(stored_crc32c);
+          return gc::make_status_or(
+              QueryResumableUploadResponse{request.payload_size(), metadata});
+        });
+    void *stream = driver_fopen("gs://mock_bucket/mock_crc_object", 'w');
+    EXPECT_NE(stream, nullptr);
+    EXPECT_EQ(driver_fwrite(content.data(), 1, content.size(), stream),
+              static_cast<long long>(content.size()));
+    return driver_fclose(stream);
+  };
+
+  EXPECT_CALL(*mock_client, DeleteObject).Times(0);
+  ASSERT_EQ(write_object("4waSgw=="), kCloseSuccess);
+  ::testing::Mock::VerifyAndClearExpectations(mock_client.get());
+
+  // a corrupted upload is not left in place
+  ON_CALL(*mock_client, CreateResumableUpload)
+      .WillByDefault(Return(CreateResumableUploadResponse{"mock_upload_id"}));
+  EXPECT_CALL(*mock_client, DeleteObject)
+      .WillOnce([](DeleteObjectRequest const &request)
+                    -> gc::StatusOr<EmptyResponse> {
+        EXPECT_EQ(request.object_name(), "mock_crc_object");
+        return EmptyResponse{};
+      });
+  ASSERT_EQ(write_object("AAAAAA=="), kFailure);
+
+  // the compressed parts are checked when decoded in whole, here by the scan
+  // learning their size at opening. An empty CRC32C, as on composite objects,
+  // is not checked.
+  const std::string compressed = GzipCompress("mock_header\n" + content);
+  for (const char *stored_crc32c : {"", "AAAAAA=="}) {
+    const std::string name =
+        std::string("mock_crc_read_") + stored_crc32c + ".gz";
+    gcs::ObjectMetadata metadata =
+        MakeObjectMetadata(mock_bucket, name, 1, compressed.size());
+    metadata.set_crc32c(stored_crc32c);
+    PrepareGetObjectMetadata(metadata);
+    EXPECT_CALL(*mock_client, ReadObject)
+        .WillRepeatedly(ServeContent(compressed));
+    void *stream = driver_fopen(("gs://mock_bucket/" + name).c_str(), 'r');
+    if (std::string(stored_crc32c) == "AAAAAA==") {
+      ASSERT_EQ(stream, nullptr);
+      continue;
+    }
+    ASSERT_NE(stream, nullptr);
+    std::array<char, 21> buff{};
+    ASSERT_EQ(driver_fread(buff.data(), 1, buff.size(), stream), 21);
+    ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+  }
+
+  // the small objects are checked when fetched in whole at opening
+  for (const char *stored_crc32c : {"4waSgw==", "AAAAAA=="}) {
+    const std::string name = std::string("mock_crc_read_") + stored_crc32c;
+    gcs::ObjectMetadata metadata =
+        MakeObjectMetadata(mock_bucket, name, 1, content.size());
+    metadata.set_crc32c(stored_crc32c);
+    PrepareGetObjectMetadata(metadata);
+    EXPECT_CALL(*mock_client, ReadObject)
+        .WillRepeatedly(ServeContent(content));
+    void *stream = driver_fopen(("gs://mock_bucket/" + name).c_str(), 'r');
+    if (std::string(stored_crc32c) == "AAAAAA==") {
+      ASSERT_EQ(stream, nullptr);
+      continue;
+    }
+    ASSERT_NE(stream, nullptr);
+    std::array<char, 9> buff{};
+    ASSERT_EQ(driver_fread(buff.data(), 1, buff.size(), stream), 9);
+    ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+  }
+}
+
+TEST_F(GCSDriverTestFixture, Copy_RewritesObject) {
+  using gcs::internal::RewriteObjectRequest;
+  using gcs::internal::RewriteObjectResponse;
+
+  ASSERT_EQ(driver_copy(nullptr, "gs://mock_bucket/copy_dest"), kFailure);
+  ASSERT_EQ(driver_copy("gs://mock_bucket/copy_source", nullptr), kFailure);
+
+  PrepareGetObjectMetadata(
+      MakeObjectMetadata("mock_bucket", "copy_source", 2, 10));
+
+  // the storage completes the rewrite in two requests
+  RewriteObjectResponse partial;
+  partial.total_bytes_rewritten = 5;
+  partial.object_size = 10;
+  partial.done = false;
+  partial.rewrite_token = "mock_token";
+  RewriteObjectResponse done;
+  done.total_bytes_rewritten = 10;
+  done.object_size = 10;
+  done.done = true;
+  done.resource = MakeObjectMetadata("other_bucket", "copy_dest", 1, 10);
+
+  EXPECT_CALL(*mock_client, RewriteObject)
+      .WillOnce([&](RewriteObjectRequest const &request) {
+        EXPECT_EQ(request.source_bucket(), "mock_bucket");
+        EXPECT_EQ(request.source_object(), "copy_source");
+        EXPECT_EQ(request.destination_bucket(), "other_bucket");
+        EXPECT_EQ(request.destination_object(), "copy_dest");
+        EXPECT_EQ(request.GetOption<gcs::SourceGeneration>().value(), 2);
+        EXPECT_TRUE(request.rewrite_token().empty());
+        return gc::make_status_or(partial);
+      })
+      .WillOnce([&](RewriteObjectRequest const &request) {
+        EXPECT_EQ(request.rewrite_token(), "mock_token");
+        return gc::make_status_or(done);
+      });
+  EXPECT_CALL(*mock_client, DeleteObject).Times(0);
+
+  ASSERT_EQ(driver_copy("gs://mock_bucket/copy_source",
+                        "gs://other_bucket/copy_dest"),
+            kSuccess);
+}
+
+TEST_F(GCSDriverTestFixture, Copy_RelaysCompressedParts) {
+  using gcs::internal::CreateResumableUploadRequest;
+  using gcs::internal::CreateResumableUploadResponse;
+  using gcs::internal::QueryResumableUploadResponse;
+  using gcs::internal::UploadChunkRequest;
+
+  // compressed parts sharing a header are decoded to be copied
+  const std::string header{"mock_header\n"};
+  const std::vector<std::string> names{"export_0.csv.gz", "export_1.csv.gz"};
+  std::map<std::string, std::string> parts;
+  std::string expected{header};
+  for (size_t i = 0; i < names.size(); i++) {
+    std::string body;
+    for (int j = 0; j < 3000; j++) {
+      body += std::to_string((j + 1000 * static_cast<int>(i)) * 7919 % 10007) +
+              (j % 10 == 9 ? '\n' : ' ');
+    }
+    parts[names[i]] = GzipCompress(header + body);
+    expected += body;
+  }
+  std::map<std::string, decltype(ServeContent(""))> serve;
+  for (const auto &part : parts) {
+    serve[part.first] = ServeContent(part.second);
+  }
+
+  std::string uploaded;
+  std::string encoding;
+  EXPECT_CALL(*mock_client, CreateResumableUpload)
+      .WillRepeatedly([&](CreateResumableUploadRequest const &request) {
+        const auto option = request.GetOption<gcs::ContentEncoding>();
+        encoding = option.has_value() ? option.value() : "";
+        return gc::make_status_or(
+            CreateResumableUploadResponse{"mock_upload_id"});
+      });
+  EXPECT_CALL(*mock_client, UploadChunk)
+      .WillRepeatedly([&](UploadChunkRequest const &request) {
+        for (auto const &buffer : request.payload()) {
+          uploaded.append(buffer.data(), buffer.size());
+        }
+        QueryResumableUploadResponse response;
+        response.committed_size = request.offset() + request.payload_size();
+        if (request.last_chunk()) {
+          response.payload =
+              MakeObjectMetadata(mock_bucket, "copy_dest", 1, uploaded.size());
+        }
+        return gc::make_status_or(response);
+      });
+  EXPECT_CALL(*mock_client, DeleteObject).Times(0);
+
+  // the copy is compressed again, with the Content-Encoding telling it when
+  // the name does not
+  for (const char *dest : {"all.csv.gz", "all_csv"}) {
+    uploaded.clear();
+    encoding.clear();
+    PrepareListObjects(MakeLOR(mock_bucket, names,
+                               {parts[names[0]].size(), parts[names[1]].size()}));
+    EXPECT_CALL(*mock_client, ReadObject)
+        .WillRepeatedly(
+            [&](gcs::internal::ReadObjectRangeRequest const &request) {
+              return serve.at(request.object_name())(request);
+            });
+    ASSERT_EQ(driver_copy("gs://mock_bucket/export_*.csv.gz",
+                          (std::string("gs://mock_bucket/") + dest).c_str()),
+              kSuccess)
+        << dest;
+    ASSERT_EQ(GzipDecompress(uploaded), expected) << dest;
+    ASSERT_EQ(encoding, std::string(dest) == "all_csv" ? "gzip" : "") << dest;
+
+    // read back through the driver
+    const auto meta = MakeObjectMetadata(mock_bucket, dest, 1, uploaded.size())
+                          .set_content_encoding(encoding);
+    EXPECT_CALL(*mock_client, GetObjectMetadata)
+        .WillRepeatedly(Return(gc::make_status_or(meta)));
+    EXPECT_CALL(*mock_client, ReadObject)
+        .WillRepeatedly(ServeContent(uploaded));
+    void *reader =
+        driver_fopen((std::string("gs://mock_bucket/") + dest).c_str(), 'r');
+    ASSERT_NE(reader, nullptr) << dest;
+    std::vector<char> buff(expected.size());
+    ASSERT_EQ(driver_fread(buff.data(), 1, buff.size(), reader),
+              static_cast<long long>(expected.size()))
+        << dest;
+    ASSERT_EQ(std::string(buff.begin(), buff.end()), expected) << dest;
+    ASSERT_EQ(driver_fclose(reader), kCloseSuccess);
+  }
+}
+
+TEST_F(GCSDriverTestFixture, Rename_DeletesCopiedSource) {
+  using gcs::internal::DeleteObjectRequest;
+  using gcs::internal::EmptyResponse;
+  using gcs::internal::RewriteObjectResponse;
+
+  PrepareGetObjectMetadata(
+      MakeObjectMetadata("mock_bucket", "rename_source", 4, 10));
+
+  RewriteObjectResponse done;
+  done.total_bytes_rewritten = 10;
+  done.object_size = 10;
+  done.done = true;
+  done.resource = MakeObjectMetadata("mock_bucket", "rename_dest", 1, 10);
+  EXPECT_CALL(*mock_client, RewriteObject)
+      .WillOnce(Return(gc::make_status_or(done)));
+
+  // the source is deleted only at the copied generation, an object already
+  // gone counts as deleted
+  EXPECT_CALL(*mock_client, DeleteObject)
+      .WillOnce([](DeleteObjectRequest const &request)
+                    -> gc::StatusOr<EmptyResponse> {
+        EXPECT_EQ(request.object_name(), "rename_source");
+        EXPECT_EQ(request.GetOption<gcs::IfGenerationMatch>().value(), 4);
+        return gc::Status{gc::StatusCode::kNotFound, "not found"};
+      });
+
+  ASSERT_EQ(driver_rename("gs://mock_bucket/rename_source",
+                          "gs://mock_bucket/rename_dest"),
+            kSuccess);
+}
+
+TEST_F(GCSDriverTestFixture, Rename_AttemptsEveryDelete) {
+  using gcs::internal::DeleteObjectRequest;
+  using gcs::internal::EmptyResponse;
+
+  const std::string part_1{"part_1\n"};
+  const std::string part_2{"part_2\n"};
+  size_t offset_1{0};
+  size_t offset_2{0};
+  ReadSimulatorParams read_1{part_1.data(), part_1.size(), &offset_1};
+  ReadSimulatorParams read_2{part_2.data(), part_2.size(), &offset_2};
+
+  PrepareListObjects(MakeLOR(mock_bucket, {"rename_part_0", "rename_part_1"},
+                             {part_1.size(), part_2.size()}));
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillOnce(READ_MOCK_LAMBDA(GenerateReadSimulator(read_1)))
+      .WillOnce(READ_MOCK_LAMBDA(GenerateReadSimulator(read_2)));
+
+  // the parts without a common header are composed into the destination
+  EXPECT_CALL(*mock_client, ComposeObject)
+      .WillOnce(Return(gc::make_status_or(
+          MakeObjectMetadata("mock_bucket", "rename_multi", 1, 14))));
+
+  // a failed delete does not stop the other ones
+  EXPECT_CALL(*mock_client, DeleteObject)
+      .Times(2)
+      .WillRepeatedly([](DeleteObjectRequest const &request)
+                          -> gc::StatusOr<EmptyResponse> {
+        if (request.object_name() == "rename_part_0") {
+          return gc::Status{gc::StatusCode::kPermissionDenied, "denied"};
+        }
+        return EmptyResponse{};
+      });
+
+  ASSERT_EQ(driver_rename("gs://mock_bucket/rename_part_*",
+                          "gs://mock_bucket/rename_multi"),
+            kFailure);
+}
+
+TEST_F(GCSDriverTestFixture, Remove_GlobPattern) {
+  using gcs::internal::DeleteObjectRequest;
+  using gcs::internal::EmptyResponse;
+
+  ASSERT_EQ(driver_remove(nullptr), kFailure);
+
+  PrepareListObjects(MakeLOR(mock_bucket,
+                             {"remove_part_0", "remove_part_1", "remove_part_2"},
+                             {10, 10, 10}));
+
+  // no object has the exact name, every matching object is deleted, one
+  // already gone counts as deleted
+  std::mutex deleted_mutex;
+  std::set<std::string> deleted;
+  EXPECT_CALL(*mock_client, DeleteObject)
+      .Times(4)
+      .WillRepeatedly([&](DeleteObjectRequest const &request)
+                          -> gc::StatusOr<EmptyResponse> {
+        std::lock_guard<std::mutex> lock{deleted_mutex};
+        deleted.insert(request.object_name());
+        if (request.object_name() == "remove_part_*" ||
+            request.object_name() == "remove_part_1") {
+          return gc::Status{gc::StatusCode::kNotFound, "not found"};
+        }
+        return EmptyResponse{};
+      });
+
+  ASSERT_EQ(driver_remove("gs://mock_bucket/remove_part_*"), kSuccess);
+  ASSERT_EQ(deleted, (std::set<std::string>{"remove_part_*", "remove_part_0",
+                                            "remove_part_1", "remove_part_2"}));
+}
+
+TEST_F(GCSDriverTestFixture, Remove_GlobPatternNoMatch) {
+  using gcs::internal::DeleteObjectRequest;
+  using gcs::internal::EmptyResponse;
+
+  PrepareListObjects(MakeLOR(mock_bucket, {}, {}));
+  EXPECT_CALL(*mock_client, DeleteObject)
+      .WillOnce([](DeleteObjectRequest const &request)
+                    -> gc::StatusOr<EmptyResponse> {
+        EXPECT_EQ(request.object_name(), "remove_none_*");
+        return gc::Status{gc::StatusCode::kNotFound, "not found"};
+      });
+
+  ASSERT_EQ(driver_remove("gs://mock_bucket/remove_none_*"), kSuccess);
+}
+
+TEST_F(GCSDriverTestFixture, Remove_ExactNameWithGlobCharacters) {
+  using gcs::internal::DeleteObjectRequest;
+  using gcs::internal::EmptyResponse;
+
+  // an object named with glob characters is removed alone, not the objects
+  // the pattern would match, as "run1.csv"
+  EXPECT_CALL(*mock_client, ListObjects).Times(0);
+  EXPECT_CALL(*mock_client, DeleteObject)
+      .WillOnce([](DeleteObjectRequest const &request)
+                    -> gc::StatusOr<EmptyResponse> {
+        EXPECT_EQ(request.object_name(), "run[1].csv");
+        return EmptyResponse{};
+      });
+
+  ASSERT_EQ(driver_remove("gs://mock_bucket/run[1].csv"), kSuccess);
+
+  // an error other than a missing object is not taken for a pattern
+  EXPECT_CALL(*mock_client, DeleteObject)
+      .WillOnce(Return(gc::Status{gc::StatusCode::kPermissionDenied, "denied"}));
+
+  ASSERT_EQ(driver_remove("gs://mock_bucket/run[2].csv"), kFailure);
+}
+
+TEST_F(GCSDriverTestFixture, RmDir) {
+  using gcs::internal::DeleteObjectRequest;
+  using gcs::internal::EmptyResponse;
+  using gcs::internal::ListObjectsRequest;
+
+  CheckInvalidURIs(driver_rmdir, kFailure);
+
+  // the root of a bucket is never removed
+  EXPECT_CALL(*mock_client, ListObjects).Times(0);
+  ASSERT_EQ(driver_rmdir("gs://mock_bucket/"), kFailure);
+  ::testing::Mock::VerifyAndClearExpectations(mock_client.get());
+
+  // the directory is the prefix of its content
+  EXPECT_CALL(*mock_client, ListObjects)
+      .WillOnce([](ListObjectsRequest const &request) -> LOReturnType {
+        EXPECT_EQ(request.GetOption<gcs::Prefix>().value(), "rmdir_dir/");
+        return MakeLOR(mock_bucket, {"rmdir_dir/a", "rmdir_dir/sub/b"},
+                       {1, 1});
+      });
+  EXPECT_CALL(*mock_client, DeleteObject)
+      .Times(2)
+      .WillRepeatedly([](DeleteObjectRequest const &request)
+                          -> gc::StatusOr<EmptyResponse> {
+        if (request.object_name() == "rmdir_dir/sub/b") {
+          return gc::Status{gc::StatusCode::kPermissionDenied, "denied"};
+        }
+        return EmptyResponse{};
+      });
+
+  // a failed delete fails the removal, after the other deletes
+  ASSERT_EQ(driver_rmdir("gs://mock_bucket/rmdir_dir"), kFailure);
+}
+
+#ifndef _WIN32
+// Setting of environment variables does not work on Windows
+TEST_F(GCSDriverTestFixture, DiskCache_ServesStagedReads) {
+  char dir_template[] = "/tmp/gcs-disk-cache-XXXXXX";
+  const char *dir = mkdtemp(dir_template);
+  ASSERT_NE(dir, nullptr);
+
+  auto env = boost::this_process::environment();
+  env["GCS_DISK_CACHE_DIR"] = dir;
+  ASSERT_EQ(driver_connect(), kSuccess);
+  env.erase("GCS_DISK_CACHE_DIR");
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+
+  const std::string content{"staged_header\nstaged_content"};
+  size_t offset{0};
+  ReadSimulatorParams read_params{content.data(), content.size(), &offset};
+
+  // the object is looked up by the warm and the open, and downloaded once,
+  // when staged
+  EXPECT_CALL(*mock_client, GetObjectMetadata)
+      .Times(2)
+      .WillRepeatedly(Return<OMReturnType>(
+          MakeObjectMetadata("mock_bucket", "staged_file", 7,
+                             static_cast<uint64_t>(content.size()))));
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillOnce(READ_MOCK_LAMBDA(GenerateReadSimulator(read_params)));
+
+  const char *uri = "gs://mock_bucket/staged_file";
+  ASSERT_EQ(driver_warmDiskCache(uri), kSuccess);
+
+  void *stream = OpenReadOnly(uri);
+  ASSERT_NE(stream, nullptr);
+  std::array<char, 32> buff{};
+  for (int i = 0; i < 2; i++) {
+    ASSERT_EQ(driver_fseek(stream, 7, std::ios::beg), 0);
+    ASSERT_EQ(driver_fread(buff.data(), 1, 7, stream), 7);
+    ASSERT_EQ(std::string(buff.data(), 7), content.substr(7, 7));
+    ASSERT_EQ(driver_fread(buff.data(), 1, buff.size(), stream),
+              static_cast<long long>(content.size() - 14));
+    ASSERT_EQ(std::string(buff.data(), content.size() - 14),
+              content.substr(14));
+  }
+  ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+
+  // back to the configuration without disk cache
+  ASSERT_EQ(driver_disconnect(), kSuccess);
+  ASSERT_EQ(driver_connect(), kSuccess);
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+
+  DIR *dir_stream = opendir(dir);
+  ASSERT_NE(dir_stream, nullptr);
+  while (const dirent *entry = readdir(dir_stream)) {
+    const std::string name{entry->d_name};
+    if (name != "." && name != "..") {
+      std::remove((std::string(dir) + '/' + name).c_str());
+    }
+  }
+  closedir(dir_stream);
+  rmdir(dir);
+}
+#endif
+
+#ifndef _WIN32
+// Setting of environment variables does not work on Windows
+TEST_F(GCSDriverTestFixture, ListObjects_SplitsOverWorkers) {
+  using gcs::internal::ListObjectsRequest;
+
+  auto env = boost::this_process::environment();
+  env["GCS_DRIVER_THREADS"] = "4";
+
+  // a bucket of more shards than a page lists, served by ranges of names
+  std::vector<std::string> shards;
+  for (int i = 0; i < 2500; i++) {
+    std::ostringstream name;
+    name << "shard_" << std::setw(5) << std::setfill('0') << i;
+    shards.push_back(name.str());
+  }
+  std::mutex mutex;
+  std::set<std::string> start_offsets;
+  EXPECT_CALL(*mock_client, ListObjects)
+      .WillRepeatedly([&](ListObjectsRequest const &request) -> LOReturnType {
+        const auto start_offset = request.GetOption<gcs::StartOffset>();
+        const auto end_offset = request.GetOption<gcs::EndOffset>();
+        const std::string start =
+            start_offset.has_value() ? start_offset.value() : "";
+        const std::string end = end_offset.has_value() ? end_offset.value() : "";
+        const size_t page_size = static_cast<size_t>(
+            request.GetOption<gcs::MaxResults>().value());
+        {
+          std::lock_guard<std::mutex> lock{mutex};
+          start_offsets.insert(start);
+        }
+
+        std::vector<std::string> names;
+        std::copy_if(shards.begin(), shards.end(), std::back_inserter(names),
+                     [&](const std::string &name) {
+                       return name >= start && (end.empty() || name < end);
+                     });
+        const size_t first = request.page_token().empty()
+                                 ? 0
+                                 : std::stoul(request.page_token());
+        const size_t last = std::min(names.size(), first + page_size);
+        gcs::internal::ListObjectsResponse response;
+        for (size_t i = first; i < last; i++) {
+          response.items.push_back(
+              MakeObjectMetadata(mock_bucket, names[i], 1, 10));
+        }
+        if (last < names.size()) {
+          response.next_page_token = std::to_string(last);
+        }
+        return response;
+      });
+
+  // the parts share their header, counted once in the size of the multifile:
+  // the ranges are disjoint and cover the whole listing
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillRepeatedly(ServeContent("header\nabc"));
+  const long long nb_shards = static_cast<long long>(shards.size());
+  ASSERT_EQ(driver_getFileSize("gs://mock_bucket/shard_*"), 3 * nb_shards + 7);
+  env.erase("GCS_DRIVER_THREADS");
+  ASSERT_GT(start_offsets.size(), 1);
+}
+#endif
+
+#ifndef _WIN32
+// Setting of environment variables does not work on Windows
+TEST_F(GCSDriverTestFixture, Read_HedgesSlowRequest) {
+  // the lookups of boost::process overrun on names sharing a prefix
+  setenv("GCS_HEDGE_READS", "1", 1);
+  setenv("GCS_HEDGE_MAX_PERCENT", "100", 1);
+  ASSERT_EQ(driver_connect(), kSuccess);
+  unsetenv("GCS_HEDGE_READS");
+  unsetenv("GCS_HEDGE_MAX_PERCENT");
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+
+  const std::string content{"hedged_header\nhedged_content"};
+  const std::int64_t content_size = static_cast<std::int64_t>(content.size());
+  EXPECT_CALL(*mock_client, GetObjectMetadata)
+      .WillRepeatedly(Return<OMReturnType>(MakeObjectMetadata(
+          "mock_bucket", "hedged_file", 5, content.size())));
+
+  // once stalling, the first request answers late, with bytes that must not
+  // be read
+  std::atomic<bool> stalling{false};
+  std::atomic<int> nb_stalling_requests{0};
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillRepeatedly(
+          [&](gcs::internal::ReadObjectRangeRequest const &request) {
+            const bool stall = stalling && nb_stalling_requests++ == 0;
+            const std::int64_t begin = request.StartingByte();
+            const std::int64_t end =
+                request.HasOption<gcs::ReadRange>()
+                    ? std::min(request.GetOption<gcs::ReadRange>().value().end,
+                               content_size)
+                    : content_size;
+            std::string served = content.substr(
+                static_cast<size_t>(begin), static_cast<size_t>(end - begin));
+            if (stall) {
+              served.assign(served.size(), 'X');
+            }
+
+            // the first byte is read apart from the others by the hedged
+            // requests
+            std::unique_ptr<gcs::testing::MockObjectReadSource> mock_source{
+                new gcs::testing::MockObjectReadSource};
+            auto offset = std::make_shared<size_t>(0);
+            EXPECT_CALL(*mock_source, IsOpen()).WillRepeatedly([=]() {
+              return *offset < served.size();
+            });
+            EXPECT_CALL(*mock_source, Read)
+                .WillRepeatedly([=](void *buf, size_t n) {
+                  if (stall && *offset == 0) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+                  }
+                  const size_t l = std::min(n, served.size() - *offset);
+                  std::memcpy(buf, served.data() + *offset, l);
+                  *offset += l;
+                  return gcs::internal::ReadSourceResult{
+                      l, gcs::internal::HttpResponse{200, {}, {}}};
+                });
+            return gc::make_status_or<
+                std::unique_ptr<gcs::internal::ObjectReadSource>>(
+                std::move(mock_source));
+          });
+
+  auto read_file = [&]() {
+    void *stream = driver_fopen("gs://mock_bucket/hedged_file", 'r');
+    ASSERT_NE(stream, nullptr);
+    std::array<char, 64> buff{};
+    ASSERT_EQ(driver_fread(buff.data(), 1, buff.size(), stream),
+              content_size);
+    ASSERT_EQ(std::string(buff.data(), content.size()), content);
+    ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+  };
+
+  // the times to first byte of the first reads give the hedging delay
+  for (int i = 0; i < 20; i++) {
+    read_file();
+  }
+
+  stalling = true;
+  read_file();
+  ASSERT_EQ(nb_stalling_requests, 2);
+
+  // back to the configuration without hedging, once the hedge is over
+  ASSERT_EQ(driver_disconnect(), kSuccess);
+  ASSERT_EQ(driver_connect(), kSuccess);
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+}
+#endif
+
+TEST_F(GCSDriverTestFixture, Open_PrefetchesFirstBlockInBackground) {
+  const std::map<std::string, std::string> contents{
+      {"prefetched_part_0", "prefetched_header\nfirst"},
+      {"prefetched_part_1", "prefetched_header\nsecond"}};
+  const std::string expected{"prefetched_header\nfirstsecond"};
+  PrepareListObjects(MakeLOR("mock_bucket",
+                             {"prefetched_part_0", "prefetched_part_1"},
+                             {contents.at("prefetched_part_0").size(),
+                              contents.at("prefetched_part_1").size()}));
+
+  // the requests of the first part are held until the stream is open
+  std::promise<void> opened;
+  std::shared_future<void> opened_future = opened.get_future().share();
+  std::mutex requests_mutex;
+  std::map<std::string, int> nb_requests;
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillRepeatedly([&](gcs::internal::ReadObjectRangeRequest const
+                              &request) {
+        {
+          std::lock_guard<std::mutex> lock{requests_mutex};
+          nb_requests[request.object_name()]++;
+        }
+        const std::string &content = contents.at(request.object_name());
+        const std::int64_t size = static_cast<std::int64_t>(content.size());
+        const std::int64_t begin = request.StartingByte();
+        const std::int64_t end =
+            request.HasOption<gcs::ReadRange>()
+                ? std::min(request.GetOption<gcs::ReadRange>().value().end,
+                           size)
+                : size;
+        const std::string served = content.substr(
+            static_cast<size_t>(begin), static_cast<size_t>(end - begin));
+        const bool held = request.object_name() == "prefetched_part_0";
+
+        std::unique_ptr<gcs::testing::MockObjectReadSource> mock_source{
+            new gcs::testing::MockObjectReadSource};
+        auto offset = std::make_shared<size_t>(0);
+        EXPECT_CALL(*mock_source, IsOpen()).WillRepeatedly([=]() {
+          return *offset < served.size();
+        });
+        EXPECT_CALL(*mock_source, Read)
+            .WillRepeatedly([=](void *buf, size_t n) {
+              if (held) {
+                opened_future.wait_for(std::chrono::seconds(5));
+              }
+              const size_t l = std::min(n, served.size() - *offset);
+              std::memcpy(buf, served.data() + *offset, l);
+              *offset += l;
+              return gcs::internal::ReadSourceResult{
+                  l, gcs::internal::HttpResponse{200, {}, {}}};
+            });
+        return gc::make_status_or<
+            std::unique_ptr<gcs::internal::ObjectReadSource>>(
+            std::move(mock_source));
+      });
+
+  const auto start = std::chrono::steady_clock::now();
+  void *stream = OpenReadOnly("gs://mock_bucket/prefetched_part_*");
+  ASSERT_NE(stream, nullptr);
+  ASSERT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(4));
+  opened.set_value();
+
+  // the first part is read from the prefetched block
+  std::array<char, 64> buff{};
+  ASSERT_EQ(driver_fread(buff.data(), 1, buff.size(), stream),
+            static_cast<long long>(expected.size()));
+  ASSERT_EQ(std::string(buff.data(), expected.size()), expected);
+  ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+  EXPECT_EQ(nb_requests["prefetched_part_0"], 1);
+  CheckHandlesEmpty();
+}
+
+#ifndef _WIN32
+TEST_F(GCSDriverTestFixture, Read_GzipFile_StartsFromCheckpoints) {
+  setenv("GCS_COMPRESSED_INDEX_SPAN", "65536", 1);
+  ASSERT_EQ(driver_connect(), kSuccess);
+  unsetenv("GCS_COMPRESSED_INDEX_SPAN");
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+
+  // lines of random words, compressed in a single member
+  std::mt19937 generator{42};
+  std::uniform_int_distribution<int> letters{'a', 'z'};
+  std::string content{"indexed_header\n"};
+  while (content.size() < 1024 * 1024) {
+    for (int i = 0; i < 12; i++) {
+      content.push_back(static_cast<char>(letters(generator)));
+    }
+    content.push_back(content.size() % 80 < 13 ? '\n' : ' ');
+  }
+  const std::string compressed = GzipCompress(content);
+  const long long content_size = static_cast<long long>(content.size());
+
+  std::vector<Range> requests;
+  PrepareGetObjectMetadata(MakeObjectMetadata(
+      mock_bucket, "mock_indexed_file.gz", 1, compressed.size()));
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillRepeatedly(ServeContent(compressed, &requests));
+
+  // the index is built while the object is decoded to learn its size
+  void *stream = driver_fopen("gs://mock_bucket/mock_indexed_file.gz", 'r');
+  ASSERT_NE(stream, nullptr);
+  ASSERT_EQ(reinterpret_cast<Handle *>(stream)->GetReader().total_size_,
+            content_size);
+
+  // the reads start from the closest checkpoint, in the middle of the object
+  std::vector<char> buff(1000);
+  for (long long start : {900000LL, 300000LL, 150000LL, 1000LL}) {
+    const size_t nb_requests = requests.size();
+    ASSERT_EQ(driver_fseek(stream, start, std::ios::beg), 0);
+    ASSERT_EQ(driver_fread(buff.data(), 1, 1000, stream), 1000);
+    ASSERT_EQ(std::string(buff.data(), 1000),
+              content.substr(static_cast<size_t>(start), 1000));
+    ASSERT_EQ(requests.size(), nb_requests + 1);
+    // a checkpoint follows each span at the first deflate block boundary
+    if (start >= 2 * 65536) {
+      ASSERT_GT(requests.back().first, 0) << start;
+    } else {
+      ASSERT_EQ(requests.back().first, 0) << start;
+    }
+  }
+  ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+
+  ASSERT_EQ(driver_disconnect(), kSuccess);
+  ASSERT_EQ(driver_connect(), kSuccess);
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+}
+#endif
+
+#ifndef _WIN32
+TEST_F(GCSDriverTestFixture, Read_GzipFile_IndexedWhileReading) {
+  using gcs::internal::CreateResumableUploadResponse;
+  using gcs::internal::QueryResumableUploadResponse;
+  using gcs::internal::UploadChunkRequest;
+
+  setenv("GCS_COMPRESSED_INDEX_SPAN", "65536", 1);
+  ASSERT_EQ(driver_connect(), kSuccess);
+  unsetenv("GCS_COMPRESSED_INDEX_SPAN");
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+
+  // lines of random words, written by the driver in a single member followed
+  // by the size member
+  std::mt19937 generator{42};
+  std::uniform_int_distribution<int> letters{'a', 'z'};
+  std::string content{"indexed_header\n"};
+  while (content.size() < 1024 * 1024) {
+    for (int i = 0; i < 12; i++) {
+      content.push_back(static_cast<char>(letters(generator)));
+    }
+    content.push_back(content.size() % 80 < 13 ? '\n' : ' ');
+  }
+  const long long content_size = static_cast<long long>(content.size());
+
+  std::string compressed;
+  EXPECT_CALL(*mock_client, CreateResumableUpload)
+      .WillOnce(Return(CreateResumableUploadResponse{"mock_upload_id"}));
+  EXPECT_CALL(*mock_client, UploadChunk)
+      .WillRepeatedly([&](UploadChunkRequest const &request) {
+        for (auto const &buffer : request.payload()) {
+          compressed.append(buffer.data(), buffer.size());
+        }
+        QueryResumableUploadResponse response;
+        response.committed_size = request.offset() + request.payload_size();
+        if (request.last_chunk()) {
+          response.payload = MakeObjectMetadata(
+              mock_bucket, "mock_indexed_file.gz", 1, compressed.size());
+        }
+        return gc::make_status_or(response);
+      });
+  void *writer = driver_fopen("gs://mock_bucket/mock_indexed_file.gz", 'w');
+  ASSERT_NE(writer, nullptr);
+  ASSERT_EQ(driver_fwrite(content.data(), 1, content.size(), writer),
+            content_size);
+  ASSERT_EQ(driver_fclose(writer), kCloseSuccess);
+
+  std::vector<Range> requests;
+  PrepareGetObjectMetadata(MakeObjectMetadata(
+      mock_bucket, "mock_indexed_file.gz", 1, compressed.size()));
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillRepeatedly(ServeContent(compressed, &requests));
+
+  // the size is read from the size member, the object is not decoded
+  void *stream = driver_fopen("gs://mock_bucket/mock_indexed_file.gz", 'r');
+  ASSERT_NE(stream, nullptr);
+  ASSERT_EQ(reinterpret_cast<Handle *>(stream)->GetReader().total_size_,
+            content_size);
+
+  // the reads forward record the checkpoints they pass, the later ones
+  // starting from those recorded by the previous ones
+  std::vector<char> buff(100000);
+  for (long long start : {200000LL, 600000LL, 900000LL}) {
+    const size_t nb_requests = requests.size();
+    ASSERT_EQ(driver_fseek(stream, start, std::ios::beg), 0);
+    ASSERT_EQ(driver_fread(buff.data(), 1, 1000, stream), 1000);
+    ASSERT_EQ(std::string(buff.data(), 1000),
+              content.substr(static_cast<size_t>(start), 1000));
+    ASSERT_EQ(requests.size(), nb_requests + 1);
+    if (start > 200000) {
+      ASSERT_GT(requests.back().first, 0) << start;
+    }
+  }
+
+  // up to the end of the object
+  ASSERT_EQ(driver_fseek(stream, 0, std::ios::beg), 0);
+  long long offset{0};
+  while (offset < content_size) {
+    const long long read = driver_fread(buff.data(), 1, buff.size(), stream);
+    ASSERT_GT(read, 0);
+    ASSERT_EQ(std::string(buff.data(), static_cast<size_t>(read)),
+              content.substr(static_cast<size_t>(offset),
+                             static_cast<size_t>(read)));
+    offset += read;
+  }
+
+  // the reads that follow start from them, in the middle of the object
+  for (long long start : {900000LL, 300000LL, 150000LL, 1000LL}) {
+    const size_t nb_requests = requests.size();
+    ASSERT_EQ(driver_fseek(stream, start, std::ios::beg), 0);
+    ASSERT_EQ(driver_fread(buff.data(), 1, 1000, stream), 1000);
+    ASSERT_EQ(std::string(buff.data(), 1000),
+              content.substr(static_cast<size_t>(start), 1000));
+    ASSERT_EQ(requests.size(), nb_requests + 1);
+    // a checkpoint follows each span at the first deflate block boundary
+    if (start >= 2 * 65536) {
+      ASSERT_GT(requests.back().first, 0) << start;
+    } else {
+      ASSERT_EQ(requests.back().first, 0) << start;
+    }
+  }
+  ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+
+  ASSERT_EQ(driver_disconnect(), kSuccess);
+  ASSERT_EQ(driver_connect(), kSuccess);
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+}
+#endif
+
+#ifndef _WIN32
+TEST_F(GCSDriverTestFixture, Read_ResumesStalledDownload) {
+  setenv("GCS_STALL_TIMEOUT", "7", 1);
+  setenv("GCS_STALL_MIN_RATE", "2048", 1);
+  ASSERT_EQ(driver_connect(), kSuccess);
+  unsetenv("GCS_STALL_TIMEOUT");
+  unsetenv("GCS_STALL_MIN_RATE");
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+
+  std::string content(2 * 1024 * 1024, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = static_cast<char>('a' + i % 19);
+  }
+  const long long content_size = static_cast<long long>(content.size());
+  constexpr size_t stall_offset{1024 * 1024};
+
+  // the requests carry the stall detection of the library, which aborts the
+  // first one after some bytes, the next one resumes at the first missing byte
+  PrepareGetObjectMetadata(MakeObjectMetadata(mock_bucket, "mock_stalled_file",
+                                              3, content.size()));
+  std::vector<Range> requests;
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillRepeatedly([&](gcs::internal::ReadObjectRangeRequest const
+                              &request) {
+        const auto &options = gc::internal::CurrentOptions();
+        EXPECT_TRUE(options.has<gcs::DownloadStallTimeoutOption>());
+        EXPECT_TRUE(options.has<gcs::DownloadStallMinimumRateOption>());
+        if (options.has<gcs::DownloadStallTimeoutOption>()) {
+          EXPECT_EQ(options.get<gcs::DownloadStallTimeoutOption>(),
+                    std::chrono::seconds(7));
+        }
+        if (options.has<gcs::DownloadStallMinimumRateOption>()) {
+          EXPECT_EQ(options.get<gcs::DownloadStallMinimumRateOption>(), 2048u);
+        }
+
+        const std::int64_t begin = request.StartingByte();
+        const std::int64_t end =
+            request.HasOption<gcs::ReadRange>()
+                ? std::min(request.GetOption<gcs::ReadRange>().value().end,
+                           static_cast<std::int64_t>(content_size))
+                : content_size;
+        const bool stalls = requests.empty();
+        requests.emplace_back(begin, end);
+        const std::string served = content.substr(
+            static_cast<size_t>(begin), static_cast<size_t>(end - begin));
+
+        std::unique_ptr<gcs::testing::MockObjectReadSource> mock_source{
+            new gcs::testing::MockObjectReadSource};
+        auto offset = std::make_shared<size_t>(0);
+        EXPECT_CALL(*mock_source, IsOpen()).WillRepeatedly([=]() {
+          return *offset < served.size();
+        });
+        EXPECT_CALL(*mock_source, Read)
+            .WillRepeatedly([=](void *buf, size_t n)
+                                -> gc::StatusOr<gcs::internal::ReadSourceResult> {
+              if (stalls && *offset >= stall_offset) {
+                return gc::Status{gc::StatusCode::kDeadlineExceeded,
+                                  "Transfer stalled"};
+              }
+              const size_t l = std::min(n, served.size() - *offset);
+              std::memcpy(buf, served.data() + *offset, l);
+              *offset += l;
+              return gcs::internal::ReadSourceResult{
+                  l, gcs::internal::HttpResponse{200, {}, {}}};
+            });
+        return gc::make_status_or<
+            std::unique_ptr<gcs::internal::ObjectReadSource>>(
+            std::move(mock_source));
+      });
+
+  void *stream = driver_fopen("gs://mock_bucket/mock_stalled_file", 'r');
+  ASSERT_NE(stream, nullptr);
+  std::vector<char> buff(content.size());
+  ASSERT_EQ(driver_fread(buff.data(), 1, buff.size(), stream), content_size);
+  ASSERT_TRUE(std::equal(buff.begin(), buff.end(), content.begin()));
+  ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+
+  ASSERT_EQ(requests.size(), 2u);
+  ASSERT_EQ(requests[1].first, static_cast<std::int64_t>(stall_offset));
+  ASSERT_EQ(requests[1].second, requests[0].second);
+
+  ASSERT_EQ(driver_disconnect(), kSuccess);
+  ASSERT_EQ(driver_connect(), kSuccess);
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+}
+#endif
+
+#ifndef _WIN32
+TEST_F(GCSDriverTestFixture, SharedCache_ServesOtherInstances) {
+  const std::string cache_name{"/gcs-driver-test-" +
+                               std::to_string(getpid())};
+  setenv("GCS_SHARED_CACHE_SIZE", "4194304", 1);
+  setenv("GCS_SHARED_CACHE_BLOCK_SIZE", "262144", 1);
+  setenv("GCS_SHARED_CACHE_NAME", cache_name.c_str(), 1);
+  ASSERT_EQ(driver_connect(), kSuccess);
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+
+  std::string content(2 * 1024 * 1024, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = static_cast<char>('a' + i % 13);
+  }
+  const long long content_size = static_cast<long long>(content.size());
+  EXPECT_CALL(*mock_client, GetObjectMetadata)
+      .WillRepeatedly(Return<OMReturnType>(MakeObjectMetadata(
+          "mock_bucket", "shared_cached_file", 8, content.size())));
+  std::vector<Range> requests;
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillRepeatedly(ServeContent(content, &requests));
+
+  auto read_file = [&]() {
+    void *stream = driver_fopen("gs://mock_bucket/shared_cached_file", 'r');
+    ASSERT_NE(stream, nullptr);
+    std::vector<char> buff(content.size());
+    ASSERT_EQ(driver_fread(buff.data(), 1, buff.size(), stream), content_size);
+    ASSERT_TRUE(std::equal(buff.begin(), buff.end(), content.begin()));
+    ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+  };
+  read_file();
+  ASSERT_FALSE(requests.empty());
+
+  // another instance attaches to the segment and reads the blocks from it
+  ASSERT_EQ(driver_disconnect(), kSuccess);
+  ASSERT_EQ(driver_connect(), kSuccess);
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+  requests.clear();
+  read_file();
+  ASSERT_TRUE(requests.empty());
+
+  unsetenv("GCS_SHARED_CACHE_SIZE");
+  unsetenv("GCS_SHARED_CACHE_BLOCK_SIZE");
+  unsetenv("GCS_SHARED_CACHE_NAME");
+  ASSERT_EQ(driver_disconnect(), kSuccess);
+  shm_unlink(cache_name.c_str());
+  ASSERT_EQ(driver_connect(), kSuccess);
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+}
+#endif
+
+#ifndef _WIN32
+TEST_F(GCSDriverTestFixture, Read_GrowsRequestsOfSequentialReads) {
+  setenv("GCS_PREFETCH_SIZE", "0", 1);
+  setenv("GCS_READ_AHEAD_MIN_SIZE", "65536", 1);
+  setenv("GCS_READ_AHEAD_MAX_SIZE", "262144", 1);
+  ASSERT_EQ(driver_connect(), kSuccess);
+  unsetenv("GCS_PREFETCH_SIZE");
+  unsetenv("GCS_READ_AHEAD_MIN_SIZE");
+  unsetenv("GCS_READ_AHEAD_MAX_SIZE");
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+
+  std::string content(4 * 1024 * 1024, '\0');
+  for (size_t i = 0; i < content.size(); i++) {
+    content[i] = static_cast<char>('a' + i % 11);
+  }
+  PrepareGetObjectMetadata(MakeObjectMetadata(
+      mock_bucket, "read_ahead_file", 2, content.size()));
+
+  // each request takes the same time, the larger ones are faster
+  std::vector<Range> requests;
+  auto serve = ServeContent(content, &requests);
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillRepeatedly(
+          [&](gcs::internal::ReadObjectRangeRequest const &request) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            return serve(request);
+          });
+
+  void *stream = driver_fopen("gs://mock_bucket/read_ahead_file", 'r');
+  ASSERT_NE(stream, nullptr);
+  constexpr long long read_size{16 * 1024};
+  std::vector<char> buff(read_size);
+  auto read_at = [&](long long offset) {
+    ASSERT_EQ(driver_fread(buff.data(), 1, buff.size(), stream), read_size);
+    ASSERT_TRUE(std::equal(buff.begin(), buff.end(),
+                           content.begin() + static_cast<size_t>(offset)));
+  };
+
+  // from the third read in a row, the requests double while they get faster,
+  // and the next reads are served by the bytes they fetched ahead
+  long long offset{0};
+  for (; offset < 1024 * 1024; offset += read_size) {
+    read_at(offset);
+  }
+  const std::vector<std::int64_t> expected_sizes{
+      read_size, read_size, 64 * 1024, 128 * 1024, 256 * 1024};
+  ASSERT_GT(requests.size(), expected_sizes.size());
+  for (size_t i = 0; i < requests.size(); i++) {
+    const std::int64_t size = requests[i].second - requests[i].first;
+    ASSERT_EQ(size, i < expected_sizes.size() ? expected_sizes[i] : 256 * 1024)
+        << i;
+  }
+  for (size_t i = 1; i < requests.size(); i++) {
+    ASSERT_EQ(requests[i].first, requests[i - 1].second) << i;
+  }
+
+  // a read away from the previous one drops the bytes ahead, and the reads
+  // start again by requests of their size
+  requests.clear();
+  offset = 3 * 1024 * 1024;
+  ASSERT_EQ(driver_fseek(stream, offset, std::ios::beg), 0);
+  read_at(offset);
+  read_at(offset + read_size);
+  read_at(offset + 2 * read_size);
+  ASSERT_EQ(requests.size(), 3u);
+  ASSERT_EQ(requests[0], Range(offset, offset + read_size));
+  ASSERT_EQ(requests[1].second - requests[1].first, read_size);
+  ASSERT_EQ(requests[2].second - requests[2].first, 128 * 1024);
+  ASSERT_EQ(driver_fclose(stream), kCloseSuccess);
+
+  ASSERT_EQ(driver_disconnect(), kSuccess);
+  ASSERT_EQ(driver_connect(), kSuccess);
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+}
+#endif
+
+#ifndef _WIN32
+TEST_F(GCSDriverTestFixture, MemoryBudget_DeclinesBuffering) {
+  setenv("GCS_MEMORY_BUDGET", "716800", 1);
+  ASSERT_EQ(driver_connect(), kSuccess);
+  unsetenv("GCS_MEMORY_BUDGET");
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+  const long long reserved_before = test_getReservedMemory();
+
+  std::map<std::string, std::string> objects;
+  for (const auto &object : std::vector<std::pair<std::string, size_t>>{
+           {"budget_small_1", 600000},
+           {"budget_small_2", 200000},
+           {"budget_large", 3 * 1024 * 1024}}) {
+    std::string content(object.second, '\0');
+    for (size_t i = 0; i < content.size(); i++) {
+      content[i] = static_cast<char>('a' + (i + object.first.size()) % 7);
+    }
+    objects[object.first] = content;
+  }
+  std::map<std::string, decltype(ServeContent(""))> serve;
+  std::map<std::string, std::vector<Range>> requests;
+  for (const auto &object : objects) {
+    serve[object.first] =
+        ServeContent(object.second, &requests[object.first]);
+  }
+  EXPECT_CALL(*mock_client, ReadObject)
+      .WillRepeatedly(
+          [&](gcs::internal::ReadObjectRangeRequest const &request) {
+            return serve.at(request.object_name())(request);
+          });
+  auto open = [&](const std::string &name) {
+    PrepareGetObjectMetadata(
+        MakeObjectMetadata(mock_bucket, name, 6, objects[name].size()));
+    return driver_fopen(("gs://mock_bucket/" + name).c_str(), 'r');
+  };
+  auto read = [&](void *stream, const std::string &name, long long offset,
+                  long long size) {
+    std::vector<char> buff(static_cast<size_t>(size));
+    ASSERT_EQ(driver_fread(buff.data(), 1, buff.size(), stream), size);
+    const auto expected = objects[name].begin() + static_cast<size_t>(offset);
+    ASSERT_TRUE(std::equal(buff.begin(), buff.end(), expected));
+  };
+
+  // the first small object fits in the budget and is held in memory, the
+  // second one does not and is read by ranges
+  void *small_1 = open("budget_small_1");
+  ASSERT_NE(small_1, nullptr);
+  ASSERT_NE(reinterpret_cast<Handle *>(small_1)->GetReader().content_,
+            nullptr);
+  ASSERT_EQ(test_getReservedMemory(), reserved_before + 600000);
+
+  void *small_2 = open("budget_small_2");
+  ASSERT_NE(small_2, nullptr);
+  ASSERT_EQ(reinterpret_cast<Handle *>(small_2)->GetReader().content_,
+            nullptr);
+  read(small_2, "budget_small_2", 0, 1000);
+  ASSERT_EQ(requests["budget_small_2"].size(), 1u);
+  ASSERT_EQ(requests["budget_small_2"][0], Range(0, 1000));
+  ASSERT_EQ(driver_fclose(small_2), kCloseSuccess);
+
+  // neither is the first block of a large object prefetched, nor are the
+  // bytes ahead of its sequential reads requested
+  void *large = open("budget_large");
+  ASSERT_NE(large, nullptr);
+  ASSERT_TRUE(
+      reinterpret_cast<Handle *>(large)->GetReader().prefetched_.empty());
+  constexpr long long read_size{16 * 1024};
+  for (long long offset = 0; offset < 4 * read_size; offset += read_size) {
+    read(large, "budget_large", offset, read_size);
+  }
+  const auto &large_requests = requests["budget_large"];
+  ASSERT_EQ(large_requests.size(), 4u);
+  for (const Range &range : large_requests) {
+    ASSERT_EQ(range.second - range.first, read_size);
+  }
+  ASSERT_EQ(test_getReservedMemory(), reserved_before + 600000);
+
+  // they are once the budget is released
+  ASSERT_EQ(driver_fclose(small_1), kCloseSuccess);
+  ASSERT_EQ(test_getReservedMemory(), reserved_before);
+  read(large, "budget_large", 4 * read_size, read_size);
+  ASSERT_EQ(large_requests.size(), 5u);
+  ASSERT_GT(large_requests.back().second - large_requests.back().first,
+            read_size);
+  ASSERT_GT(test_getReservedMemory(), reserved_before);
+  ASSERT_EQ(driver_fclose(large), kCloseSuccess);
+  ASSERT_EQ(test_getReservedMemory(), reserved_before);
+
+  ASSERT_EQ(driver_disconnect(), kSuccess);
+  ASSERT_EQ(driver_connect(), kSuccess);
+  test_setClient(gcs::testing::UndecoratedClientFromMock(mock_client));
+}
+#endif